@@ -0,0 +1,499 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "bank_srv.h"
+#include "synth.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "host/ble_hs.h"
+#include "nimble/nimble_port.h"
+#include "esp_log.h"
+
+#define BANK_SRV_PACKET_SIZE 512
+#define BANK_SRV_SEQ_LEN 2
+#define BANK_SRV_CRC_LEN 4
+#define BANK_SRV_DATA_OVERHEAD (1 + BANK_SRV_SEQ_LEN + BANK_SRV_CRC_LEN)
+#define BANK_SRV_BATCH_LEN 16
+#define BANK_SRV_BATCHES 3
+#define BANK_SRV_STORE_QUEUE_LEN (BANK_SRV_BATCHES + 2)
+#define BANK_SRV_STORE_STACK_SIZE 4096
+#define BANK_SRV_ATT_HEADER_LEN 3
+// after running out of buffers for a notification
+#define BANK_SRV_RETRY_MS 20
+
+// a batch takes the packets between two DATA_ACKs, the host never has more than two of those unacknowledged
+_Static_assert(BANK_SRV_BATCH_LEN >= BANK_SRV_ACK_INTERVAL * ((BANK_SRV_PACKET_SIZE - BANK_SRV_DATA_OVERHEAD) / sizeof(synth_prg_dump_t)), "batch smaller than the packets of one ack");
+
+typedef enum {
+  BANK_MODE_NONE,
+  BANK_MODE_EXPORT,
+  BANK_MODE_IMPORT,
+} bank_mode_t;
+
+// Records for the store task and the reply it sends once they are stored, END carries none
+typedef struct {
+  synth_prg_dump_t* records;
+  uint8_t count;
+  // BANK_SRV_NOP, BANK_SRV_DATA_ACK or BANK_SRV_END
+  uint8_t op;
+  // next expected sequence number for DATA_ACK, programs received for END
+  uint16_t seq;
+  uint16_t import_id;
+  uint16_t conn_handle;
+  bool ok;
+} bank_store_t;
+
+static const char *TAG = "bank_srv";
+
+static const uint16_t* bank_val_handle;
+static bank_mode_t mode;
+
+// every write callback runs on the host task
+static uint8_t packet[BANK_SRV_PACKET_SIZE];
+
+static uint16_t record_count;
+static uint32_t crc;
+static uint16_t next_seq;
+
+// export: packets are rebuilt from the program index when they are sent again
+static uint16_t export_pos;
+static uint16_t packet_records;
+static uint16_t packet_count;
+static uint16_t acked_seq;
+static uint16_t crc_seq;
+// resumes sending when a notification failed, nothing else might come to do it. Fires on the host task.
+static struct ble_npl_callout export_retry;
+static uint16_t export_conn;
+
+// import: records are gathered into batches, stored by the store task so NVS writes never hold up the host task
+static synth_prg_dump_t batches[BANK_SRV_BATCHES][BANK_SRV_BATCH_LEN];
+static QueueHandle_t free_queue;
+static QueueHandle_t store_queue;
+static synth_prg_dump_t* batch;
+static uint8_t batch_count;
+static uint16_t received;
+static uint8_t unacked;
+static bool nak_sent;
+static bool dup_acked;
+static bool overflow;
+// replies of an import the host has given up on are not sent
+static uint16_t import_id;
+// records still queued of an import dropped with its connection are not stored
+static uint16_t discarded_id;
+// import_id << 16 | last DATA_ACK of the store task
+static uint32_t stored_ack;
+
+// store task side
+static uint16_t store_id;
+static esp_err_t store_err;
+
+static inline uint16_t bank_srv_get_u16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t bank_srv_get_u32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void bank_srv_put_u16(uint8_t* p, uint16_t val) {
+  p[0] = val & 0xff;
+  p[1] = val >> 8;
+}
+
+static inline void bank_srv_put_u32(uint8_t* p, uint32_t val) {
+  bank_srv_put_u16(p, val & 0xffff);
+  bank_srv_put_u16(&p[2], val >> 16);
+}
+
+static bool bank_srv_notify(uint16_t conn_handle, const uint8_t* buf, size_t len) {
+  struct os_mbuf *om = ble_hs_mbuf_from_flat(buf, len);
+  if (om == NULL) {
+    return false;
+  }
+
+  return ble_gatts_notify_custom(conn_handle, *bank_val_handle, om) == 0;
+}
+
+static void bank_srv_notify_op(uint16_t conn_handle, uint8_t op) {
+  bank_srv_notify(conn_handle, &op, 1);
+}
+
+static void bank_srv_notify_seq(uint16_t conn_handle, uint8_t op, uint16_t seq) {
+  uint8_t buf[1 + BANK_SRV_SEQ_LEN];
+  buf[0] = op;
+  bank_srv_put_u16(&buf[1], seq);
+  bank_srv_notify(conn_handle, buf, sizeof(buf));
+}
+
+static void bank_srv_store_run(void *param) {
+  bank_store_t s;
+
+  while(1) {
+    if (xQueueReceive(store_queue, &s, portMAX_DELAY) == pdFALSE) {
+      continue;
+    }
+
+    if (s.import_id != store_id) {
+      store_id = s.import_id;
+      store_err = ESP_OK;
+    }
+
+    if ((s.count > 0) && (store_err == ESP_OK) && (s.import_id != __atomic_load_n(&discarded_id, __ATOMIC_RELAXED))) {
+      store_err = synth_prg_import(s.records, s.count);
+      if (store_err != ESP_OK) {
+        ESP_LOGE(TAG, "Storing programs failed (%s)", esp_err_to_name(store_err));
+      }
+    }
+
+    if (s.records != NULL) {
+      xQueueSend(free_queue, &s.records, 0);
+    }
+
+    if (s.import_id != __atomic_load_n(&import_id, __ATOMIC_RELAXED)) {
+      continue;
+    }
+
+    if (s.op == BANK_SRV_DATA_ACK) {
+      __atomic_store_n(&stored_ack, ((uint32_t) s.import_id << 16) | s.seq, __ATOMIC_RELAXED);
+      bank_srv_notify_seq(s.conn_handle, BANK_SRV_DATA_ACK, s.seq);
+    } else if (s.op == BANK_SRV_END) {
+      bool ok = s.ok && (store_err == ESP_OK);
+      if (ok) {
+        ESP_LOGI(TAG, "Imported %d programs", s.seq);
+      }
+
+      bank_srv_notify_op(s.conn_handle, ok ? BANK_SRV_END_ACK : BANK_SRV_END_NAK);
+    }
+  }
+}
+
+// Hands the current batch to the store task with the reply to send once it is stored. The host task is the only one
+// queueing, a packet is only taken when the queue has room for its batch.
+static bool bank_srv_submit(uint16_t conn_handle, uint8_t op, uint16_t seq, bool ok) {
+  const bank_store_t s = {
+    .records = batch, .count = batch_count, .op = op, .seq = seq, .import_id = import_id, .conn_handle = conn_handle, .ok = ok,
+  };
+
+  if (xQueueSend(store_queue, &s, 0) != pdTRUE) {
+    return false;
+  }
+
+  batch = NULL;
+  batch_count = 0;
+  return true;
+}
+
+static void bank_srv_reset() {
+  if ((mode == BANK_MODE_IMPORT) && (batch_count > 0)) {
+    // what was received is kept
+    if (!bank_srv_submit(BLE_HS_CONN_HANDLE_NONE, BANK_SRV_NOP, 0, false)) {
+      ESP_LOGW(TAG, "%d programs dropped", batch_count);
+    }
+  }
+
+  mode = BANK_MODE_NONE;
+}
+
+// Sends as many packets as the window allows, then END once all are acknowledged
+static void bank_srv_export_send(uint16_t conn_handle) {
+  while ((next_seq < packet_count) && ((uint16_t) (next_seq - acked_seq) < BANK_SRV_WINDOW)) {
+    uint16_t first = next_seq * packet_records;
+    uint16_t count = record_count - first;
+    if (count > packet_records) {
+      count = packet_records;
+    }
+
+    packet[0] = BANK_SRV_DATA;
+    bank_srv_put_u16(&packet[1], next_seq);
+
+    size_t len = 1 + BANK_SRV_SEQ_LEN;
+    for (int i = 0; i < count; i++) {
+      synth_prg_dump_t* dump = (synth_prg_dump_t*) &packet[len];
+      if (!synth_prg_export(export_pos + first + i, dump)) {
+        memset(dump, 0, sizeof(synth_prg_dump_t));
+      }
+      len += sizeof(synth_prg_dump_t);
+    }
+
+    // the total covers each record once, however often it is sent
+    if (next_seq == crc_seq) {
+      crc = esp_rom_crc32_le(crc, &packet[1 + BANK_SRV_SEQ_LEN], len - (1 + BANK_SRV_SEQ_LEN));
+      crc_seq++;
+    }
+
+    bank_srv_put_u32(&packet[len], esp_rom_crc32_le(0, &packet[1], len - 1));
+    len += BANK_SRV_CRC_LEN;
+
+    // out of buffers, sent again from the retry or the next DATA_ACK, whichever comes first
+    if (!bank_srv_notify(conn_handle, packet, len)) {
+      ble_npl_callout_reset(&export_retry, ble_npl_time_ms_to_ticks32(BANK_SRV_RETRY_MS));
+      return;
+    }
+
+    next_seq++;
+  }
+
+  if (acked_seq == packet_count) {
+    uint8_t end[1 + 2 + BANK_SRV_CRC_LEN];
+    end[0] = BANK_SRV_END;
+    bank_srv_put_u16(&end[1], record_count);
+    bank_srv_put_u32(&end[3], crc);
+
+    if (bank_srv_notify(conn_handle, end, sizeof(end))) {
+      ESP_LOGI(TAG, "Exported %d programs", record_count);
+      mode = BANK_MODE_NONE;
+    } else {
+      ble_npl_callout_reset(&export_retry, ble_npl_time_ms_to_ticks32(BANK_SRV_RETRY_MS));
+    }
+  }
+}
+
+static void bank_srv_export_retry(struct ble_npl_event* ev) {
+  if (mode == BANK_MODE_EXPORT) {
+    bank_srv_export_send(export_conn);
+  }
+}
+
+static int bank_srv_export(uint16_t conn_handle, const uint8_t* req, size_t len) {
+  if (len < 5) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  bank_srv_reset();
+
+  uint16_t payload = ble_att_mtu(conn_handle) - BANK_SRV_ATT_HEADER_LEN;
+  if (payload > BANK_SRV_PACKET_SIZE) {
+    payload = BANK_SRV_PACKET_SIZE;
+  }
+
+  packet_records = (payload > BANK_SRV_DATA_OVERHEAD) ? (payload - BANK_SRV_DATA_OVERHEAD) / sizeof(synth_prg_dump_t) : 0;
+  if (packet_records == 0) {
+    ESP_LOGW(TAG, "ATT MTU too small for a program");
+    bank_srv_notify_op(conn_handle, BANK_SRV_REQUEST_NAK);
+    return 0;
+  }
+
+  record_count = synth_prg_range(req[1], req[2], req[3], req[4], &export_pos);
+  packet_count = (record_count + packet_records - 1) / packet_records;
+  next_seq = 0;
+  acked_seq = 0;
+  crc_seq = 0;
+  crc = 0;
+  export_conn = conn_handle;
+  mode = BANK_MODE_EXPORT;
+
+  ESP_LOGI(TAG, "Exporting %d programs in %d packets", record_count, packet_count);
+
+  uint8_t ack[1 + 2];
+  ack[0] = BANK_SRV_REQUEST_ACK;
+  bank_srv_put_u16(&ack[1], record_count);
+  bank_srv_notify(conn_handle, ack, sizeof(ack));
+
+  bank_srv_export_send(conn_handle);
+  return 0;
+}
+
+static int bank_srv_export_ack(uint16_t conn_handle, const uint8_t* msg, size_t len) {
+  if (len < 1 + BANK_SRV_SEQ_LEN) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  if (mode != BANK_MODE_EXPORT) {
+    return 0;
+  }
+
+  uint16_t seq = bank_srv_get_u16(&msg[1]);
+  if (seq > next_seq) {
+    return 0;
+  }
+
+  if (seq > acked_seq) {
+    acked_seq = seq;
+  }
+
+  // the host lost or rejected a packet, everything from it is sent again
+  if (msg[0] == BANK_SRV_DATA_NAK) {
+    next_seq = seq;
+  }
+
+  bank_srv_export_send(conn_handle);
+  return 0;
+}
+
+static int bank_srv_import(uint16_t conn_handle, const uint8_t* req, size_t len) {
+  if (len < 3) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  bank_srv_reset();
+
+  record_count = bank_srv_get_u16(&req[1]);
+  received = 0;
+  batch_count = 0;
+  next_seq = 0;
+  unacked = 0;
+  nak_sent = false;
+  dup_acked = false;
+  overflow = false;
+  crc = 0;
+  __atomic_store_n(&import_id, import_id + 1, __ATOMIC_RELAXED);
+  mode = BANK_MODE_IMPORT;
+
+  ESP_LOGI(TAG, "Importing %d programs", record_count);
+  bank_srv_notify_op(conn_handle, BANK_SRV_REQUEST_ACK);
+  return 0;
+}
+
+static int bank_srv_import_data(uint16_t conn_handle, const uint8_t* msg, size_t len) {
+  if ((len < BANK_SRV_DATA_OVERHEAD) || (((len - BANK_SRV_DATA_OVERHEAD) % sizeof(synth_prg_dump_t)) != 0)) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  if (mode != BANK_MODE_IMPORT) {
+    return 0;
+  }
+
+  uint16_t seq = bank_srv_get_u16(&msg[1]);
+  size_t records_len = len - BANK_SRV_DATA_OVERHEAD;
+  bool intact = (esp_rom_crc32_le(0, &msg[1], BANK_SRV_SEQ_LEN + records_len) == bank_srv_get_u32(&msg[len - BANK_SRV_CRC_LEN]));
+
+  if ((seq != next_seq) || !intact) {
+    if (!intact || ((int16_t) (seq - next_seq) > 0)) {
+      // lost or damaged, the host goes back to it. Only the first packet past the gap is NAKed.
+      if (!nak_sent) {
+        bank_srv_notify_seq(conn_handle, BANK_SRV_DATA_NAK, next_seq);
+        nak_sent = true;
+      }
+    } else if (!dup_acked) {
+      // resent after a lost ACK, only what is stored is acknowledged
+      uint32_t acked = __atomic_load_n(&stored_ack, __ATOMIC_RELAXED);
+      if ((acked >> 16) == import_id) {
+        bank_srv_notify_seq(conn_handle, BANK_SRV_DATA_ACK, acked & 0xffff);
+      }
+      dup_acked = true;
+    }
+
+    return 0;
+  }
+
+  // the store task is behind, the host goes back to this packet until a batch is free
+  if (((batch == NULL) && (xQueueReceive(free_queue, &batch, 0) == pdFALSE)) || (uxQueueSpacesAvailable(store_queue) < 2)) {
+    bank_srv_notify_seq(conn_handle, BANK_SRV_DATA_NAK, next_seq);
+    nak_sent = true;
+    return 0;
+  }
+
+  nak_sent = false;
+  dup_acked = false;
+
+  uint16_t count = records_len / sizeof(synth_prg_dump_t);
+  if ((received + count) > record_count) {
+    ESP_LOGE(TAG, "Programs past the announced count");
+    overflow = true;
+    count = record_count - received;
+  }
+
+  crc = esp_rom_crc32_le(crc, &msg[1 + BANK_SRV_SEQ_LEN], count * sizeof(synth_prg_dump_t));
+
+  if (!overflow) {
+    memcpy(&batch[batch_count], &msg[1 + BANK_SRV_SEQ_LEN], count * sizeof(synth_prg_dump_t));
+    batch_count += count;
+  }
+
+  received += count;
+  next_seq++;
+
+  // acknowledged by the store task once the batch is stored
+  if ((++unacked == BANK_SRV_ACK_INTERVAL) || (received == record_count)) {
+    bank_srv_submit(conn_handle, BANK_SRV_DATA_ACK, next_seq, true);
+    unacked = 0;
+  }
+
+  return 0;
+}
+
+static int bank_srv_import_end(uint16_t conn_handle, const uint8_t* msg, size_t len) {
+  if (len < 1 + 2 + BANK_SRV_CRC_LEN) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  if (mode != BANK_MODE_IMPORT) {
+    bank_srv_notify_op(conn_handle, BANK_SRV_END_NAK);
+    return 0;
+  }
+
+  mode = BANK_MODE_NONE;
+
+  uint16_t count = bank_srv_get_u16(&msg[1]);
+  uint32_t expected_crc = bank_srv_get_u32(&msg[3]);
+  bool ok = !overflow && (received == record_count) && (count == record_count) && (crc == expected_crc);
+
+  if (!ok) {
+    ESP_LOGE(TAG, "Import failed: %d/%d programs, crc %08lx expected %08lx", received, record_count, (unsigned long) crc, (unsigned long) expected_crc);
+  }
+
+  // answered by the store task once everything before is stored
+  if (!bank_srv_submit(conn_handle, BANK_SRV_END, received, ok)) {
+    bank_srv_notify_op(conn_handle, BANK_SRV_END_NAK);
+  }
+
+  return 0;
+}
+
+int bank_srv_write(uint16_t conn_handle, struct os_mbuf* om) {
+  uint16_t len;
+
+  if (OS_MBUF_PKTLEN(om) > sizeof(packet)) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  if ((ble_hs_mbuf_to_flat(om, packet, sizeof(packet), &len) != 0) || (len < 1)) {
+    return BLE_ATT_ERR_UNLIKELY;
+  }
+
+  switch (packet[0]) {
+    case BANK_SRV_EXPORT:
+      return bank_srv_export(conn_handle, packet, len);
+    case BANK_SRV_IMPORT:
+      return bank_srv_import(conn_handle, packet, len);
+    case BANK_SRV_DATA:
+      return bank_srv_import_data(conn_handle, packet, len);
+    case BANK_SRV_DATA_ACK:
+    case BANK_SRV_DATA_NAK:
+      return bank_srv_export_ack(conn_handle, packet, len);
+    case BANK_SRV_END:
+      return bank_srv_import_end(conn_handle, packet, len);
+    default:
+      return 0;
+  }
+}
+
+void bank_srv_disconnect() {
+  ble_npl_callout_stop(&export_retry);
+
+  if (mode == BANK_MODE_IMPORT) {
+    ESP_LOGW(TAG, "Connection lost, import of %d programs dropped", record_count);
+    batch_count = 0;
+    __atomic_store_n(&discarded_id, import_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&import_id, import_id + 1, __ATOMIC_RELAXED);
+  }
+
+  mode = BANK_MODE_NONE;
+}
+
+void bank_srv_init(const uint16_t* val_handle) {
+  bank_val_handle = val_handle;
+  ble_npl_callout_init(&export_retry, nimble_port_get_dflt_eventq(), bank_srv_export_retry, NULL);
+  free_queue = xQueueCreate(BANK_SRV_BATCHES, sizeof(synth_prg_dump_t*));
+  store_queue = xQueueCreate(BANK_SRV_STORE_QUEUE_LEN, sizeof(bank_store_t));
+
+  for (int i = 0; i < BANK_SRV_BATCHES; i++) {
+    synth_prg_dump_t* b = batches[i];
+    xQueueSend(free_queue, &b, 0);
+  }
+
+  // NVS writes, below everything that plays like the program saves
+  xTaskCreate(bank_srv_store_run, "bank_store", BANK_SRV_STORE_STACK_SIZE, NULL, 1, NULL);
+}
@@ -0,0 +1,46 @@
+#ifndef __BANK_SRV__
+#define __BANK_SRV__
+
+#include <stdint.h>
+
+struct os_mbuf;
+
+typedef enum {
+  BANK_SRV_NOP,
+  BANK_SRV_EXPORT,
+  BANK_SRV_IMPORT,
+  BANK_SRV_REQUEST_ACK,
+  BANK_SRV_REQUEST_NAK,
+  BANK_SRV_DATA,
+  BANK_SRV_DATA_ACK,
+  BANK_SRV_DATA_NAK,
+  BANK_SRV_END,
+  BANK_SRV_END_ACK,
+  BANK_SRV_END_NAK,
+} bank_srv_op_t;
+
+// Whole banks or ranges of programs move as one transfer of synth_prg_dump_t records. Every message starts with its
+// op, numbers are little endian.
+//   DATA, sequence number (u16), records, CRC32 of the sequence number and the records (u32)
+//   DATA_ACK / DATA_NAK, next expected sequence number (u16)
+// Export, the device notifies the data:
+//   write  EXPORT, first bank, first program, last bank, last program -> REQUEST_ACK, record count (u16) / REQUEST_NAK
+//   notify DATA, at most BANK_SRV_WINDOW packets past the last DATA_ACK, sending goes back to a DATA_NAK
+//   notify END, record count (u16), CRC32 of all records (u32) once every packet is acknowledged
+// Import, the host writes the data, without response:
+//   write  IMPORT, record count (u16) -> REQUEST_ACK / REQUEST_NAK
+//   write  DATA -> DATA_ACK every BANK_SRV_ACK_INTERVAL packets and at the last one once their records are stored,
+//          DATA_NAK on the first packet past a gap or failing its CRC, and on any packet while the device is behind
+//          storing. A DATA_ACK may then trail the DATA_NAK with a lower sequence number.
+//   write  END, record count (u16), CRC32 of all records (u32) -> END_ACK / END_NAK once everything is stored
+// Records are never split across packets, the ATT MTU has to fit at least one.
+#define BANK_SRV_WINDOW 8
+#define BANK_SRV_ACK_INTERVAL 4
+
+// The handle is read when notifying, it is only known once the service is registered
+void bank_srv_init(const uint16_t* val_handle);
+int bank_srv_write(uint16_t conn_handle, struct os_mbuf* om);
+// Stops the transfer of the connection, an import is dropped with the records not yet stored
+void bank_srv_disconnect();
+
+#endif
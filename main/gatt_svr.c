@@ -1,7 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
-#include "esp_ota_ops.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOSConfig.h"
 #include "nimble/nimble_port.h"
 #include "nimble/nimble_port_freertos.h"
@@ -13,11 +13,17 @@
 #include "services/gatt/ble_svc_gatt.h"
 #include "services/dis/ble_svc_dis.h"
 #include "gatt_svr.h"
+#include "midi_parser.h"
+#include "midi_srv.h"
 #include "opl_srv.h"
+#include "opl_stats.h"
+#include "ota_srv.h"
+#include "bank_srv.h"
 #include "synth.h"
 #include "esp_log.h"
 
-#define REBOOT_DEEP_SLEEP_TIMEOUT 500
+#define BLE_MIDI_BATCH_LEN 32
+#define OPL_MSGS_BATCH_LEN 32
 
 static const char *manuf_name = "Bitgamma";
 static const char *model_num = "Synth OPL";
@@ -25,24 +31,27 @@ static const char *TAG = "gatt_srv";
 
 static uint8_t ble_synth_prph_addr_type;
 static uint16_t ble_synth_program_val_handle;
+static uint16_t ble_synth_bank_val_handle;
+static uint16_t ble_synth_save_val_handle;
 
-static uint8_t gatt_svr_chr_ota_control_val;
-static uint8_t gatt_svr_chr_ota_data_val[512];
+static midi_ble_parser_t ble_midi_parser;
+// write callbacks all run on the host task
+static opl_msg_t opl_msgs_batch[OPL_MSGS_BATCH_LEN];
 
 static uint16_t ota_control_val_handle;
 static uint16_t ota_data_val_handle;
 
-static const esp_partition_t *update_partition;
-static esp_ota_handle_t update_handle;
-static bool updating = false;
-static uint16_t num_pkgs_received = 0;
-static uint16_t packet_size = 0;
-
 static int ble_synth_prph_gap_event(struct ble_gap_event *event, void *arg);
 
 static int gatt_svr_chr_opl_msg(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int gatt_svr_chr_opl_msgs(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 static int gatt_svr_chr_opl_list_prg(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 static int gatt_svr_chr_opl_program(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int gatt_svr_chr_opl_stats(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int gatt_svr_chr_opl_bank(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int gatt_svr_chr_opl_save(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+
+static int gatt_svr_chr_midi_io(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 
 static int gatt_svr_chr_ota_control_cb(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 static int gatt_svr_chr_ota_data_cb(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
@@ -69,6 +78,44 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
         .access_cb = gatt_svr_chr_opl_program,
         .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY,
         .val_handle = &ble_synth_program_val_handle
+      }, {
+        /* Characteristic: Statistics, writing resets them */
+        .uuid = BLE_UUID128_DECLARE(GATT_OPL_CHR_UUID_STATS),
+        .access_cb = gatt_svr_chr_opl_stats,
+        .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+      }, {
+        /* Characteristic: OPL Messages, each one prefixed with the length of its command and parameters */
+        .uuid = BLE_UUID128_DECLARE(GATT_OPL_CHR_UUID_MSGS),
+        .access_cb = gatt_svr_chr_opl_msgs,
+        .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP,
+      }, {
+        /* Characteristic: Bank transfer, programs exported and imported in bulk */
+        .uuid = BLE_UUID128_DECLARE(GATT_OPL_CHR_UUID_BANK),
+        .access_cb = gatt_svr_chr_opl_bank,
+        .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP | BLE_GATT_CHR_F_NOTIFY,
+        .val_handle = &ble_synth_bank_val_handle
+      }, {
+        /* Characteristic: Program saves, notifies each save once it is stored or failed */
+        .uuid = BLE_UUID128_DECLARE(GATT_OPL_CHR_UUID_SAVE),
+        .access_cb = gatt_svr_chr_opl_save,
+        .flags = BLE_GATT_CHR_F_NOTIFY,
+        .val_handle = &ble_synth_save_val_handle
+      }, {
+        0, /* No more characteristics in this service */
+      },
+    }
+  }, 
+
+  {
+    /* Service: BLE-MIDI */
+    .type = BLE_GATT_SVC_TYPE_PRIMARY,
+    .uuid = BLE_UUID128_DECLARE(GATT_MIDI_UUID),
+    .characteristics = (struct ble_gatt_chr_def[]) { 
+      {
+        /* Characteristic: MIDI Data I/O, reads are empty and nothing is sent back */
+        .uuid = BLE_UUID128_DECLARE(GATT_MIDI_CHR_UUID_IO),
+        .access_cb = gatt_svr_chr_midi_io,
+        .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE_NO_RSP | BLE_GATT_CHR_F_NOTIFY,
       }, {
         0, /* No more characteristics in this service */
       },
@@ -90,7 +137,7 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
         /* Characteristic: List programs */
         .uuid = BLE_UUID128_DECLARE(GATT_OTA_CHR_DATA),
         .access_cb = gatt_svr_chr_ota_data_cb,
-        .flags = BLE_GATT_CHR_F_WRITE,
+        .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP,
         .val_handle = &ota_data_val_handle,
       }, {
         0, /* No more characteristics in this service */
@@ -121,6 +168,7 @@ static inline int gatt_svr_chr_write(struct os_mbuf *om, uint16_t max_len, void
 }
 
 static int gatt_svr_chr_opl_msg(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+  uint32_t ingress_us = (uint32_t) esp_timer_get_time();
   opl_msg_t msg;
   memset(&msg, 0, sizeof(opl_msg_t));
 
@@ -129,7 +177,48 @@ static int gatt_svr_chr_opl_msg(uint16_t conn_handle, uint16_t attr_handle, stru
     return rc;
   }
 
-  opl_srv_queue_msg(&msg);
+  opl_srv_queue_msg(OPL_SRC_BLE, &msg, ingress_us);
+
+  return 0;
+}
+
+static int gatt_svr_chr_opl_msgs(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+  uint32_t ingress_us = (uint32_t) esp_timer_get_time();
+  uint16_t om_len = OS_MBUF_PKTLEN(ctxt->om);
+
+  // the whole write is rejected if any message is malformed, before anything is queued
+  for (int off = 0; off < om_len; ) {
+    uint8_t msg_len;
+    os_mbuf_copydata(ctxt->om, off, 1, &msg_len);
+
+    if ((msg_len == 0) || (msg_len > sizeof(opl_msg_t)) || ((off + 1 + msg_len) > om_len)) {
+      return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    off += 1 + msg_len;
+  }
+
+  size_t count = 0;
+
+  for (int off = 0; off < om_len; ) {
+    uint8_t msg_len;
+    os_mbuf_copydata(ctxt->om, off, 1, &msg_len);
+
+    // parameters not sent are zero
+    uint8_t* msg = (uint8_t*) &opl_msgs_batch[count];
+    os_mbuf_copydata(ctxt->om, off + 1, msg_len, msg);
+    memset(&msg[msg_len], 0, sizeof(opl_msg_t) - msg_len);
+    off += 1 + msg_len;
+
+    if (++count == OPL_MSGS_BATCH_LEN) {
+      opl_srv_queue_msgs(OPL_SRC_BLE, opl_msgs_batch, count, ingress_us);
+      count = 0;
+    }
+  }
+
+  if (count > 0) {
+    opl_srv_queue_msgs(OPL_SRC_BLE, opl_msgs_batch, count, ingress_us);
+  }
 
   return 0;
 }
@@ -161,11 +250,73 @@ static int gatt_svr_chr_opl_program(uint16_t conn_handle, uint16_t attr_handle,
       return rc;
     }
     
-    if (synth_prg_write(&prg_desc) != ESP_OK) {
-      return BLE_ATT_ERR_UNLIKELY;
+    // the OPL task owns the playing program, it saves it after the edits queued before. Stored in the background, the
+    // save characteristic notifies the result.
+    opl_msg_t msg = { .cmd = SAVE_PROGRAM };
+    msg.params.save_prg.bank = prg_desc.bank_num;
+    msg.params.save_prg.prg = prg_desc.prg_num;
+    memcpy(msg.params.save_prg.name, prg_desc.prg_name, PROGRAM_MAX_NAME_LEN);
+    msg.params.save_prg.conn_handle = conn_handle;
+    opl_srv_queue_msg(OPL_SRC_BLE, &msg, (uint32_t) esp_timer_get_time());
+  }
+
+  return 0;
+}
+
+static int gatt_svr_chr_opl_stats(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+  if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) {
+    opl_stats_t stats;
+    opl_stats_get(&stats);
+    if (os_mbuf_append(ctxt->om, &stats, sizeof(opl_stats_t)) != 0) {
+      return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+  } else {
+    opl_stats_reset();
+  }
+
+  return 0;
+}
+
+static int gatt_svr_chr_opl_bank(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+  return bank_srv_write(conn_handle, ctxt->om);
+}
+
+static int gatt_svr_chr_opl_save(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+  return 0;
+}
+
+static int gatt_svr_chr_midi_io(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+  if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) {
+    return 0;
+  }
+
+  uint32_t ingress_us = (uint32_t) esp_timer_get_time();
+  opl_msg_t msgs[BLE_MIDI_BATCH_LEN];
+  size_t count = 0;
+
+  midi_ble_parser_packet(&ble_midi_parser);
+
+  // the packet is parsed in place, one connection event can carry many messages
+  for (const struct os_mbuf *om = ctxt->om; om != NULL; om = SLIST_NEXT(om, om_next)) {
+    for (int i = 0; i < om->om_len; i++) {
+      midi_msg_t midi;
+      if (!midi_ble_parser_feed(&ble_midi_parser, om->om_data[i], &midi)) {
+        continue;
+      }
+
+      count += midi_srv_to_opl(&midi, &msgs[count]);
+
+      if (count == BLE_MIDI_BATCH_LEN) {
+        opl_srv_queue_msgs(OPL_SRC_BLE, msgs, count, ingress_us);
+        count = 0;
+      }
     }
   }
 
+  if (count > 0) {
+    opl_srv_queue_msgs(OPL_SRC_BLE, msgs, count, ingress_us);
+  }
+
   return 0;
 }
 
@@ -191,86 +342,26 @@ void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg) {
   }
 }
 
-static void update_ota_control(uint16_t conn_handle) {
-  struct os_mbuf *om;
-  esp_err_t err;
-
-  switch (gatt_svr_chr_ota_control_val) {
-    case SVR_CHR_OTA_CONTROL_REQUEST:
-      ESP_LOGI(TAG, "OTA has been requested via BLE.");
-      update_partition = esp_ota_get_next_update_partition(NULL);
-      err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
-      if (err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-        esp_ota_abort(update_handle);
-        gatt_svr_chr_ota_control_val = SVR_CHR_OTA_CONTROL_REQUEST_NAK;
-      } else {
-        gatt_svr_chr_ota_control_val = SVR_CHR_OTA_CONTROL_REQUEST_ACK;
-        updating = true;
-
-        packet_size = (gatt_svr_chr_ota_data_val[1] << 8) + gatt_svr_chr_ota_data_val[0];
-        ESP_LOGD(TAG, "Packet size is: %d", packet_size);
-
-        num_pkgs_received = 0;
-      }
-
-      om = ble_hs_mbuf_from_flat(&gatt_svr_chr_ota_control_val, sizeof(gatt_svr_chr_ota_control_val));
-      ble_gatts_notify_custom(conn_handle, ota_control_val_handle, om);
-      ESP_LOGI(TAG, "OTA request acknowledgement has been sent.");
-      break;
-    case SVR_CHR_OTA_CONTROL_DONE:
-      updating = false;
-
-      err = esp_ota_end(update_handle);
-      if (err != ESP_OK) {
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-          ESP_LOGE(TAG, "Image validation failed, image is corrupted!");
-        } else {
-          ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
-        }
-      } else {
-        err = esp_ota_set_boot_partition(update_partition);
-        if (err != ESP_OK) {
-          ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
-        }
-      }
-
-      if (err != ESP_OK) {
-        gatt_svr_chr_ota_control_val = SVR_CHR_OTA_CONTROL_DONE_NAK;
-      } else {
-        gatt_svr_chr_ota_control_val = SVR_CHR_OTA_CONTROL_DONE_ACK;
-      }
-
-      om = ble_hs_mbuf_from_flat(&gatt_svr_chr_ota_control_val, sizeof(gatt_svr_chr_ota_control_val));
-      ble_gatts_notify_custom(conn_handle, ota_control_val_handle, om);
-      ESP_LOGI(TAG, "OTA DONE acknowledgement has been sent.");
-
-      // restart the ESP to finish the OTA
-      if (err == ESP_OK) {
-        ESP_LOGI(TAG, "Preparing to restart!");
-        vTaskDelay(pdMS_TO_TICKS(REBOOT_DEEP_SLEEP_TIMEOUT));
-        esp_restart();
-      }
-
-      break;
-
-    default:
-      break;
-  }
-}
-
 static int gatt_svr_chr_ota_control_cb(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+  uint8_t ctrl[OTA_SRV_CTRL_LEN];
+  uint16_t len;
   int rc;
-  uint8_t length = sizeof(gatt_svr_chr_ota_control_val);
 
   switch (ctxt->op) {
     case BLE_GATT_ACCESS_OP_READ_CHR:
-      rc = os_mbuf_append(ctxt->om, &gatt_svr_chr_ota_control_val, length);
+      ctrl[0] = ota_srv_control_val();
+      rc = os_mbuf_append(ctxt->om, ctrl, 1);
       return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
     case BLE_GATT_ACCESS_OP_WRITE_CHR:
-      rc = gatt_svr_chr_write(ctxt->om, length, &gatt_svr_chr_ota_control_val);
-      update_ota_control(conn_handle);
-      return rc;
+      if (OS_MBUF_PKTLEN(ctxt->om) > sizeof(ctrl)) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+      }
+
+      if (ble_hs_mbuf_to_flat(ctxt->om, ctrl, sizeof(ctrl), &len) != 0) {
+        return BLE_ATT_ERR_UNLIKELY;
+      }
+
+      return ota_srv_control(conn_handle, ctrl, len);
     default:
       break;
   }
@@ -281,22 +372,7 @@ static int gatt_svr_chr_ota_control_cb(uint16_t conn_handle, uint16_t attr_handl
 }
 
 static int gatt_svr_chr_ota_data_cb(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
-  int rc;
-  esp_err_t err;
-
-  rc = gatt_svr_chr_write(ctxt->om, sizeof(gatt_svr_chr_ota_data_val), gatt_svr_chr_ota_data_val);
-
-  if (updating) {
-    err = esp_ota_write(update_handle, (const void *)gatt_svr_chr_ota_data_val, packet_size);
-    if (err != ESP_OK) {
-      ESP_LOGE(TAG, "esp_ota_write failed (%s)!", esp_err_to_name(err));
-    }
-
-    num_pkgs_received++;
-    ESP_LOGD(TAG, "Received packet %d", num_pkgs_received);
-  }
-
-  return rc;
+  return ota_srv_data(conn_handle, ctxt->om);
 }
 
 int gatt_svr_init(void) {
@@ -305,6 +381,8 @@ int gatt_svr_init(void) {
   ble_svc_gap_init();
   ble_svc_gatt_init();
   ble_svc_dis_init();
+  ota_srv_init(&ota_control_val_handle);
+  bank_srv_init(&ble_synth_bank_val_handle);
 
   rc = ble_gatts_count_cfg(gatt_svr_svcs);
   if (rc != 0) {
@@ -346,6 +424,14 @@ static void ble_synth_prph_advertise(void) {
   scan_response_fields.name = (uint8_t *)model_num;
   scan_response_fields.name_len = strlen(model_num);
   scan_response_fields.name_is_complete = 1;
+
+  // MIDI controllers look for the BLE-MIDI service in the advertisement, both 128 bit UUIDs do not fit in it
+  scan_response_fields.uuids128 = (ble_uuid128_t[]) {
+    BLE_UUID128_INIT(GATT_OPL_UUID)
+  };
+  scan_response_fields.num_uuids128 = 1;
+  scan_response_fields.uuids128_is_complete = 0;
+
   rc = ble_gap_adv_rsp_set_fields(&scan_response_fields);
 
   if (rc != 0) {
@@ -358,10 +444,10 @@ static void ble_synth_prph_advertise(void) {
   fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
 
   fields.uuids128 = (ble_uuid128_t[]) {
-    BLE_UUID128_INIT(GATT_OPL_UUID)
+    BLE_UUID128_INIT(GATT_MIDI_UUID)
   };
   fields.num_uuids128 = 1;
-  fields.uuids128_is_complete = 1;
+  fields.uuids128_is_complete = 0;
 
   rc = ble_gap_adv_set_fields(&fields);
   if (rc != 0) {
@@ -384,6 +470,15 @@ void ble_synth_notify_program(void) {
   ble_gatts_chr_updated(ble_synth_program_val_handle);
 }
 
+void ble_synth_notify_saved(uint16_t conn_handle, uint8_t bank, uint8_t prg, bool stored) {
+  const uint8_t result[3] = { bank, prg, stored ? 0 : 1 };
+  struct os_mbuf *om = ble_hs_mbuf_from_flat(result, sizeof(result));
+
+  if (om != NULL) {
+    ble_gatts_notify_custom(conn_handle, ble_synth_save_val_handle, om);
+  }
+}
+
 static int ble_synth_prph_gap_event(struct ble_gap_event *event, void *arg) {
   switch (event->type) {
   case BLE_GAP_EVENT_CONNECT:
@@ -392,11 +487,15 @@ static int ble_synth_prph_gap_event(struct ble_gap_event *event, void *arg) {
 
     if (event->connect.status != 0) {
       ble_synth_prph_advertise();
+    } else {
+      midi_ble_parser_reset(&ble_midi_parser);
     }
     break;
 
   case BLE_GAP_EVENT_DISCONNECT:
     MODLOG_DFLT(INFO, "disconnect; reason=%d\n", event->disconnect.reason);
+    ota_srv_disconnect();
+    bank_srv_disconnect();
     ble_synth_prph_advertise();
     break;
 
@@ -1,6 +1,7 @@
 #ifndef H_BLE_HTP_PRPH_
 #define H_BLE_HTP_PRPH_
 
+#include <stdbool.h>
 #include "nimble/ble.h"
 #include "modlog/modlog.h"
 
@@ -9,6 +10,16 @@
 #define GATT_OPL_CHR_UUID_MSG       0x67, 0x57, 0xd6, 0xb4, 0x70, 0xa7, 0x38, 0x90, 0x53, 0x41, 0xfe, 0x60, 0x01, 0x00, 0x79, 0x78
 #define GATT_OPL_CHR_UUID_LIST_PRG  0x67, 0x57, 0xd6, 0xb4, 0x70, 0xa7, 0x38, 0x90, 0x53, 0x41, 0xfe, 0x60, 0x02, 0x00, 0x79, 0x78
 #define GATT_OPL_CHR_UUID_PROGRAM   0x67, 0x57, 0xd6, 0xb4, 0x70, 0xa7, 0x38, 0x90, 0x53, 0x41, 0xfe, 0x60, 0x03, 0x00, 0x79, 0x78
+#define GATT_OPL_CHR_UUID_STATS     0x67, 0x57, 0xd6, 0xb4, 0x70, 0xa7, 0x38, 0x90, 0x53, 0x41, 0xfe, 0x60, 0x04, 0x00, 0x79, 0x78
+#define GATT_OPL_CHR_UUID_MSGS      0x67, 0x57, 0xd6, 0xb4, 0x70, 0xa7, 0x38, 0x90, 0x53, 0x41, 0xfe, 0x60, 0x05, 0x00, 0x79, 0x78
+#define GATT_OPL_CHR_UUID_BANK      0x67, 0x57, 0xd6, 0xb4, 0x70, 0xa7, 0x38, 0x90, 0x53, 0x41, 0xfe, 0x60, 0x06, 0x00, 0x79, 0x78
+#define GATT_OPL_CHR_UUID_SAVE      0x67, 0x57, 0xd6, 0xb4, 0x70, 0xa7, 0x38, 0x90, 0x53, 0x41, 0xfe, 0x60, 0x07, 0x00, 0x79, 0x78
+
+/* BLE-MIDI: 03b80e5a-ede8-4b33-a751-6ce34ec4c700 */
+#define GATT_MIDI_UUID              0x00, 0xc7, 0xc4, 0x4e, 0xe3, 0x6c, 0x51, 0xa7, 0x33, 0x4b, 0xe8, 0xed, 0x5a, 0x0e, 0xb8, 0x03
+
+/* BLE-MIDI Data I/O: 7772e5db-3868-4112-a1a9-f2669d106bf3 */
+#define GATT_MIDI_CHR_UUID_IO       0xf3, 0x6b, 0x10, 0x9d, 0x66, 0xf2, 0xa9, 0xa1, 0x12, 0x41, 0x68, 0x38, 0xdb, 0xe5, 0x72, 0x77
 
 /* OTA GATT: d6f1d96d-594c-4c53-b1c6-244a1dfde6d8 */
 #define GATT_OTA_UUID 0xd8, 0xe6, 0xfd, 0x1d, 0x4a, 024, 0xc6, 0xb1, 0x53, 0x4c, 0x4c, 0x59, 0x6d, 0xd9, 0xf1, 0xd6
@@ -19,16 +30,6 @@
 /* OTA Data: 23408888-1f40-4cd8-9b89-ca8d45f8a5b0 */
 #define GATT_OTA_CHR_DATA 0xb0, 0xa5, 0xf8, 0x45, 0x8d, 0xca, 0x89, 0x9b, 0xd8, 0x4c, 0x40, 0x1f, 0x88, 0x88, 0x40, 0x23
 
-typedef enum {
-  SVR_CHR_OTA_CONTROL_NOP,
-  SVR_CHR_OTA_CONTROL_REQUEST,
-  SVR_CHR_OTA_CONTROL_REQUEST_ACK,
-  SVR_CHR_OTA_CONTROL_REQUEST_NAK,
-  SVR_CHR_OTA_CONTROL_DONE,
-  SVR_CHR_OTA_CONTROL_DONE_ACK,
-  SVR_CHR_OTA_CONTROL_DONE_NAK,
-} svr_chr_ota_control_val_t;
-
 struct ble_hs_cfg;
 struct ble_gatt_register_ctxt;
 
@@ -36,5 +37,7 @@ void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
 int gatt_svr_init(void);
 void gatt_srv_start(void);
 void ble_synth_notify_program(void);
+// Result of a program save on the save characteristic: bank, program, 0 when stored or 1 when it failed
+void ble_synth_notify_saved(uint16_t conn_handle, uint8_t bank, uint8_t prg, bool stored);
 
 #endif
\ No newline at end of file
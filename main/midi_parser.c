@@ -0,0 +1,96 @@
+#include "midi_parser.h"
+
+static const uint8_t MIDI_CHANNEL_MSG_LEN[8] = { 2, 2, 2, 2, 1, 1, 2, 0 };
+static const uint8_t MIDI_SYSTEM_MSG_LEN[8] = { 0, 1, 2, 1, 0, 0, 0, 0 };
+
+void midi_parser_reset(midi_parser_t* parser) {
+  parser->status = 0;
+  parser->expected = 0;
+  parser->count = 0;
+}
+
+int midi_parser_feed(midi_parser_t* parser, uint8_t byte, midi_msg_t* out) {
+  if (byte >= MIDI_REALTIME) {
+    out->status = byte;
+    return 1;
+  }
+
+  if (byte & 0x80) {
+    parser->status = byte;
+    parser->count = 0;
+
+    if (byte < MIDI_SYSTEM) {
+      parser->expected = MIDI_CHANNEL_MSG_LEN[(byte >> 4) & 0x7];
+      return 0;
+    }
+
+    // system common messages cancel running status, SysEx start and end are dropped with their content
+    parser->expected = MIDI_SYSTEM_MSG_LEN[byte & 0x7];
+
+    if (byte == MIDI_SYSEX_START) {
+      return 0;
+    } else if (byte == MIDI_SYSEX_END) {
+      parser->status = 0;
+      return 0;
+    } else if (parser->expected == 0) {
+      out->status = byte;
+      parser->status = 0;
+      return 1;
+    }
+
+    return 0;
+  }
+
+  if (parser->status == 0 || parser->status == MIDI_SYSEX_START) {
+    return 0;
+  }
+
+  parser->data[parser->count++] = byte;
+
+  if (parser->count < parser->expected) {
+    return 0;
+  }
+
+  out->status = parser->status;
+  out->data[0] = parser->data[0];
+  out->data[1] = parser->data[1];
+  parser->count = 0;
+
+  if (parser->status >= MIDI_SYSTEM) {
+    parser->status = 0;
+  }
+
+  return 1;
+}
+
+void midi_ble_parser_reset(midi_ble_parser_t* parser) {
+  midi_parser_reset(&parser->midi);
+  parser->state = MIDI_BLE_HEADER;
+}
+
+void midi_ble_parser_packet(midi_ble_parser_t* parser) {
+  parser->state = MIDI_BLE_HEADER;
+}
+
+int midi_ble_parser_feed(midi_ble_parser_t* parser, uint8_t byte, midi_msg_t* out) {
+  switch (parser->state) {
+    case MIDI_BLE_HEADER:
+      // a packet not starting with a header is dropped
+      parser->state = (byte & 0x80) ? MIDI_BLE_MESSAGE : MIDI_BLE_INVALID;
+      return 0;
+    case MIDI_BLE_INVALID:
+      return 0;
+    case MIDI_BLE_TIMESTAMP:
+      // a status byte, or a data byte continuing the running status
+      parser->state = MIDI_BLE_MESSAGE;
+      return midi_parser_feed(&parser->midi, byte, out);
+    default:
+      // any other byte with the high bit set is the timestamp of the next message, running status messages may omit it
+      if (byte & 0x80) {
+        parser->state = MIDI_BLE_TIMESTAMP;
+        return 0;
+      }
+
+      return midi_parser_feed(&parser->midi, byte, out);
+  }
+}
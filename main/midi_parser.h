@@ -0,0 +1,56 @@
+#ifndef __MIDI_PARSER__
+#define __MIDI_PARSER__
+
+#include <stdint.h>
+
+#define MIDI_NOTE_OFF 0x80
+#define MIDI_NOTE_ON 0x90
+#define MIDI_POLY_PRESSURE 0xa0
+#define MIDI_CTRL_CHANGE 0xb0
+#define MIDI_PRG_CHANGE 0xc0
+#define MIDI_CHAN_PRESSURE 0xd0
+#define MIDI_PITCH_BEND 0xe0
+#define MIDI_SYSTEM 0xf0
+
+#define MIDI_SYSEX_START 0xf0
+#define MIDI_SYSEX_END 0xf7
+#define MIDI_REALTIME 0xf8
+
+typedef struct {
+  uint8_t status;
+  uint8_t data[2];
+} midi_msg_t;
+
+typedef struct {
+  uint8_t status;
+  uint8_t expected;
+  uint8_t count;
+  uint8_t data[2];
+} midi_parser_t;
+
+typedef enum {
+  MIDI_BLE_HEADER,
+  MIDI_BLE_TIMESTAMP,
+  MIDI_BLE_MESSAGE,
+  MIDI_BLE_INVALID,
+} midi_ble_state_t;
+
+// BLE-MIDI packets are a header byte followed by messages each preceded by a timestamp byte. Running status and SysEx
+// carry over from one packet to the next. Timestamps are skipped, messages are played as they arrive.
+typedef struct {
+  midi_parser_t midi;
+  midi_ble_state_t state;
+} midi_ble_parser_t;
+
+void midi_parser_reset(midi_parser_t* parser);
+
+// Returns 1 and fills out when byte completes a message. Running status is applied, realtime bytes are returned immediately
+// without disturbing a message in progress and SysEx content is dropped.
+int midi_parser_feed(midi_parser_t* parser, uint8_t byte, midi_msg_t* out);
+
+void midi_ble_parser_reset(midi_ble_parser_t* parser);
+// Starts a new packet, the next byte is its header
+void midi_ble_parser_packet(midi_ble_parser_t* parser);
+int midi_ble_parser_feed(midi_ble_parser_t* parser, uint8_t byte, midi_msg_t* out);
+
+#endif
\ No newline at end of file
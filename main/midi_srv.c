@@ -6,6 +6,8 @@
 #include "driver/uart.h"
 #include "soc/uart_channel.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "midi_parser.h"
 #include "opl_srv.h"
 #include "synth.h"
 
@@ -13,110 +15,138 @@
 #define MIDI_UART UART_NUM_1
 #define MIDI_UART_RX_PIN UART_NUM_1_RXD_DIRECT_GPIO_NUM
 #define RECV_BUF_SIZE 512
-#define RECV_TIMEOUT 1
-
-#define MIDI_NOTE_OFF 0x80
-#define MIDI_NOTE_ON 0x90
-#define MIDI_POLY_PRESSURE 0xa0
-#define MIDI_CTRL_CHANGE 0xb0
-#define MIDI_PRG_CHANGE 0xc0
-#define MIDI_CHAN_PRESSURE 0xd0
-#define MIDI_PITCH_BEND 0xe0
-#define MIDI_SYSTEM 0xf0
+#define DRAIN_BUF_SIZE 128
+#define MSG_BATCH_LEN 32
 
 #define MIDI_BANK_CC 0x00
 #define MIDI_PRG_CC 0x20
 
 static const char *TAG = "midi_srv";
 
-static void midi_queue_note(opl_cmd_t cmd, uint8_t note, uint8_t vel, uint8_t ch) {
-  opl_msg_t msg;
-  msg.cmd = cmd;
-  msg.params.note.note = note;
-  msg.params.note.velocity = vel;
-  msg.params.note.drum_channel = ch & 0x1;
-  opl_srv_queue_msg(&msg);  
+static int midi_note(opl_cmd_t cmd, uint8_t note, uint8_t vel, uint8_t ch, opl_msg_t* msg) {
+  msg->cmd = cmd;
+  msg->params.note.note = note;
+  msg->params.note.velocity = vel;
+  msg->params.note.channel = ch;
+  return 1;
+}
+
+static inline uint8_t midi_channel_bank(uint8_t ch) {
+  uint8_t part = synth_channel_part(ch) & ~SYNTH_PART_DRUMS;
+  return (part < SYNTH_MAX_PARTS) ? synth_part_bank(part) : 0;
 }
 
-static void midi_program_change(uint8_t bank, uint8_t prg) {
-  opl_msg_t msg;
-  msg.cmd = LOAD_PROGRAM;
-  msg.params.load_prg.bank = bank;
-  msg.params.load_prg.prg = prg;
-  opl_srv_queue_msg(&msg);  
+static int midi_program_change(uint8_t bank, uint8_t prg, uint8_t ch, opl_msg_t* msg) {
+  uint8_t part = synth_channel_part(ch) & ~SYNTH_PART_DRUMS;
+  if (part >= SYNTH_MAX_PARTS) {
+    return 0;
+  }
+
+  msg->cmd = LOAD_PROGRAM;
+  msg->params.load_prg.bank = bank;
+  msg->params.load_prg.prg = prg;
+  msg->params.load_prg.part = part;
+  return 1;
 }
 
-static void midi_ctrl_change(uint8_t cc, uint8_t val) {
+static int midi_ctrl_change(uint8_t cc, uint8_t val, uint8_t ch, opl_msg_t* msg) {
   switch(cc) {
     case MIDI_BANK_CC:
-      midi_program_change(val, 0);
-      break;
+      return midi_program_change(val, 0, ch, msg);
     case MIDI_PRG_CC:
-      midi_program_change(g_synth.bank_num, val);
-      break;
+      return midi_program_change(midi_channel_bank(ch), val, ch, msg);
     default:
-      break;
+      return 0;
   }
 }
 
-static void midi_pitch_bend(int16_t val) {
-  opl_msg_t msg;
-  msg.cmd = PITCH_BEND;
-  msg.params.bend = (val >> 5) - 256;
-  opl_srv_queue_msg(&msg);   
+static int midi_pitch_bend(int16_t val, uint8_t ch, opl_msg_t* msg) {
+  msg->cmd = PITCH_BEND;
+  msg->params.bend.value = (val >> 5) - 256;
+  msg->params.bend.channel = ch;
+  return 1;
+}
+
+int midi_srv_to_opl(const midi_msg_t* midi, opl_msg_t* msg) {
+  uint8_t ch = midi->status & 0xf;
+
+  switch(midi->status & 0xf0) {
+    case MIDI_NOTE_OFF:
+      ESP_LOGD(TAG, "Note Off: %d velocity: %d, ch: %d", midi->data[0], midi->data[1], ch);
+      return midi_note(NOTE_OFF, midi->data[0], midi->data[1], ch, msg);
+    case MIDI_NOTE_ON:
+      ESP_LOGD(TAG, "Note On: %d velocity: %d, ch: %d", midi->data[0], midi->data[1], ch);
+      // a note on with zero velocity is a note off, senders using running status rely on it
+      return midi_note(midi->data[1] ? NOTE_ON : NOTE_OFF, midi->data[0], midi->data[1], ch, msg);
+    case MIDI_POLY_PRESSURE:
+      ESP_LOGD(TAG, "Polyacustic Pressure: %d pressure: %d, ch: %d", midi->data[0], midi->data[1], ch);
+      return 0;
+    case MIDI_CTRL_CHANGE:
+      ESP_LOGD(TAG, "Control Change: %d value: %d, ch: %d", midi->data[0], midi->data[1], ch);
+      return midi_ctrl_change(midi->data[0], midi->data[1], ch, msg);
+    case MIDI_PRG_CHANGE:
+      ESP_LOGD(TAG, "Program Change: %d ch: %d", midi->data[0], ch);
+      return midi_program_change(midi_channel_bank(ch), midi->data[0], ch, msg);
+    case MIDI_CHAN_PRESSURE:
+      ESP_LOGD(TAG, "Channel Pressure: %d ch: %d", midi->data[0], ch);
+      return 0;
+    case MIDI_PITCH_BEND:
+      ESP_LOGD(TAG, "Pitch Bend: %d ch: %d", (midi->data[0] | (midi->data[1] << 7)), ch);
+      return midi_pitch_bend((int16_t)(midi->data[0] | (midi->data[1] << 7)), ch, msg);
+    default:
+      ESP_LOGD(TAG, "System Message: %x", midi->status);
+      return 0;
+  }
 }
 
 void midi_srv_run(void *param) {
   ESP_LOGI(TAG, "ready");
 
-  while(1) {
-    uint8_t status;
-    uint8_t data[2];
+  midi_parser_t parser;
+  midi_parser_reset(&parser);
+
+  uint8_t buf[DRAIN_BUF_SIZE];
+  opl_msg_t msgs[MSG_BATCH_LEN];
 
-    if (uart_read_bytes(MIDI_UART, &status, 1, portMAX_DELAY) < 1) {
+  while(1) {
+    int len = uart_read_bytes(MIDI_UART, buf, 1, portMAX_DELAY);
+    if (len < 1) {
       continue;
     }
 
-    switch(status & 0xf0) {
-      case MIDI_NOTE_OFF:
-        uart_read_bytes(MIDI_UART, &data, 2, pdTICKS_TO_MS(RECV_TIMEOUT));
-        ESP_LOGD(TAG, "Note Off: %d velocity: %d, ch: %d", data[0], data[1], (status & 0xf));
-        midi_queue_note(NOTE_OFF, data[0], data[1], (status & 0xf));
-        break;
-      case MIDI_NOTE_ON:
-        uart_read_bytes(MIDI_UART, &data, 2, pdTICKS_TO_MS(RECV_TIMEOUT));
-        ESP_LOGD(TAG, "Note On: %d velocity: %d, ch: %d", data[0], data[1], (status & 0xf));
-        midi_queue_note(NOTE_ON, data[0], data[1], (status & 0xf));
-        break;
-      case MIDI_POLY_PRESSURE:
-        uart_read_bytes(MIDI_UART, &data, 2, pdTICKS_TO_MS(RECV_TIMEOUT));
-        ESP_LOGD(TAG, "Polyacustic Pressure: %d pressure: %d, ch: %d", data[0], data[1], (status & 0xf));
-        break;        
-      case MIDI_CTRL_CHANGE:
-        uart_read_bytes(MIDI_UART, &data, 2, pdTICKS_TO_MS(RECV_TIMEOUT));
-        ESP_LOGD(TAG, "Control Change: %d value: %d, ch: %d", data[0], data[1], (status & 0xf));
-        midi_ctrl_change(data[0], data[1]);
-        break;
-      case MIDI_PRG_CHANGE:
-        uart_read_bytes(MIDI_UART, &data, 1, pdTICKS_TO_MS(RECV_TIMEOUT));
-        ESP_LOGD(TAG, "Program Change: %d ch: %d", data[0], (status & 0xf));
-        midi_program_change(g_synth.bank_num, data[0]);
-        break;
-      case MIDI_CHAN_PRESSURE:
-        uart_read_bytes(MIDI_UART, &data, 1, pdTICKS_TO_MS(RECV_TIMEOUT));
-        ESP_LOGD(TAG, "Channel Pressure: %d ch: %d", data[0], (status & 0xf));
-        break;
-      case MIDI_PITCH_BEND:
-        uart_read_bytes(MIDI_UART, &data, 2, pdTICKS_TO_MS(RECV_TIMEOUT));
-        ESP_LOGD(TAG, "Pitch Bend: %d ch: %d", (data[0] | (data[1] << 7)), (status & 0xf));
-        midi_pitch_bend((int16_t)(data[0] | (data[1] << 7)));
-        break;
-      case MIDI_SYSTEM:
-        ESP_LOGD(TAG, "System Message: %x", status);
-        break;   
-      default:
-        ESP_LOGD(TAG, "Skipped data byte: %x ", status);
-        break;     
+    uint32_t ingress_us = (uint32_t) esp_timer_get_time();
+
+    // drain whatever else is already buffered without waiting
+    size_t pending;
+    if ((uart_get_buffered_data_len(MIDI_UART, &pending) == ESP_OK) && (pending > 0)) {
+      if (pending > (DRAIN_BUF_SIZE - 1)) {
+        pending = DRAIN_BUF_SIZE - 1;
+      }
+
+      int more = uart_read_bytes(MIDI_UART, &buf[1], pending, 0);
+      if (more > 0) {
+        len += more;
+      }
+    }
+
+    size_t count = 0;
+
+    for (int i = 0; i < len; i++) {
+      midi_msg_t midi;
+      if (!midi_parser_feed(&parser, buf[i], &midi)) {
+        continue;
+      }
+
+      count += midi_srv_to_opl(&midi, &msgs[count]);
+
+      if (count == MSG_BATCH_LEN) {
+        opl_srv_queue_msgs(OPL_SRC_DIN, msgs, count, ingress_us);
+        count = 0;
+      }
+    }
+
+    if (count > 0) {
+      opl_srv_queue_msgs(OPL_SRC_DIN, msgs, count, ingress_us);
     }
   }
 }
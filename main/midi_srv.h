@@ -1,6 +1,11 @@
 #ifndef __MIDI_SRV__
 #define __MIDI_SRV__
 
+#include "midi_parser.h"
+#include "opl_srv.h"
+
 void midi_srv_start();
+// Returns 1 when the MIDI message translates to an OPL message
+int midi_srv_to_opl(const midi_msg_t* midi, opl_msg_t* msg);
 
 #endif
\ No newline at end of file
@@ -1,91 +1,135 @@
+#include <string.h>
+
 #include "opl_bus.h"
-#include "driver/spi_master.h"
-#include "driver/gpio.h"
-#include "rom/ets_sys.h"
 
-#define OPL_NRESET_PIN 4
-#define OPL_NWRITE_PIN 5
-#define OPL_ADDR_DATA_PIN 6
-#define OPL_ADDR_HIGH_PIN 7
-#define OPL_DATA_LATCH_PIN 10
-#define OPL_DATA_OUT_PIN 11
-#define OPL_DATA_CLK_PIN 12
+#define OPL_BUS_BATCH_LEN 256
 
-#define OPL_RESET_DELAY_US 30
-#define OPL_ADDR_DATA_DELAY_US 3
+// both register banks, the bank is selected by bit 15 of the address
+#define OPL_REG_COUNT 512
 
-#define OPL_SPI SPI2_HOST
+#ifdef ESP_PLATFORM
+static const opl_bus_backend_t* backend = &OPL_BUS_SPI;
+#else
+static const opl_bus_backend_t* backend = &OPL_BUS_REC;
+#endif
 
-static spi_device_handle_t spi;
+static uint8_t shadow[OPL_REG_COUNT];
+static opl_bus_stats_t stats;
 
-esp_err_t opl_bus_init() {
+static opl_bus_reg_t batch[OPL_BUS_BATCH_LEN];
+static size_t batch_len;
+static int batch_depth;
+
+static inline uint16_t opl_bus_shadow_idx(uint16_t addr) {
+  return ((addr >> 7) & 0x100) | (addr & 0xff);
+}
+
+static esp_err_t opl_bus_flush() {
   esp_err_t ret;
 
-  gpio_config_t io_conf = {};
-  io_conf.mode = GPIO_MODE_OUTPUT;
-  io_conf.pin_bit_mask = (1 << OPL_NRESET_PIN) | (1 << OPL_NWRITE_PIN) | (1 << OPL_ADDR_DATA_PIN) | (1 << OPL_ADDR_HIGH_PIN);
-  ret = gpio_config(&io_conf);
-  ESP_ERROR_CHECK(ret);
-
-  gpio_set_level(OPL_NRESET_PIN, 0);
-  gpio_set_level(OPL_NWRITE_PIN, 1);
-  gpio_set_level(OPL_ADDR_DATA_PIN, 0);
-  gpio_set_level(OPL_ADDR_HIGH_PIN, 0);
-    
-  spi_bus_config_t buscfg = {
-    .miso_io_num = -1,
-    .mosi_io_num = OPL_DATA_OUT_PIN,
-    .sclk_io_num = OPL_DATA_CLK_PIN,
-    .quadwp_io_num = -1,
-    .quadhd_io_num = -1
-  };
-
-  spi_device_interface_config_t devcfg = {
-    .clock_speed_hz = SPI_MASTER_FREQ_20M,
-    .mode = 0,
-    .spics_io_num = OPL_DATA_LATCH_PIN,
-    .queue_size = 1,
-  };
-
-  ret = spi_bus_initialize(OPL_SPI, &buscfg, SPI_DMA_DISABLED);
-  ESP_ERROR_CHECK(ret);
-  ret = spi_bus_add_device(OPL_SPI, &devcfg, &spi);
-  ESP_ERROR_CHECK(ret);
-  ret = spi_device_acquire_bus(spi, portMAX_DELAY);
-  ESP_ERROR_CHECK(ret);
-
-  ets_delay_us(OPL_RESET_DELAY_US);
-  gpio_set_level(OPL_NRESET_PIN, 1);
+  if (batch_len == 1) {
+    ret = backend->write(batch[0].addr, batch[0].data);
+  } else {
+    ret = backend->write_batch(batch, batch_len);
+  }
 
+  batch_len = 0;
+  return ret;
+}
+
+void opl_bus_set_backend(const opl_bus_backend_t* b) {
+  backend = b;
+}
+
+esp_err_t opl_bus_init() {
+  esp_err_t ret = backend->init();
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  // the backend resets the chip on init
+  memset(shadow, 0, OPL_REG_COUNT);
   return ESP_OK;
 }
 
+esp_err_t opl_bus_reset() {
+  batch_len = 0;
+
+  // the chip clears all registers on reset
+  memset(shadow, 0, OPL_REG_COUNT);
+
+  return backend->reset();
+}
+
+static esp_err_t opl_bus_append(uint16_t addr, uint8_t data) {
+  esp_err_t ret = ESP_OK;
+
+  if (batch_len == OPL_BUS_BATCH_LEN) {
+    ret = opl_bus_flush();
+  }
+
+  shadow[opl_bus_shadow_idx(addr)] = data;
+  batch[batch_len].addr = addr;
+  batch[batch_len].data = data;
+  batch_len++;
+  stats.issued++;
+
+  return ret;
+}
+
+esp_err_t opl_bus_write_force(uint16_t addr, uint8_t data) {
+  opl_bus_begin();
+  opl_bus_append(addr, data);
+  return opl_bus_commit();
+}
+
 esp_err_t opl_bus_write(uint16_t addr, uint8_t data) {
-  esp_err_t ret;
+  // goes through the batch so that ordering with pending writes is kept
+  opl_bus_begin();
+  opl_bus_queue(addr, data);
+  return opl_bus_commit();
+}
+
+void opl_bus_get_stats(opl_bus_stats_t* out) {
+  *out = stats;
+}
+
+void opl_bus_reset_stats() {
+  memset(&stats, 0, sizeof(opl_bus_stats_t));
+}
+
+esp_err_t opl_bus_write_batch(const opl_bus_reg_t* regs, size_t count) {
+  opl_bus_begin();
+
+  for (int i = 0; i < count; i++) {
+    opl_bus_queue(regs[i].addr, regs[i].data);
+  }
+
+  return opl_bus_commit();
+}
+
+void opl_bus_begin() {
+  batch_depth++;
+}
+
+esp_err_t opl_bus_queue(uint16_t addr, uint8_t data) {
+  // the shadow is updated at queue time, so values already pending in the batch are not queued again
+  if (shadow[opl_bus_shadow_idx(addr)] == data) {
+    stats.elided++;
+    return ESP_OK;
+  }
+
+  return opl_bus_append(addr, data);
+}
+
+esp_err_t opl_bus_commit() {
+  if (batch_depth == 0) {
+    return ESP_ERR_INVALID_STATE;
+  }
 
-  spi_transaction_t tx = {
-    .length = 8,
-    .flags = SPI_TRANS_USE_TXDATA
-  };
-
-  gpio_set_level(OPL_ADDR_DATA_PIN, 0);
-  gpio_set_level(OPL_ADDR_HIGH_PIN, (addr >> 15)); 
-  tx.tx_data[0] = (uint8_t)(addr & 0xff);
-  ret = spi_device_transmit(spi, &tx);
-  ESP_ERROR_CHECK(ret);
-  
-  gpio_set_level(OPL_NWRITE_PIN, 0);
-  ets_delay_us(OPL_ADDR_DATA_DELAY_US);
-  gpio_set_level(OPL_NWRITE_PIN, 1);
-
-  gpio_set_level(OPL_ADDR_DATA_PIN, 1);
-  tx.tx_data[0] = data;
-  ret = spi_device_transmit(spi, &tx);
-  ESP_ERROR_CHECK(ret);
-
-  gpio_set_level(OPL_NWRITE_PIN, 0);
-  ets_delay_us(OPL_ADDR_DATA_DELAY_US);
-  gpio_set_level(OPL_NWRITE_PIN, 1);
+  if (--batch_depth == 0 && batch_len > 0) {
+    return opl_bus_flush();
+  }
 
   return ESP_OK;
 }
\ No newline at end of file
@@ -1,10 +1,47 @@
 #ifndef __OPL_BUS__
 #define __OPL_BUS__
 
+#include <stddef.h>
+#include <stdint.h>
 #include "esp_err.h"
 
+typedef struct {
+  uint16_t addr;
+  uint8_t data;
+} opl_bus_reg_t;
+
+typedef struct {
+  uint32_t issued;
+  uint32_t elided;
+} opl_bus_stats_t;
+
+typedef struct {
+  esp_err_t (*init)();
+  esp_err_t (*reset)();
+  esp_err_t (*write)(uint16_t addr, uint8_t data);
+  esp_err_t (*write_batch)(const opl_bus_reg_t* regs, size_t count);
+} opl_bus_backend_t;
+
+// ESP32 SPI/GPIO driver for the board
+extern const opl_bus_backend_t OPL_BUS_SPI;
+// Records writes in memory, see opl_bus_rec.h
+extern const opl_bus_backend_t OPL_BUS_REC;
+
+// Must be called before opl_bus_init
+void opl_bus_set_backend(const opl_bus_backend_t* backend);
+
 esp_err_t opl_bus_init();
 esp_err_t opl_bus_reset();
 esp_err_t opl_bus_write(uint16_t addr, uint8_t data);
+esp_err_t opl_bus_write_force(uint16_t addr, uint8_t data);
+esp_err_t opl_bus_write_batch(const opl_bus_reg_t* regs, size_t count);
+
+// Batches can be nested, the writes are only sent on the outermost commit
+void opl_bus_begin();
+esp_err_t opl_bus_queue(uint16_t addr, uint8_t data);
+esp_err_t opl_bus_commit();
+
+void opl_bus_get_stats(opl_bus_stats_t* out);
+void opl_bus_reset_stats();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include <string.h>
+
+#include "opl_bus.h"
+#include "opl_bus_rec.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#else
+#include <time.h>
+#endif
+
+static opl_bus_rec_entry_t entries[OPL_BUS_REC_LEN];
+static size_t entry_count;
+static opl_bus_rec_stats_t stats;
+
+static inline uint32_t opl_bus_rec_now() {
+#ifdef ESP_PLATFORM
+  return (uint32_t) esp_timer_get_time();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) ((ts.tv_sec * 1000000ull) + (ts.tv_nsec / 1000));
+#endif
+}
+
+static esp_err_t opl_bus_rec_init() {
+  opl_bus_rec_clear();
+  return ESP_OK;
+}
+
+static esp_err_t opl_bus_rec_reset() {
+  stats.resets++;
+  return ESP_OK;
+}
+
+static esp_err_t opl_bus_rec_write_batch(const opl_bus_reg_t* regs, size_t count) {
+  uint32_t now = opl_bus_rec_now();
+  stats.batches++;
+
+  for (int i = 0; i < count; i++) {
+    if (entry_count == OPL_BUS_REC_LEN) {
+      stats.dropped += (count - i);
+      break;
+    }
+
+    entries[entry_count].timestamp_us = now;
+    entries[entry_count].addr = regs[i].addr;
+    entries[entry_count].data = regs[i].data;
+    entry_count++;
+  }
+
+  return ESP_OK;
+}
+
+static esp_err_t opl_bus_rec_write(uint16_t addr, uint8_t data) {
+  opl_bus_reg_t reg = { .addr = addr, .data = data };
+  return opl_bus_rec_write_batch(&reg, 1);
+}
+
+const opl_bus_rec_entry_t* opl_bus_rec_entries(size_t* count) {
+  *count = entry_count;
+  return entries;
+}
+
+void opl_bus_rec_get_stats(opl_bus_rec_stats_t* out) {
+  *out = stats;
+}
+
+void opl_bus_rec_clear() {
+  entry_count = 0;
+  memset(&stats, 0, sizeof(opl_bus_rec_stats_t));
+}
+
+const opl_bus_backend_t OPL_BUS_REC = {
+  .init = opl_bus_rec_init,
+  .reset = opl_bus_rec_reset,
+  .write = opl_bus_rec_write,
+  .write_batch = opl_bus_rec_write_batch,
+};
\ No newline at end of file
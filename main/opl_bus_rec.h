@@ -0,0 +1,25 @@
+#ifndef __OPL_BUS_REC__
+#define __OPL_BUS_REC__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OPL_BUS_REC_LEN 4096
+
+typedef struct {
+  uint32_t timestamp_us;
+  uint16_t addr;
+  uint8_t data;
+} opl_bus_rec_entry_t;
+
+typedef struct {
+  uint32_t resets;
+  uint32_t batches;
+  uint32_t dropped;
+} opl_bus_rec_stats_t;
+
+const opl_bus_rec_entry_t* opl_bus_rec_entries(size_t* count);
+void opl_bus_rec_get_stats(opl_bus_rec_stats_t* out);
+void opl_bus_rec_clear();
+
+#endif
\ No newline at end of file
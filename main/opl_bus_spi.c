@@ -0,0 +1,180 @@
+#include <string.h>
+
+#include "opl_bus.h"
+#include "driver/spi_master.h"
+#include "driver/gpio.h"
+#include "hal/gpio_ll.h"
+#include "soc/gpio_struct.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "esp_attr.h"
+#include "rom/ets_sys.h"
+
+#define OPL_NRESET_PIN 4
+#define OPL_NWRITE_PIN 5
+#define OPL_ADDR_DATA_PIN 6
+#define OPL_ADDR_HIGH_PIN 7
+#define OPL_DATA_LATCH_PIN 10
+#define OPL_DATA_OUT_PIN 11
+#define OPL_DATA_CLK_PIN 12
+
+#define OPL_RESET_DELAY_US 30
+#define OPL_ADDR_DATA_DELAY_US 3
+#define OPL_WRITE_PULSE_NS 100
+
+#define OPL_SPI SPI2_HOST
+#define OPL_SPI_CLOCK_MHZ 20
+#define OPL_SPI_QUEUE_LEN 16
+// The shift register keeps the last byte clocked in, the bytes before it stretch each frame to the time the chip needs
+// between two writes. The next byte is only latched once that time has passed.
+#define OPL_SPI_FRAME_LEN (((OPL_ADDR_DATA_DELAY_US * OPL_SPI_CLOCK_MHZ) + 7) / 8)
+
+// pin levels of a transaction, set before it is clocked out
+#define OPL_SPI_A0 0x1
+#define OPL_SPI_A1 0x2
+
+static spi_device_handle_t spi;
+
+// transactions in flight, oldest first from tx_next - tx_queued
+static spi_transaction_t txs[OPL_SPI_QUEUE_LEN];
+static uint8_t frames[OPL_SPI_QUEUE_LEN][OPL_SPI_FRAME_LEN];
+static uint8_t tx_next;
+static uint8_t tx_queued;
+
+static esp_err_t opl_bus_spi_reset() {
+  gpio_set_level(OPL_NRESET_PIN, 0);
+  ets_delay_us(OPL_RESET_DELAY_US);
+  gpio_set_level(OPL_NRESET_PIN, 1);
+
+  return ESP_OK;
+}
+
+// Run from the SPI interrupt, the address pins change while the write strobe is high
+static void IRAM_ATTR opl_bus_spi_pre(spi_transaction_t* tx) {
+  uint32_t pins = (uint32_t) tx->user;
+  gpio_ll_set_level(&GPIO, OPL_ADDR_DATA_PIN, (pins & OPL_SPI_A0) ? 1 : 0);
+  gpio_ll_set_level(&GPIO, OPL_ADDR_HIGH_PIN, (pins & OPL_SPI_A1) ? 1 : 0);
+}
+
+// The byte is latched when chip select rises at the end of the transaction, the strobe writes it to the chip
+static void IRAM_ATTR opl_bus_spi_post(spi_transaction_t* tx) {
+  uint32_t start = esp_cpu_get_cycle_count();
+  uint32_t pulse = (OPL_WRITE_PULSE_NS * esp_rom_get_cpu_ticks_per_us() + 999) / 1000;
+
+  gpio_ll_set_level(&GPIO, OPL_NWRITE_PIN, 0);
+  while ((esp_cpu_get_cycle_count() - start) < pulse);
+  gpio_ll_set_level(&GPIO, OPL_NWRITE_PIN, 1);
+}
+
+static esp_err_t opl_bus_spi_init() {
+  esp_err_t ret;
+
+  gpio_config_t io_conf = {};
+  io_conf.mode = GPIO_MODE_OUTPUT;
+  io_conf.pin_bit_mask = (1 << OPL_NRESET_PIN) | (1 << OPL_NWRITE_PIN) | (1 << OPL_ADDR_DATA_PIN) | (1 << OPL_ADDR_HIGH_PIN);
+  ret = gpio_config(&io_conf);
+  ESP_ERROR_CHECK(ret);
+
+  gpio_set_level(OPL_NRESET_PIN, 0);
+  gpio_set_level(OPL_NWRITE_PIN, 1);
+  gpio_set_level(OPL_ADDR_DATA_PIN, 0);
+  gpio_set_level(OPL_ADDR_HIGH_PIN, 0);
+    
+  spi_bus_config_t buscfg = {
+    .miso_io_num = -1,
+    .mosi_io_num = OPL_DATA_OUT_PIN,
+    .sclk_io_num = OPL_DATA_CLK_PIN,
+    .quadwp_io_num = -1,
+    .quadhd_io_num = -1
+  };
+
+  spi_device_interface_config_t devcfg = {
+    .clock_speed_hz = OPL_SPI_CLOCK_MHZ * 1000 * 1000,
+    .mode = 0,
+    .spics_io_num = OPL_DATA_LATCH_PIN,
+    .queue_size = OPL_SPI_QUEUE_LEN,
+    .pre_cb = opl_bus_spi_pre,
+    .post_cb = opl_bus_spi_post,
+  };
+
+  ret = spi_bus_initialize(OPL_SPI, &buscfg, SPI_DMA_DISABLED);
+  ESP_ERROR_CHECK(ret);
+  ret = spi_bus_add_device(OPL_SPI, &devcfg, &spi);
+  ESP_ERROR_CHECK(ret);
+  ret = spi_device_acquire_bus(spi, portMAX_DELAY);
+  ESP_ERROR_CHECK(ret);
+
+  return opl_bus_spi_reset();
+}
+
+// Waits, without spinning, for the oldest transaction in flight
+static esp_err_t opl_bus_spi_reclaim() {
+  spi_transaction_t* done;
+  esp_err_t err = spi_device_get_trans_result(spi, &done, portMAX_DELAY);
+  tx_queued--;
+
+  return err;
+}
+
+static esp_err_t opl_bus_spi_queue(uint8_t val, uint32_t pins) {
+  esp_err_t err = ESP_OK;
+
+  if (tx_queued == OPL_SPI_QUEUE_LEN) {
+    err = opl_bus_spi_reclaim();
+  }
+
+  spi_transaction_t* tx = &txs[tx_next];
+  uint8_t* frame = frames[tx_next];
+  tx_next = (tx_next + 1) % OPL_SPI_QUEUE_LEN;
+
+  memset(frame, 0, OPL_SPI_FRAME_LEN - 1);
+  frame[OPL_SPI_FRAME_LEN - 1] = val;
+
+  memset(tx, 0, sizeof(spi_transaction_t));
+  tx->length = OPL_SPI_FRAME_LEN * 8;
+  tx->tx_buffer = frame;
+  tx->user = (void*) pins;
+
+  esp_err_t queue_err = spi_device_queue_trans(spi, tx, portMAX_DELAY);
+  if (queue_err == ESP_OK) {
+    tx_queued++;
+  }
+
+  return (err != ESP_OK) ? err : queue_err;
+}
+
+// The whole batch is queued, the SPI interrupt moves from one write to the next and the task sleeps until the last one
+// is out
+static esp_err_t opl_bus_spi_write_batch(const opl_bus_reg_t* regs, size_t count) {
+  esp_err_t err = ESP_OK;
+
+  for (int i = 0; (i < count) && (err == ESP_OK); i++) {
+    uint32_t high = (regs[i].addr >> 15) ? OPL_SPI_A1 : 0;
+    err = opl_bus_spi_queue((uint8_t)(regs[i].addr & 0xff), high);
+
+    if (err == ESP_OK) {
+      err = opl_bus_spi_queue(regs[i].data, high | OPL_SPI_A0);
+    }
+  }
+
+  while (tx_queued > 0) {
+    esp_err_t done_err = opl_bus_spi_reclaim();
+    if (err == ESP_OK) {
+      err = done_err;
+    }
+  }
+
+  return err;
+}
+
+static esp_err_t opl_bus_spi_write(uint16_t addr, uint8_t data) {
+  opl_bus_reg_t reg = { .addr = addr, .data = data };
+  return opl_bus_spi_write_batch(&reg, 1);
+}
+
+const opl_bus_backend_t OPL_BUS_SPI = {
+  .init = opl_bus_spi_init,
+  .reset = opl_bus_spi_reset,
+  .write = opl_bus_spi_write,
+  .write_batch = opl_bus_spi_write_batch,
+};
\ No newline at end of file
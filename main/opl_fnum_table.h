@@ -0,0 +1,38 @@
+// Generated by tools/gen_fnum_table.py, do not edit
+#ifndef __OPL_FNUM_TABLE__
+#define __OPL_FNUM_TABLE__
+
+#include <stdint.h>
+
+#define OPL_FNUM_OCTAVE_STEPS 384
+// pitch, in fine steps above MIDI note 0, of the first entry at block 0
+#define OPL_FNUM_OCTAVE_BASE 603
+
+static const uint16_t OPL_FNUM_OCTAVE[OPL_FNUM_OCTAVE_STEPS] = {
+  512, 513, 514, 515, 516, 517, 518, 519, 520, 520, 521, 522, 523, 524, 525, 526,
+  527, 528, 529, 530, 531, 532, 533, 534, 535, 536, 537, 538, 539, 540, 541, 542,
+  543, 544, 545, 545, 546, 547, 548, 549, 550, 551, 552, 553, 554, 555, 556, 557,
+  558, 559, 560, 561, 562, 563, 565, 566, 567, 568, 569, 570, 571, 572, 573, 574,
+  575, 576, 577, 578, 579, 580, 581, 582, 583, 584, 585, 586, 587, 588, 590, 591,
+  592, 593, 594, 595, 596, 597, 598, 599, 600, 601, 602, 604, 605, 606, 607, 608,
+  609, 610, 611, 612, 613, 615, 616, 617, 618, 619, 620, 621, 622, 623, 625, 626,
+  627, 628, 629, 630, 631, 633, 634, 635, 636, 637, 638, 639, 641, 642, 643, 644,
+  645, 646, 648, 649, 650, 651, 652, 653, 655, 656, 657, 658, 659, 661, 662, 663,
+  664, 665, 666, 668, 669, 670, 671, 673, 674, 675, 676, 677, 679, 680, 681, 682,
+  684, 685, 686, 687, 689, 690, 691, 692, 693, 695, 696, 697, 699, 700, 701, 702,
+  704, 705, 706, 707, 709, 710, 711, 713, 714, 715, 716, 718, 719, 720, 722, 723,
+  724, 726, 727, 728, 729, 731, 732, 733, 735, 736, 737, 739, 740, 741, 743, 744,
+  745, 747, 748, 749, 751, 752, 754, 755, 756, 758, 759, 760, 762, 763, 765, 766,
+  767, 769, 770, 771, 773, 774, 776, 777, 778, 780, 781, 783, 784, 785, 787, 788,
+  790, 791, 793, 794, 795, 797, 798, 800, 801, 803, 804, 806, 807, 808, 810, 811,
+  813, 814, 816, 817, 819, 820, 822, 823, 825, 826, 828, 829, 831, 832, 834, 835,
+  837, 838, 840, 841, 843, 844, 846, 847, 849, 850, 852, 853, 855, 857, 858, 860,
+  861, 863, 864, 866, 867, 869, 871, 872, 874, 875, 877, 878, 880, 882, 883, 885,
+  886, 888, 890, 891, 893, 894, 896, 898, 899, 901, 903, 904, 906, 908, 909, 911,
+  912, 914, 916, 917, 919, 921, 922, 924, 926, 927, 929, 931, 932, 934, 936, 937,
+  939, 941, 943, 944, 946, 948, 949, 951, 953, 955, 956, 958, 960, 961, 963, 965,
+  967, 968, 970, 972, 974, 975, 977, 979, 981, 983, 984, 986, 988, 990, 991, 993,
+  995, 997, 999, 1000, 1002, 1004, 1006, 1008, 1009, 1011, 1013, 1015, 1017, 1019, 1020, 1022,
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __OPL_RING__
+#define __OPL_RING__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Lock-free ring of fixed size elements between exactly one producer task and one consumer task. Each index is only
+// written by its own side, the release store of the head publishes the element and the release store of the tail hands
+// its slot back. The capacity is a power of two, indices run freely and wrap through the mask.
+typedef struct {
+  uint8_t* buf;
+  uint32_t elem_size;
+  uint32_t mask;
+  // next slot to write, producer side
+  uint32_t head;
+  // next slot to read, consumer side
+  uint32_t tail;
+} opl_ring_t;
+
+static inline void opl_ring_init(opl_ring_t* r, void* buf, size_t elem_size, uint32_t capacity) {
+  r->buf = buf;
+  r->elem_size = elem_size;
+  r->mask = capacity - 1;
+  r->head = 0;
+  r->tail = 0;
+}
+
+// Producer side, false when the ring is full
+static inline bool opl_ring_push(opl_ring_t* r, const void* elem) {
+  uint32_t head = r->head;
+
+  if ((head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) > r->mask) {
+    return false;
+  }
+
+  memcpy(r->buf + (head & r->mask) * r->elem_size, elem, r->elem_size);
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+// Consumer side, the oldest element or NULL when empty. It stays valid until opl_ring_pop.
+static inline const void* opl_ring_peek(opl_ring_t* r) {
+  uint32_t tail = r->tail;
+
+  if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  return r->buf + (tail & r->mask) * r->elem_size;
+}
+
+static inline void opl_ring_pop(opl_ring_t* r) {
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -2,16 +2,23 @@
 
 #include "opl_srv.h"
 #include "opl_bus.h"
+#include "opl_ring.h"
+#include "opl_stats.h"
+#include "opl_fnum_table.h"
 #include "synth.h"
 #include "freertos/FreeRTOSConfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #define OPL_SRV_STACK_SIZE 8192
-#define OPL_SRV_QUEUE_LEN 32
+#define OPL_SRV_NOTE_LANE_LEN 64
+#define OPL_SRV_CFG_LANE_LEN 16
 #define OPL_SRV_QUEUE_TIMEOUT_MS 20
+#define OPL_SRV_BURST_LEN 32
+#define OPL_SRV_MIN_GATE_MS 5
+#define OPL_SRV_DEFERRED_LEN 32
 
 #define OPL_CHANNEL_COUNT 18
 #define OPL_OP_COUNT_BANK 18
@@ -38,6 +45,11 @@
 #define OPL_OPL3_2OPS_MODE 0x00
 #define OPL_OPL3_ENABLE 0x01
 
+#define OPL_POOL_TIMBRE(part, id) (((part) << 3) | (id))
+#define OPL_POOL_TIMBRE_PART(timbre) (((timbre) >> 3) & 0x7)
+#define OPL_POOL_TIMBRE_4OPS 0x40
+#define OPL_POOL_TIMBRE_NONE 0xff
+
 static const uint8_t OPL_VOICE_TO_CHANNEL[OPL_CHANNEL_COUNT] = { 6, 7, 8, 15, 16, 17, 0, 1, 2, 9, 10, 11, 3, 4, 5, 12, 13, 14 };
 static const uint8_t OPL_CHANNEL_OPS[OPL_CHANNEL_COUNT][4] = { 
   {0, 3, 6, 9},
@@ -62,10 +74,17 @@ static const uint8_t OPL_CHANNEL_OPS[OPL_CHANNEL_COUNT][4] = {
 
 static const uint8_t OPL_OP_REG_OFF[OPL_OP_COUNT_BANK] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15 };
 
-static const uint16_t OPL_NOTE_TO_FNUM[12] = {
-	345, 365, 387, 410, 435, 460, 488, 517, 547, 580, 615, 651
+// time for a release to fade out from full level, it halves with each rate step and ignores key scaling so it errs
+// long. Rate 0 never ends, it is capped.
+static const uint16_t OPL_RELEASE_MS[16] = {
+  0xffff, 39280, 19640, 9820, 4910, 2455, 1227, 614, 307, 153, 77, 38, 19, 10, 5, 3
 };
 
+_Static_assert(OPL_FNUM_OCTAVE_STEPS == (12 * OPL_PITCH_FINE), "opl_fnum_table.h does not match OPL_PITCH_FINE");
+
+#define OPL_BLOCK_MAX 7
+#define OPL_FNUM_MAX 1023
+
 static const uint8_t OPL_VELOCITY_TO_OUTPUT_LEVEL[64] = {
   0x3f, 0x3a, 0x35, 0x30, 0x2c, 0x29, 0x25, 0x24,
   0x23, 0x22, 0x21, 0x20, 0x1f, 0x1e, 0x1d, 0x1c,
@@ -91,10 +110,93 @@ static const enum opl_op_role OP_ROLE_4OPS[4][4] = {
   {OP_CARRIER, OP_MOD1, OP_CARRIER, OP_CARRIER},
 };
 
+typedef struct {
+  opl_msg_t msg;
+  opl_src_t src;
+  // position among all the messages of the source, across its two lanes
+  uint16_t seq;
+  uint32_t ingress_us;
+  uint32_t enqueue_us;
+} opl_event_t;
+
+// note on and off in the note lanes, a third of the size of a full event
+typedef struct {
+  uint32_t ingress_us;
+  uint32_t enqueue_us;
+  uint16_t seq;
+  opl_cmd_t cmd;
+  opl_note_t note;
+} opl_note_ev_t;
+
+#define OPL_NOTE_WORDS (MIDI_CHANNEL_COUNT * MIDI_NOTE_COUNT / 32)
+
+// Every source queues from a single task into its own rings: notes in one, everything else in the other. The OPL task
+// takes notes first, except those queued after a pending config message of the same source, which still go after it.
+// A note off that finds its ring full is never dropped, it is parked as a bit of its note instead. The OPL task takes
+// the parked bits and releases them once it has taken every message queued before the latest of them.
+typedef struct {
+  opl_ring_t notes;
+  opl_ring_t cfgs;
+  // producer side
+  uint16_t seq;
+  // seq of the next message when the latest note off was parked, then its note bit and its MIDI channel bit
+  uint16_t park_seq;
+  uint32_t parked[OPL_NOTE_WORDS];
+  uint32_t parked_channels;
+} opl_lanes_t;
+
+// note offs the OPL task took from the parked bits of a source, released before any message from park_seq on
+typedef struct {
+  uint32_t notes[OPL_NOTE_WORDS];
+  uint32_t channels;
+  uint16_t park_seq;
+} opl_parked_offs_t;
+
 static const char *TAG = "opl_srv";
 
-static QueueHandle_t msg_queue;
+static TaskHandle_t opl_task;
+static opl_lanes_t lanes[OPL_SRC_COUNT];
+static opl_note_ev_t note_lane_bufs[OPL_SRC_COUNT][OPL_SRV_NOTE_LANE_LEN];
+static opl_event_t cfg_lane_bufs[OPL_SRC_COUNT][OPL_SRV_CFG_LANE_LEN];
+static opl_parked_offs_t parked_offs[OPL_SRC_COUNT];
+// block and F-Number of every pitch, as written to the B0 and A0 registers
+static uint16_t pitch_fnum[OPL_PITCH_COUNT];
 static uint8_t fnum_cache[OPL_CHANNEL_COUNT];
+static uint32_t note_on_alloc_us;
+// voices that were sounding during a program switch, their channel registers are written on the next key-on
+static uint32_t pending_voices;
+
+// note off released once the minimum gate time of its note has passed
+typedef struct {
+  opl_msg_t msg;
+  uint32_t due_ms;
+} opl_deferred_off_t;
+
+static opl_event_t burst[OPL_SRV_BURST_LEN];
+// ordered by due time
+static opl_deferred_off_t deferred_offs[OPL_SRV_DEFERRED_LEN];
+static size_t deferred_count;
+// one bit per note of each MIDI channel
+static uint32_t notes_on_in_burst[MIDI_CHANNEL_COUNT * 128 / 32];
+static uint32_t notes_off_deferred[MIDI_CHANNEL_COUNT * 128 / 32];
+
+// multi timbral mode: part and timbre whose registers each pool channel holds, and the channels whose part has changed
+// program since, rewritten on their next key-on
+static uint8_t pool_timbres[OPL_CHANNEL_COUNT];
+static uint32_t pool_stale;
+
+// released channels are still audible until their release fades out, pitch bends skip the others
+static uint16_t release_ms[OPL_CHANNEL_COUNT];
+static uint32_t silent_at_ms[OPL_CHANNEL_COUNT];
+
+// latest pitch bend of each MIDI channel. Producers overwrite it and notify the OPL task, so a burst of bends costs a
+// single update.
+static int16_t bend_slots[MIDI_CHANNEL_COUNT];
+static uint32_t bend_pending;
+static uint32_t bend_merged;
+
+// a config message of the burst may have changed the program of part 0, it is published once the burst is done
+static uint8_t prg_edited;
 
 static inline uint16_t opl_channel_reg_addr(uint8_t base, uint8_t ch) {
   uint16_t hi;
@@ -125,116 +227,291 @@ static inline uint16_t opl_op_reg_addr(uint8_t base, uint8_t op) {
 static void opl_write_channel(uint8_t opl_ch, uint8_t feedback_synth, const opl_operator_t *ops, size_t op_count) {
   for (int i = 0; i < op_count; i++) {
     uint8_t op_id = OPL_CHANNEL_OPS[opl_ch][i];
-    opl_bus_write(opl_op_reg_addr(OPL_OP_TREM_VIBR_SUST_KSR_FMF_BASE, op_id), ops[i].trem_vibr_sust_ksr_fmf);
-    opl_bus_write(opl_op_reg_addr(OPL_OP_KSL_OUTPUT_BASE, op_id), ops[i].ksl_output);
-    opl_bus_write(opl_op_reg_addr(OPL_OP_ATTACK_DECAY_BASE, op_id), ops[i].attack_decay);
-    opl_bus_write(opl_op_reg_addr(OPL_OP_SUSTAIN_RELEASE_BASE, op_id), ops[i].sustain_release);
-    opl_bus_write(opl_op_reg_addr(OPL_OP_WAVEFORM_BASE, op_id), ops[i].waveform);
+    opl_bus_queue(opl_op_reg_addr(OPL_OP_TREM_VIBR_SUST_KSR_FMF_BASE, op_id), ops[i].trem_vibr_sust_ksr_fmf);
+    opl_bus_queue(opl_op_reg_addr(OPL_OP_KSL_OUTPUT_BASE, op_id), ops[i].ksl_output);
+    opl_bus_queue(opl_op_reg_addr(OPL_OP_ATTACK_DECAY_BASE, op_id), ops[i].attack_decay);
+    opl_bus_queue(opl_op_reg_addr(OPL_OP_SUSTAIN_RELEASE_BASE, op_id), ops[i].sustain_release);
+    opl_bus_queue(opl_op_reg_addr(OPL_OP_WAVEFORM_BASE, op_id), ops[i].waveform);
   }
 
-  opl_bus_write(opl_channel_reg_addr(OPL_CH_CHANNELS_FMF_SYNTH_BASE, opl_ch), (feedback_synth & 0x3f));
+  opl_bus_queue(opl_channel_reg_addr(OPL_CH_CHANNELS_FMF_SYNTH_BASE, opl_ch), (feedback_synth & 0x3f));
 
   if (op_count == 4) {
-    opl_bus_write(opl_channel_reg_addr(OPL_CH_CHANNELS_FMF_SYNTH_BASE, (opl_ch + 3)), ((feedback_synth & 0x3e) | ((feedback_synth & 0x80) >> 7)));
+    opl_bus_queue(opl_channel_reg_addr(OPL_CH_CHANNELS_FMF_SYNTH_BASE, (opl_ch + 3)), ((feedback_synth & 0x3e) | ((feedback_synth & 0x80) >> 7)));
+  }
+}
+
+static void opl_write_voice(uint8_t voice) {
+  if (voice < DRUMKIT_SIZE) {
+    opl_write_channel(OPL_VOICE_TO_CHANNEL[voice], g_synth.prg->drumkit[voice].ch_feedback_synth, g_synth.prg->drumkit[voice].ops, 2);
+  } else {
+    opl_write_channel(OPL_VOICE_TO_CHANNEL[voice], g_synth.prg->keyboard.ch_feedback_synth, g_synth.prg->keyboard.ops, g_synth.prg->config.map ? 2 : 4);
+  }
+
+  pending_voices &= ~(1 << voice);
+}
+
+static inline uint8_t opl_voice_sounding(uint8_t voice) {
+  if (voice < DRUMKIT_SIZE) {
+    return (g_synth.drumkit_voices >> voice) & 1;
+  } else {
+    return !(g_synth.voices.voices[voice - DRUMKIT_SIZE].note & SYNTH_NOTE_OFF);
   }
 }
 
-static inline uint16_t opl_midi_note_to_fnum(const opl_note_t* note) {
-  uint16_t fnum = OPL_NOTE_TO_FNUM[note->note % 12];
-  uint16_t octave = (note->note / 12);
+// Every pitch takes the lowest block that fits its F-Number, so the F-Number keeps 10 significant bits. Pitches below
+// block 0 lose bits instead and the ones above block 7 stop at its highest F-Number.
+static void opl_pitch_table_init() {
+  for (int p = 0; p < OPL_PITCH_COUNT; p++) {
+    int step = p - OPL_FNUM_OCTAVE_BASE;
+    uint16_t block, fnum;
+
+    if (step < 0) {
+      int octaves = ((-step) + OPL_FNUM_OCTAVE_STEPS - 1) / OPL_FNUM_OCTAVE_STEPS;
+      block = 0;
+      fnum = OPL_FNUM_OCTAVE[step + (octaves * OPL_FNUM_OCTAVE_STEPS)] >> octaves;
+    } else if ((step / OPL_FNUM_OCTAVE_STEPS) > OPL_BLOCK_MAX) {
+      block = OPL_BLOCK_MAX;
+      fnum = OPL_FNUM_MAX;
+    } else {
+      block = step / OPL_FNUM_OCTAVE_STEPS;
+      fnum = OPL_FNUM_OCTAVE[step % OPL_FNUM_OCTAVE_STEPS];
+    }
 
-  if (!note->drum_channel) {
-    fnum += g_synth.pitch_bend;
+    pitch_fnum[p] = (block << 10) | fnum;
   }
+}
+
+static inline uint16_t opl_part_fnum(const synth_part_t* p, uint8_t note) {
+  int pitch = p->note_pitch[note & 0x7f] + p->bend_steps;
 
-  // MIDI notes start from -1 octave
-  // TODO: actually octave -1 and 0 can both be rendered with block 0, add the fnums if it makes sense
-  if (octave < 1) {
-    octave = 1;
-  } else if (octave > 8) {
-    octave = 8;
+  if (pitch < 0) {
+    pitch = 0;
+  } else if (pitch >= OPL_PITCH_COUNT) {
+    pitch = OPL_PITCH_COUNT - 1;
   }
 
-  return ((octave - 1) << 10) | fnum;
+  return pitch_fnum[pitch];
+}
+
+// drum notes are neither tuned nor bent
+static inline uint16_t opl_drum_fnum(uint8_t note) {
+  return pitch_fnum[(note & 0x7f) * OPL_PITCH_FINE];
 }
 
-static void opl_set_fnum(uint8_t channel, const opl_note_t* note, uint8_t onflag) {
-  uint16_t fnum = opl_midi_note_to_fnum(note);
+static void opl_set_fnum(uint8_t channel, uint16_t fnum, uint8_t onflag) {
   fnum_cache[channel] = (fnum >> 8);
 
-  opl_bus_write(opl_channel_reg_addr(OPL_CH_FREQL_BASE, channel), (uint8_t) (fnum & 0xff));
-  opl_bus_write(opl_channel_reg_addr(OPL_CH_KEYON_BLOCK_FREQH_BASE, channel), onflag | fnum_cache[channel]);  
+  opl_bus_queue(opl_channel_reg_addr(OPL_CH_FREQL_BASE, channel), (uint8_t) (fnum & 0xff));
+  opl_bus_queue(opl_channel_reg_addr(OPL_CH_KEYON_BLOCK_FREQH_BASE, channel), onflag | fnum_cache[channel]);  
 }
 
 static inline uint8_t opl_is_carrier(uint8_t op, uint8_t op_count, uint8_t synth_mode) {
   if (op_count == 2) {
     // in FM only op 1 is carrier, in AM both are
-    return (op | (g_synth.prg.keyboard.ch_feedback_synth & 1));
+    return (op | (synth_mode & 1));
   } else {
     return OP_ROLE_4OPS[synth_mode][op] == OP_CARRIER;
   }
 }
 
+static inline uint8_t opl_synth_mode(uint8_t feedback_synth, uint8_t op_count) {
+  if (op_count == 2) {
+    return feedback_synth & 0x1;
+  } else {
+    return ((feedback_synth & 0x80) >> 6) | (feedback_synth & 0x1);
+  }
+}
+
+static inline uint32_t opl_now_ms() {
+  return (uint32_t) (esp_timer_get_time() / 1000);
+}
+
+static inline uint8_t opl_channel_audible(uint8_t ch, uint8_t note, uint32_t now_ms) {
+  return !(note & SYNTH_NOTE_OFF) || ((int32_t) (silent_at_ms[ch] - now_ms) > 0);
+}
+
+static inline void opl_channel_released(uint8_t ch) {
+  silent_at_ms[ch] = opl_now_ms() + release_ms[ch];
+}
+
+static void opl_key_on(uint8_t ch, const opl_operator_t* ops, uint8_t op_count, uint8_t synth_mode, uint8_t velocity, uint16_t fnum) {
+  uint8_t release_rate = 0xf;
+
+  for (int i = 0; i < op_count; i++) {
+    if (opl_is_carrier(i, op_count, synth_mode)) {
+      uint8_t ksl_ol = (ops[i].ksl_output & 0xc0) | (OPL_VELOCITY_TO_OUTPUT_LEVEL[velocity >> 1] + (ops[i].ksl_output & 0x3f));
+      opl_bus_queue(opl_op_reg_addr(OPL_OP_KSL_OUTPUT_BASE, OPL_CHANNEL_OPS[ch][i]), ksl_ol);
+
+      // the slowest carrier decides when the voice falls silent
+      if ((ops[i].sustain_release & 0xf) < release_rate) {
+        release_rate = ops[i].sustain_release & 0xf;
+      }
+    }
+  }
+
+  release_ms[ch] = OPL_RELEASE_MS[release_rate];
+  opl_set_fnum(ch, fnum, OPL_CH_KEY_ON);
+}
+
+static void opl_part_note_on(const opl_note_t* note) {
+  uint8_t part = synth_channel_part(note->channel);
+  if (part == SYNTH_PART_NONE) {
+    return;
+  }
+
+  opl_channel_id_t id = KEYBOARD;
+  uint8_t owner = part;
+
+  if (part & SYNTH_PART_DRUMS) {
+    part &= ~SYNTH_PART_DRUMS;
+    id = note->note & 0x7;
+
+    if (id >= DRUMKIT_SIZE) {
+      return;
+    }
+  }
+
+  const synth_part_t* p = &g_synth.parts[part];
+  bool four_ops = (id == KEYBOARD) && (p->prg->config.map == KEYBOARD_4OPS);
+
+  uint32_t alloc_start = (uint32_t) esp_timer_get_time();
+  uint8_t ch = synth_add_part_voice(owner, note->note, four_ops);
+  note_on_alloc_us = (uint32_t) esp_timer_get_time() - alloc_start;
+
+  if (ch == VOICE_ALLOC_NONE) {
+    return;
+  }
+
+  // the allocation may have joined or split pairs, the shadow elides the write when it did not
+  opl_bus_queue(OPL_OPL3_CONFIG_ADDR, synth_pool_4ops_mask());
+
+  uint8_t secondary = g_synth.voices.voices[ch].link;
+  uint8_t op_count = (secondary != VOICE_ALLOC_NONE) ? 4 : 2;
+  uint8_t timbre_tag = OPL_POOL_TIMBRE(part, id);
+
+  if (op_count == 4) {
+    timbre_tag |= OPL_POOL_TIMBRE_4OPS;
+    pool_timbres[secondary] = OPL_POOL_TIMBRE_NONE;
+    // a note stolen from the secondary channel would sound again once the pair is split
+    opl_bus_queue(opl_channel_reg_addr(OPL_CH_KEYON_BLOCK_FREQH_BASE, secondary), fnum_cache[secondary]);
+  }
+
+  // a note left playing unpaired keeps 2 ops, the first two of its 4 op timbre
+  uint8_t feedback_synth;
+  const opl_operator_t* ops;
+
+  if (id == KEYBOARD) {
+    feedback_synth = p->prg->keyboard.ch_feedback_synth;
+    ops = p->prg->keyboard.ops;
+  } else {
+    feedback_synth = p->prg->drumkit[id].ch_feedback_synth;
+    ops = p->prg->drumkit[id].ops;
+  }
+
+  if ((pool_timbres[ch] != timbre_tag) || (pool_stale & (1 << ch))) {
+    opl_write_channel(ch, feedback_synth, ops, op_count);
+    pool_timbres[ch] = timbre_tag;
+    pool_stale &= ~(1 << ch);
+  }
+
+  uint16_t fnum = (id == KEYBOARD) ? opl_part_fnum(p, note->note) : opl_drum_fnum(p->prg->drumkit_notes[id]);
+  opl_key_on(ch, ops, op_count, opl_synth_mode(feedback_synth, op_count), note->velocity, fnum);
+}
+
 static void opl_note_on(opl_note_t* note) {
+  if (g_synth.multi) {
+    opl_part_note_on(note);
+    return;
+  }
+
+  uint8_t drum = synth_channel_part(note->channel) & SYNTH_PART_DRUMS;
+  uint32_t alloc_start = (uint32_t) esp_timer_get_time();
   uint8_t voice_ch = synth_add_voice(note);
+  note_on_alloc_us = (uint32_t) esp_timer_get_time() - alloc_start;
 
   if (voice_ch == VOICE_NONE) {
     return;
   }
 
+  if (pending_voices & (1 << voice_ch)) {
+    opl_write_voice(voice_ch);
+  }
+
   uint8_t op_count;
   opl_operator_t* ops;
   uint8_t synth_mode;
+  uint16_t fnum;
 
-  if (note->drum_channel) {
+  if (drum) {
     op_count = 2;
-    ops = g_synth.prg.drumkit[voice_ch].ops;
-    synth_mode = g_synth.prg.drumkit[voice_ch].ch_feedback_synth & 0x1;
+    ops = g_synth.prg->drumkit[voice_ch].ops;
+    synth_mode = opl_synth_mode(g_synth.prg->drumkit[voice_ch].ch_feedback_synth, op_count);
+    fnum = opl_drum_fnum(note->note);
   } else {
-    op_count = g_synth.prg.config.map ? 2 : 4;
-    ops = g_synth.prg.keyboard.ops;
-    synth_mode = (g_synth.prg.keyboard.ch_feedback_synth & 0x80 >> 6) | (g_synth.prg.keyboard.ch_feedback_synth & 1);
+    op_count = g_synth.prg->config.map ? 2 : 4;
+    ops = g_synth.prg->keyboard.ops;
+    synth_mode = opl_synth_mode(g_synth.prg->keyboard.ch_feedback_synth, op_count);
+    fnum = opl_part_fnum(&g_synth.parts[0], note->note);
   }
 
-  voice_ch = OPL_VOICE_TO_CHANNEL[voice_ch];
-  
-  for (int i = 0; i < op_count; i++) {
-    if (opl_is_carrier(i, op_count, synth_mode)) {
-      uint8_t ksl_ol = (ops[i].ksl_output & 0xc0) | (OPL_VELOCITY_TO_OUTPUT_LEVEL[note->velocity >> 1] + (ops[i].ksl_output & 0x3f));
-      opl_bus_write(opl_op_reg_addr(OPL_OP_KSL_OUTPUT_BASE, OPL_CHANNEL_OPS[voice_ch][i]), ksl_ol);
+  opl_key_on(OPL_VOICE_TO_CHANNEL[voice_ch], ops, op_count, synth_mode, note->velocity, fnum);
+}
+
+static void opl_note_off(const opl_note_t* note) {
+  uint8_t voice_ch;
+
+  if (g_synth.multi) {
+    uint8_t part = synth_channel_part(note->channel);
+    if (part == SYNTH_PART_NONE) {
+      return;
+    }
+
+    voice_ch = synth_remove_part_voice(part, note->note);
+    if (voice_ch == VOICE_ALLOC_NONE) {
+      return;
+    }
+  } else {
+    voice_ch = synth_remove_voice(note);
+    if (voice_ch == VOICE_NONE) {
+      return;
     }
+
+    voice_ch = OPL_VOICE_TO_CHANNEL[voice_ch];
   }
 
-  opl_set_fnum(voice_ch, note, OPL_CH_KEY_ON);
+  opl_bus_queue(opl_channel_reg_addr(OPL_CH_KEYON_BLOCK_FREQH_BASE, voice_ch), fnum_cache[voice_ch]);
+  opl_channel_released(voice_ch);
 }
 
-static void opl_note_off(const opl_note_t* note) {
-  uint8_t voice_ch = synth_remove_voice(note);
-  if (voice_ch == VOICE_NONE) {
-    return;
+static void opl_pool_invalidate(uint8_t part) {
+  for (int i = 0; i < OPL_CHANNEL_COUNT; i++) {
+    if ((pool_timbres[i] != OPL_POOL_TIMBRE_NONE) && (OPL_POOL_TIMBRE_PART(pool_timbres[i]) == part)) {
+      pool_stale |= (1 << i);
+    }
   }
-
-  voice_ch = OPL_VOICE_TO_CHANNEL[voice_ch];
-  opl_bus_write(opl_channel_reg_addr(OPL_CH_KEYON_BLOCK_FREQH_BASE, voice_ch), fnum_cache[voice_ch]);
 }
 
 static void opl_load_keyboard() {
-  int op_count = g_synth.prg.config.map ? 2 : 4;
-  int ch_end = KEYBOARD_POLY_CFG[g_synth.prg.config.map] + DRUMKIT_SIZE;
+  int ch_end = KEYBOARD_POLY_CFG[g_synth.prg->config.map] + DRUMKIT_SIZE;
   for (int i = DRUMKIT_SIZE; i < ch_end; i++) {
-    opl_write_channel(OPL_VOICE_TO_CHANNEL[i], g_synth.prg.keyboard.ch_feedback_synth, g_synth.prg.keyboard.ops, op_count);
+    opl_write_voice(i);
   }
 }
 
 static void opl_cfg(const opl_config_t* cfg) {
-  if (g_synth.prg.config.map != cfg->map) {
-    g_synth.prg.config.map = cfg->map & 0x1;
-    opl_bus_write(OPL_OPL3_CONFIG_ADDR, g_synth.prg.config.map ? OPL_OPL3_2OPS_MODE : OPL_OPL3_4OPS_MODE);
+  if (g_synth.multi) {
+    // pool voices take 2 or 4 ops from their program at each key-on
+    g_synth.prg->config.map = cfg->map & 0x1;
+    opl_pool_invalidate(0);
+  } else if (g_synth.prg->config.map != cfg->map) {
+    g_synth.prg->config.map = cfg->map & 0x1;
+    opl_bus_queue(OPL_OPL3_CONFIG_ADDR, g_synth.prg->config.map ? OPL_OPL3_2OPS_MODE : OPL_OPL3_4OPS_MODE);
     opl_load_keyboard();
   }
 
-  g_synth.prg.config.trem_vib_deep = cfg->trem_vib_deep & 0xc0;
-  opl_bus_write(OPL_TREM_VIBR_PERCUSSION_ADDR, g_synth.prg.config.trem_vib_deep);
+  g_synth.prg->config.trem_vib_deep = cfg->trem_vib_deep & 0xc0;
+  opl_bus_queue(OPL_TREM_VIBR_PERCUSSION_ADDR, g_synth.prg->config.trem_vib_deep);
 }
 
 static void opl_channel_cfg(const opl_channel_cfg_t* ch_cfg) {
@@ -243,93 +520,658 @@ static void opl_channel_cfg(const opl_channel_cfg_t* ch_cfg) {
     return;
   }
 
-  if (ch_cfg->id != KEYBOARD) {
-    memcpy(&g_synth.prg.drumkit[ch_cfg->id], &ch_cfg->channel, sizeof(opl_2ops_channel_t));
-    opl_write_channel(OPL_VOICE_TO_CHANNEL[ch_cfg->id], ch_cfg->channel.ch_feedback_synth, ch_cfg->channel.ops, 2);
+  if (g_synth.multi) {
+    if (ch_cfg->id != KEYBOARD) {
+      memcpy(&g_synth.prg->drumkit[ch_cfg->id], &ch_cfg->channel, sizeof(opl_2ops_channel_t));
+    } else {
+      memcpy(&g_synth.prg->keyboard, &ch_cfg->channel, sizeof(opl_4ops_channel_t));
+    }
+
+    opl_pool_invalidate(0);
+  } else if (ch_cfg->id != KEYBOARD) {
+    memcpy(&g_synth.prg->drumkit[ch_cfg->id], &ch_cfg->channel, sizeof(opl_2ops_channel_t));
+    opl_write_voice(ch_cfg->id);
   } else {
-    memcpy(&g_synth.prg.keyboard, &ch_cfg->channel, sizeof(opl_4ops_channel_t));
+    memcpy(&g_synth.prg->keyboard, &ch_cfg->channel, sizeof(opl_4ops_channel_t));
     opl_load_keyboard();
   }
 }
 
-static void opl_load_prg(const opl_load_prg_t* prg) {
-  synth_load_prg(prg);
+static void opl_swap_part_prg(uint8_t part) {
+  if (!synth_swap_prg(part) || !g_synth.multi) {
+    return;
+  }
+
+  // held notes keep their registers, the voices of the part take the program on their next key-on
+  opl_pool_invalidate(part);
+
+  if (part == 0) {
+    opl_bus_queue(OPL_TREM_VIBR_PERCUSSION_ADDR, g_synth.prg->config.trem_vib_deep);
+  }
+}
+
+// Switches a part to the program the loader has fetched for it and writes the registers it changes
+static void opl_swap_prg(uint8_t part) {
+  if (g_synth.multi || part) {
+    opl_swap_part_prg(part);
+    return;
+  }
+
+  opl_bus_stats_t before;
+  opl_bus_get_stats(&before);
+
+#ifdef CONFIG_SYNTH_PRG_SWITCH_DIFF
+  opl_map_t old_map = g_synth.prg->config.map;
+#endif
+
+  if (!synth_swap_prg(0)) {
+    return;
+  }
+
+  opl_bus_queue(OPL_OPL3_CONFIG_ADDR, g_synth.prg->config.map ? OPL_OPL3_2OPS_MODE : OPL_OPL3_4OPS_MODE);
+  opl_bus_queue(OPL_TREM_VIBR_PERCUSSION_ADDR, g_synth.prg->config.trem_vib_deep);
+
+  int voice_end = KEYBOARD_POLY_CFG[g_synth.prg->config.map] + DRUMKIT_SIZE;
+  uint32_t deferred = 0;
+
+  for (int i = 0; i < voice_end; i++) {
+#ifdef CONFIG_SYNTH_PRG_SWITCH_DIFF
+    // a changed channel layout invalidates every voice, otherwise held notes keep their timbre until retriggered and
+    // the shadow registers reduce the rest to the registers that differ
+    if ((old_map == g_synth.prg->config.map) && opl_voice_sounding(i)) {
+      pending_voices |= (1 << i);
+      deferred++;
+      continue;
+    }
+#endif
+
+    opl_write_voice(i);
+  }
+
+  opl_bus_stats_t after;
+  opl_bus_get_stats(&after);
+  opl_stats_prg_switch(after.issued - before.issued, after.elided - before.elided, deferred);
+  ESP_LOGD(TAG, "Program switch: %lu writes issued, %lu elided, %lu voices deferred", (unsigned long) (after.issued - before.issued), (unsigned long) (after.elided - before.elided), (unsigned long) deferred);
+}
+
+// Silent channels keep their old frequency, key-on writes a new one anyway. The shadow registers drop the FNUM bytes
+// that do not change.
+static void opl_bend_channel(uint8_t ch, uint8_t note, const synth_part_t* p, uint32_t now_ms) {
+  if (!opl_channel_audible(ch, note, now_ms)) {
+    return;
+  }
+
+  uint8_t onflag = ((~note) & SYNTH_NOTE_OFF) >> 2;
+  opl_set_fnum(ch, opl_part_fnum(p, note), onflag);
+}
+
+static void opl_pitch_bend(const opl_bend_t* bend) {
+  uint32_t now_ms = opl_now_ms();
 
-  opl_bus_write(OPL_OPL3_CONFIG_ADDR, g_synth.prg.config.map ? OPL_OPL3_2OPS_MODE : OPL_OPL3_4OPS_MODE);
-  opl_bus_write(OPL_TREM_VIBR_PERCUSSION_ADDR, g_synth.prg.config.trem_vib_deep);
-  
-  for (int i = 0; i < DRUMKIT_SIZE; i++) {
-    opl_write_channel(OPL_VOICE_TO_CHANNEL[i], g_synth.prg.drumkit[i].ch_feedback_synth, g_synth.prg.drumkit[i].ops, 2);
+  if (!g_synth.multi) {
+    // single timbral bends apply to the keyboard whatever the channel
+    synth_set_pitch_bend(0, bend->value);
+    for (int i = 0; i < KEYBOARD_POLY_CFG[g_synth.prg->config.map]; i++) {
+      opl_bend_channel(OPL_VOICE_TO_CHANNEL[DRUMKIT_SIZE + i], g_synth.voices.voices[i].note, &g_synth.parts[0], now_ms);
+    }
+
+    return;
   }
 
-  opl_load_keyboard();
+  uint8_t part = synth_channel_part(bend->channel);
+  if (part & SYNTH_PART_DRUMS) {
+    return;
+  }
+
+  synth_set_pitch_bend(part, bend->value);
+
+  for (int i = 0; i < OPL_CHANNEL_COUNT; i++) {
+    if ((pool_timbres[i] & ~OPL_POOL_TIMBRE_4OPS) != OPL_POOL_TIMBRE(part, KEYBOARD)) {
+      continue;
+    }
+
+    opl_bend_channel(i, g_synth.voices.voices[i].note, &g_synth.parts[part], now_ms);
+  }
 }
 
-void opl_pitch_bend(int16_t bend) {
-  g_synth.pitch_bend = bend;
-  opl_note_t note = {.drum_channel = 0, .velocity = 127};
-  for (int i = 0; i < KEYBOARD_POLY_CFG[g_synth.prg.config.map]; i++) {
-    note.note = g_synth.keyboard_voices[i].note & 0x7f;
-    uint8_t onflag = ((~g_synth.keyboard_voices[i].note) & SYNTH_NOTE_OFF) >> 2;
-    opl_set_fnum(OPL_VOICE_TO_CHANNEL[DRUMKIT_SIZE + i], &note, onflag);
+// Applies the latest bend of every channel that received one since the last call, returns how many
+static uint32_t opl_pitch_bend_drain() {
+  uint32_t pending = __atomic_exchange_n(&bend_pending, 0, __ATOMIC_SEQ_CST);
+  uint32_t applied = 0;
+
+  for (int ch = 0; pending; ch++, pending >>= 1) {
+    if (pending & 1) {
+      const opl_bend_t bend = { .value = __atomic_load_n(&bend_slots[ch], __ATOMIC_SEQ_CST), .channel = ch };
+      ESP_LOGD(TAG, "Pitch bend: %d ch: %d", bend.value, bend.channel);
+      opl_pitch_bend(&bend);
+      applied++;
+    }
+  }
+
+  return applied;
+}
+
+static void opl_part_map(const opl_part_map_t* map) {
+  if (!synth_set_part_map(map)) {
+    return;
+  }
+
+  // the mode change released every voice
+  for (int i = 0; i < OPL_CHANNEL_COUNT; i++) {
+    opl_bus_queue(opl_channel_reg_addr(OPL_CH_KEYON_BLOCK_FREQH_BASE, i), fnum_cache[i]);
+    opl_channel_released(i);
+  }
+
+  memset(pool_timbres, OPL_POOL_TIMBRE_NONE, sizeof(pool_timbres));
+  pool_stale = 0;
+  pending_voices = 0;
+
+  if (g_synth.multi) {
+    opl_bus_queue(OPL_OPL3_CONFIG_ADDR, OPL_OPL3_2OPS_MODE);
+    return;
+  }
+
+  opl_bus_queue(OPL_OPL3_CONFIG_ADDR, g_synth.prg->config.map ? OPL_OPL3_2OPS_MODE : OPL_OPL3_4OPS_MODE);
+
+  int voice_end = KEYBOARD_POLY_CFG[g_synth.prg->config.map] + DRUMKIT_SIZE;
+  for (int i = 0; i < voice_end; i++) {
+    opl_write_voice(i);
+  }
+}
+
+static void opl_srv_dispatch(opl_msg_t* msg) {
+  prg_edited |= (msg->cmd != NOTE_ON) && (msg->cmd != NOTE_OFF);
+
+  switch(msg->cmd) {
+    case NOTE_ON:
+      ESP_LOGD(TAG, "Note On: %d ch: %d", msg->params.note.note, msg->params.note.channel);
+      opl_note_on(&msg->params.note);
+      break;
+    case NOTE_OFF:
+      ESP_LOGD(TAG, "Note Off: %d ch: %d", msg->params.note.note, msg->params.note.channel);
+      opl_note_off(&msg->params.note);
+      break;
+    case OPL_CFG:
+      ESP_LOGD(TAG, "Global OPL Config: map: %d options: %x", msg->params.opl_cfg.map, msg->params.opl_cfg.trem_vib_deep);
+      opl_cfg(&msg->params.opl_cfg);
+      break;
+    case CHANNEL_CFG:
+      ESP_LOGD(TAG, "Channel Config: %d", msg->params.channel_cfg.id);
+      opl_channel_cfg(&msg->params.channel_cfg);
+      break;
+    case LOAD_PROGRAM:
+      ESP_LOGD(TAG, "Load Program: %d, bank: %d, part: %d", msg->params.load_prg.prg, msg->params.load_prg.bank, msg->params.load_prg.part);
+      synth_load_prg(&msg->params.load_prg);
+      break; 
+    case DRUMKIT_NOTES:
+      ESP_LOGD(TAG, "Set drumkit notes");
+      memcpy(g_synth.prg->drumkit_notes, msg->params.drumkit_notes, DRUMKIT_SIZE);
+      break;
+    case PART_MAP:
+      ESP_LOGD(TAG, "Part map: multi: %d", msg->params.part_map.multi);
+      opl_part_map(&msg->params.part_map);
+      break;
+    case PART_VOICES:
+      ESP_LOGD(TAG, "Part voices: %d part: %d", msg->params.part_voices.voices, msg->params.part_voices.part);
+      synth_set_part_voices(&msg->params.part_voices);
+      break;
+    case TUNING:
+      // held notes keep their pitch until the next key-on or bend
+      ESP_LOGD(TAG, "Tuning: bend range: %d", msg->params.tuning.bend_range);
+      memcpy(&g_synth.prg->tuning, &msg->params.tuning, sizeof(opl_tuning_t));
+      synth_tune_part(0);
+      break;
+    case SAVE_PROGRAM:
+      // the edits queued before are applied, the program is taken as they left it
+      ESP_LOGD(TAG, "Save program: %d, bank: %d", msg->params.save_prg.prg, msg->params.save_prg.bank);
+      synth_save_prg(&msg->params.save_prg);
+      break;
+    default:
+      ESP_LOGW(TAG, "Unknown Command %x", msg->cmd);
+      break;
+  }
+}
+
+static inline uint8_t opl_srv_supersedes(const opl_msg_t* next, const opl_msg_t* msg) {
+  if (next->cmd != msg->cmd) {
+    return 0;
+  }
+
+  switch(msg->cmd) {
+    case OPL_CFG:
+    case DRUMKIT_NOTES:
+    case PART_MAP:
+    case TUNING:
+      return 1;
+    case LOAD_PROGRAM:
+      return next->params.load_prg.part == msg->params.load_prg.part;
+    case CHANNEL_CFG:
+      return next->params.channel_cfg.id == msg->params.channel_cfg.id;
+    case PART_VOICES:
+      return next->params.part_voices.part == msg->params.part_voices.part;
+    case SAVE_PROGRAM:
+      return (next->params.save_prg.bank == msg->params.save_prg.bank) && (next->params.save_prg.prg == msg->params.save_prg.prg);
+    default:
+      return 0;
+  }
+}
+
+static uint32_t opl_srv_coalesce(opl_event_t* evs, size_t* count) {
+  size_t out = 0;
+
+  for (int i = 0; i < *count; i++) {
+    // config messages only supersede each other when adjacent since notes in between depend on them
+    if (((i + 1) < *count) && opl_srv_supersedes(&evs[i + 1].msg, &evs[i].msg)) {
+      continue;
+    }
+
+    if (out != i) {
+      evs[out] = evs[i];
+    }
+
+    out++;
+  }
+
+  uint32_t coalesced = *count - out;
+  *count = out;
+
+  return coalesced;
+}
+
+static inline uint8_t opl_seq_before(uint16_t a, uint16_t b) {
+  return ((int16_t) (a - b)) < 0;
+}
+
+// Takes the note offs parked since the last ones were released, with the seq they have to go before
+static void opl_srv_take_parked(int src) {
+  opl_lanes_t* l = &lanes[src];
+  opl_parked_offs_t* p = &parked_offs[src];
+  uint32_t channels = __atomic_exchange_n(&l->parked_channels, 0, __ATOMIC_SEQ_CST);
+
+  for (int ch = 0; channels; ch++, channels >>= 1) {
+    if (!(channels & 1)) {
+      continue;
+    }
+
+    for (int w = ch * 4; w < (ch + 1) * 4; w++) {
+      p->notes[w] |= __atomic_exchange_n(&l->parked[w], 0, __ATOMIC_SEQ_CST);
+      if (p->notes[w]) {
+        p->channels |= (1 << ch);
+      }
+    }
+  }
+
+  // read after the bits, it is then at least the seq of every one of them
+  p->park_seq = __atomic_load_n(&l->park_seq, __ATOMIC_SEQ_CST);
+}
+
+// True once every message of the source queued before its taken note offs is out of the lanes
+static inline uint8_t opl_srv_parked_due(int src, const opl_note_ev_t* note, const opl_event_t* cfg) {
+  uint16_t park_seq = parked_offs[src].park_seq;
+  return ((note == NULL) || !opl_seq_before(note->seq, park_seq)) && ((cfg == NULL) || !opl_seq_before(cfg->seq, park_seq));
+}
+
+// Adds the taken note offs to the burst, those that do not fit stay for the next one
+static size_t opl_srv_release_parked(int src, size_t count) {
+  opl_parked_offs_t* p = &parked_offs[src];
+  uint32_t now_us = (uint32_t) esp_timer_get_time();
+
+  for (int w = 0; (w < OPL_NOTE_WORDS) && p->channels; w++) {
+    while (p->notes[w]) {
+      if (count == OPL_SRV_BURST_LEN) {
+        return count;
+      }
+
+      int bit = __builtin_ctz(p->notes[w]);
+      p->notes[w] &= ~(1 << bit);
+
+      opl_event_t* ev = &burst[count++];
+      ev->msg.cmd = NOTE_OFF;
+      ev->msg.params.note.channel = w >> 2;
+      ev->msg.params.note.note = ((w & 3) << 5) | bit;
+      ev->msg.params.note.velocity = 0;
+      ev->src = src;
+      ev->seq = p->park_seq;
+      ev->ingress_us = now_us;
+      ev->enqueue_us = now_us;
+    }
+
+    if ((w & 3) == 3) {
+      p->channels &= ~(1 << (w >> 2));
+    }
+  }
+
+  return count;
+}
+
+// Fills the burst from the lanes: the notes of every source up to its first pending config message, then one config
+// message of each source, and again until the lanes are empty or the burst is full. Parked note offs go in once the
+// messages queued before them are in.
+static size_t opl_srv_fill_burst() {
+  size_t count = 0;
+  uint8_t progress = 1;
+
+  while (progress && (count < OPL_SRV_BURST_LEN)) {
+    progress = 0;
+
+    for (int src = 0; src < OPL_SRC_COUNT; src++) {
+      if ((parked_offs[src].channels == 0) && __atomic_load_n(&lanes[src].parked_channels, __ATOMIC_SEQ_CST)) {
+        opl_srv_take_parked(src);
+      }
+
+      while (count < OPL_SRV_BURST_LEN) {
+        // the note is read first, a config message queued before it is then visible too
+        const opl_note_ev_t* note = opl_ring_peek(&lanes[src].notes);
+        const opl_event_t* cfg = opl_ring_peek(&lanes[src].cfgs);
+
+        if (parked_offs[src].channels && opl_srv_parked_due(src, note, cfg)) {
+          count = opl_srv_release_parked(src, count);
+          progress = 1;
+          continue;
+        }
+
+        if (note == NULL) {
+          break;
+        }
+
+        if ((cfg != NULL) && !opl_seq_before(note->seq, cfg->seq)) {
+          break;
+        }
+
+        opl_event_t* ev = &burst[count++];
+        ev->msg.cmd = note->cmd;
+        ev->msg.params.note = note->note;
+        ev->src = src;
+        ev->seq = note->seq;
+        ev->ingress_us = note->ingress_us;
+        ev->enqueue_us = note->enqueue_us;
+        opl_ring_pop(&lanes[src].notes);
+        progress = 1;
+      }
+    }
+
+    for (int src = 0; (src < OPL_SRC_COUNT) && (count < OPL_SRV_BURST_LEN); src++) {
+      const opl_event_t* cfg = opl_ring_peek(&lanes[src].cfgs);
+      // parked note offs queued before it go first
+      if ((cfg != NULL) && !(parked_offs[src].channels && !opl_seq_before(cfg->seq, parked_offs[src].park_seq))) {
+        burst[count++] = *cfg;
+        opl_ring_pop(&lanes[src].cfgs);
+        progress = 1;
+      }
+    }
+  }
+
+  return count;
+}
+
+// Dispatches the deferred note offs that are due, in the current bus batch
+static void opl_srv_release_deferred(uint32_t now_ms) {
+  size_t released = 0;
+
+  while ((released < deferred_count) && ((int32_t) (deferred_offs[released].due_ms - now_ms) <= 0)) {
+    opl_msg_t* msg = &deferred_offs[released++].msg;
+    uint16_t note_key = ((msg->params.note.channel & 0xf) << 7) | (msg->params.note.note & 0x7f);
+    notes_off_deferred[note_key >> 5] &= ~(1 << (note_key & 0x1f));
+    opl_srv_dispatch(msg);
+  }
+
+  if (released > 0) {
+    deferred_count -= released;
+    memmove(deferred_offs, &deferred_offs[released], deferred_count * sizeof(opl_deferred_off_t));
+  }
+}
+
+static inline uint8_t opl_srv_deferred_due(uint32_t now_ms) {
+  return (deferred_count > 0) && ((int32_t) (deferred_offs[0].due_ms - now_ms) <= 0);
+}
+
+// Ticks until the first deferred note off is due, rounded up so the wakeup is never early
+static TickType_t opl_srv_deferred_timeout() {
+  if (deferred_count == 0) {
+    return portMAX_DELAY;
+  }
+
+  int32_t wait_ms = (int32_t) (deferred_offs[0].due_ms - opl_now_ms());
+  if (wait_ms <= 0) {
+    return 0;
+  }
+
+  return pdMS_TO_TICKS(wait_ms) + 1;
+}
+
+// Due times only grow, the note off goes last. False when every slot is taken, it is then dispatched right away.
+static uint8_t opl_srv_defer_off(const opl_msg_t* msg, uint16_t note_key, uint32_t due_ms) {
+  if (deferred_count == OPL_SRV_DEFERRED_LEN) {
+    return 0;
+  }
+
+  deferred_offs[deferred_count].msg = *msg;
+  deferred_offs[deferred_count].due_ms = due_ms;
+  deferred_count++;
+  notes_off_deferred[note_key >> 5] |= (1 << (note_key & 0x1f));
+
+  return 1;
+}
+
+static void opl_srv_cancel_deferred(uint16_t note_key) {
+  if (!(notes_off_deferred[note_key >> 5] & (1 << (note_key & 0x1f)))) {
+    return;
+  }
+
+  notes_off_deferred[note_key >> 5] &= ~(1 << (note_key & 0x1f));
+
+  for (int i = 0; i < deferred_count; i++) {
+    const opl_note_t* note = &deferred_offs[i].msg.params.note;
+
+    if ((((note->channel & 0xf) << 7) | (note->note & 0x7f)) == note_key) {
+      deferred_count--;
+      memmove(&deferred_offs[i], &deferred_offs[i + 1], (deferred_count - i) * sizeof(opl_deferred_off_t));
+      return;
+    }
   }
 }
 
 void opl_srv_run(void *param) {
   ESP_LOGI(TAG, "ready");
 
-  opl_bus_write(OPL_OPL3_ENABLE_ADDR, OPL_OPL3_ENABLE);
-  const opl_load_prg_t prg = { .bank = 0, .prg = 0 };
-  opl_load_prg(&prg);
+  opl_bus_begin();
+  opl_bus_queue(OPL_OPL3_ENABLE_ADDR, OPL_OPL3_ENABLE);
+  memset(pool_timbres, OPL_POOL_TIMBRE_NONE, sizeof(pool_timbres));
+
+  // the programs are written once loaded, like any program change
+  for (int i = 0; i < SYNTH_MAX_PARTS; i++) {
+    const opl_load_prg_t prg = { .bank = 0, .prg = 0, .part = i };
+    synth_load_prg(&prg);
+  }
+
+  opl_bus_commit();
+
+  uint32_t burst_alloc_us[OPL_SRV_BURST_LEN];
+  uint32_t burst_start_us[OPL_SRV_BURST_LEN];
 
   while(1) {
-    opl_msg_t msg;
-    if (xQueueReceive(msg_queue, &msg, portMAX_DELAY) == pdFALSE) {
+    size_t count = opl_srv_fill_burst();
+
+    // a notification left from messages already taken wakes with nothing to do, the wait then starts over. A deferred
+    // note off is due after the minimum gate time even if nothing else arrives.
+    while ((count == 0) && (__atomic_load_n(&bend_pending, __ATOMIC_SEQ_CST) == 0) && (synth_prg_loaded() == 0)) {
+      if (ulTaskNotifyTake(pdTRUE, opl_srv_deferred_timeout()) == 0) {
+        break;
+      }
+
+      count = opl_srv_fill_burst();
+    }
+
+    uint32_t loaded = synth_prg_loaded();
+
+    if ((count == 0) && !opl_srv_deferred_due(opl_now_ms()) && (__atomic_load_n(&bend_pending, __ATOMIC_SEQ_CST) == 0) && (loaded == 0)) {
       continue;
     }
 
-    switch(msg.cmd) {
-      case NOTE_ON:
-        ESP_LOGD(TAG, "Note On: %d ch: %d", msg.params.note.note, msg.params.note.drum_channel);
-        opl_note_on(&msg.params.note);
-        break;
-      case NOTE_OFF:
-        ESP_LOGD(TAG, "Note Off: %d ch: %d", msg.params.note.note, msg.params.note.drum_channel);
-        opl_note_off(&msg.params.note);
-        break;
-      case OPL_CFG:
-        ESP_LOGD(TAG, "Global OPL Config: map: %d options: %x", msg.params.opl_cfg.map, msg.params.opl_cfg.trem_vib_deep);
-        opl_cfg(&msg.params.opl_cfg);
-        break;
-      case CHANNEL_CFG:
-        ESP_LOGD(TAG, "Channel Config: %d", msg.params.channel_cfg.id);
-        opl_channel_cfg(&msg.params.channel_cfg);
-        break;
-      case LOAD_PROGRAM:
-        ESP_LOGD(TAG, "Load Program: %d, bank: %d", msg.params.load_prg.prg, msg.params.load_prg.bank);
-        opl_load_prg(&msg.params.load_prg);
-        break; 
-      case DRUMKIT_NOTES:
-        ESP_LOGD(TAG, "Set drumkit notes");
-        memcpy(g_synth.prg.drumkit_notes, msg.params.drumkit_notes, DRUMKIT_SIZE);
-        break;
-      case PITCH_BEND:
-        ESP_LOGD(TAG, "Pitch bend: %d", msg.params.bend);
-        opl_pitch_bend(msg.params.bend);
-        break;        
-      default:
-        ESP_LOGW(TAG, "Unknown Command %x", msg.cmd);
-        break;
+    uint32_t dequeue_us = (uint32_t) esp_timer_get_time();
+    // bends overwritten in their slot before being applied count as coalesced
+    uint32_t merged = __atomic_exchange_n(&bend_merged, 0, __ATOMIC_SEQ_CST);
+    size_t received = count + merged;
+    uint32_t coalesced = opl_srv_coalesce(burst, &count) + merged;
+    uint32_t deferred = 0;
+
+    // all register writes caused by the burst go out as a single batch
+    opl_bus_begin();
+
+    // programs and bends first, the notes of the burst then key on with them
+    for (int part = 0; loaded; part++, loaded >>= 1) {
+      if (loaded & 1) {
+        opl_swap_prg(part);
+      }
+    }
+
+    received += opl_pitch_bend_drain();
+
+    uint32_t now_ms = opl_now_ms();
+    opl_srv_release_deferred(now_ms);
+    memset(notes_on_in_burst, 0, sizeof(notes_on_in_burst));
+
+    for (int i = 0; i < count; i++) {
+      opl_msg_t* msg = &burst[i].msg;
+      uint16_t note_key = ((msg->params.note.channel & 0xf) << 7) | (msg->params.note.note & 0x7f);
+
+      if (msg->cmd == NOTE_ON) {
+        notes_on_in_burst[note_key >> 5] |= (1 << (note_key & 0x1f));
+        // the note is struck again before its release, it keeps sounding on the same voice
+        opl_srv_cancel_deferred(note_key);
+      } else if ((msg->cmd == NOTE_OFF) && (notes_off_deferred[note_key >> 5] & (1 << (note_key & 0x1f)))) {
+        // already released once its gate time has passed
+        continue;
+      } else if ((msg->cmd == NOTE_OFF) && (notes_on_in_burst[note_key >> 5] & (1 << (note_key & 0x1f)))) {
+        // keying off in the same batch would silence the note before its attack, so it is released once the minimum
+        // gate time has passed
+        if (opl_srv_defer_off(msg, note_key, now_ms + OPL_SRV_MIN_GATE_MS)) {
+          deferred++;
+          continue;
+        }
+      }
+
+      burst_start_us[i] = (uint32_t) esp_timer_get_time();
+      opl_srv_dispatch(msg);
+      burst_alloc_us[i] = note_on_alloc_us;
+    }
+
+    opl_bus_commit();
+
+    if (prg_edited) {
+      synth_publish();
+      prg_edited = 0;
+    }
+
+    uint32_t done_us = (uint32_t) esp_timer_get_time();
+    if (received > 0) {
+      opl_stats_burst(received, coalesced, deferred);
+    }
+
+    for (int i = 0; i < count; i++) {
+      opl_event_t* ev = &burst[i];
+      if (ev->msg.cmd != NOTE_ON) {
+        continue;
+      }
+
+      opl_stats_latency(ev->src, LATENCY_INGRESS_ENQUEUE, ev->enqueue_us - ev->ingress_us);
+      opl_stats_latency(ev->src, LATENCY_QUEUE_WAIT, dequeue_us - ev->enqueue_us);
+      opl_stats_latency(ev->src, LATENCY_VOICE_ALLOC, burst_alloc_us[i]);
+      opl_stats_latency(ev->src, LATENCY_BUS_WRITE, done_us - burst_start_us[i] - burst_alloc_us[i]);
     }
   }
 }
 
 void opl_srv_start() {
+  opl_pitch_table_init();
   opl_bus_init();
-  msg_queue = xQueueCreate(OPL_SRV_QUEUE_LEN, sizeof(opl_msg_t));
-  xTaskCreatePinnedToCore(opl_srv_run, "opl_srv", OPL_SRV_STACK_SIZE, NULL, 10, NULL, 1);
+
+  for (int src = 0; src < OPL_SRC_COUNT; src++) {
+    opl_ring_init(&lanes[src].notes, note_lane_bufs[src], sizeof(opl_note_ev_t), OPL_SRV_NOTE_LANE_LEN);
+    opl_ring_init(&lanes[src].cfgs, cfg_lane_bufs[src], sizeof(opl_event_t), OPL_SRV_CFG_LANE_LEN);
+  }
+
+  xTaskCreatePinnedToCore(opl_srv_run, "opl_srv", OPL_SRV_STACK_SIZE, NULL, 10, &opl_task, 1);
 }
 
-void opl_srv_queue_msg(const opl_msg_t* msg) {
-  xQueueSend(msg_queue, msg, pdTICKS_TO_MS(OPL_SRV_QUEUE_TIMEOUT_MS));
-}
\ No newline at end of file
+void opl_srv_wake() {
+  xTaskNotifyGive(opl_task);
+}
+
+void opl_srv_queue_msg(opl_src_t src, const opl_msg_t* msg, uint32_t ingress_us) {
+  opl_srv_queue_msgs(src, msg, 1, ingress_us);
+}
+
+static void opl_srv_lane_push(opl_ring_t* ring, const void* elem) {
+  TickType_t waited = 0;
+
+  // the OPL task is behind, it is woken and given time to drain before the message is dropped
+  while (!opl_ring_push(ring, elem)) {
+    if (waited >= pdMS_TO_TICKS(OPL_SRV_QUEUE_TIMEOUT_MS)) {
+      opl_stats_lane_drop();
+      return;
+    }
+
+    xTaskNotifyGive(opl_task);
+    vTaskDelay(1);
+    waited++;
+  }
+}
+
+// The note off goes after every message queued so far, it takes no seq of its own
+static void opl_srv_park_off(opl_lanes_t* l, const opl_note_t* note) {
+  uint8_t ch = note->channel & 0xf;
+  uint8_t n = note->note & 0x7f;
+
+  __atomic_store_n(&l->park_seq, l->seq, __ATOMIC_SEQ_CST);
+  __atomic_fetch_or(&l->parked[(ch << 2) | (n >> 5)], (1 << (n & 0x1f)), __ATOMIC_SEQ_CST);
+  __atomic_fetch_or(&l->parked_channels, (1 << ch), __ATOMIC_SEQ_CST);
+  opl_stats_lane_park();
+}
+
+void opl_srv_queue_msgs(opl_src_t src, const opl_msg_t* msgs, size_t count, uint32_t ingress_us) {
+  opl_lanes_t* l = &lanes[src];
+  uint32_t enqueue_us = (uint32_t) esp_timer_get_time();
+
+  for (int i = 0; i < count; i++) {
+    const opl_msg_t* msg = &msgs[i];
+
+    if (msg->cmd == PITCH_BEND) {
+      uint8_t ch = msg->params.bend.channel & 0xf;
+      __atomic_store_n(&bend_slots[ch], msg->params.bend.value, __ATOMIC_SEQ_CST);
+
+      if (__atomic_fetch_or(&bend_pending, (1 << ch), __ATOMIC_SEQ_CST) & (1 << ch)) {
+        __atomic_fetch_add(&bend_merged, 1, __ATOMIC_SEQ_CST);
+      }
+    } else if ((msg->cmd == NOTE_ON) || (msg->cmd == NOTE_OFF)) {
+      const opl_note_ev_t ev = {
+        .ingress_us = ingress_us,
+        .enqueue_us = enqueue_us,
+        .seq = l->seq++,
+        .cmd = msg->cmd,
+        .note = msg->params.note
+      };
+
+      // a stuck note is worse than a late release, note offs never wait nor get dropped
+      if (msg->cmd == NOTE_ON) {
+        opl_srv_lane_push(&l->notes, &ev);
+      } else if (!opl_ring_push(&l->notes, &ev)) {
+        opl_srv_park_off(l, &msg->params.note);
+      }
+    } else {
+      const opl_event_t ev = {
+        .msg = *msg,
+        .src = src,
+        .seq = l->seq++,
+        .ingress_us = ingress_us,
+        .enqueue_us = enqueue_us
+      };
+
+      opl_srv_lane_push(&l->cfgs, &ev);
+    }
+  }
+
+  if (count > 0) {
+    xTaskNotifyGive(opl_task);
+  }
+}
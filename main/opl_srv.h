@@ -1,10 +1,18 @@
 #ifndef __OPL_SRV__
 #define __OPL_SRV__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define PROGRAM_MAX_NAME_LEN 12
 #define DRUMKIT_SIZE 6
+#define MIDI_CHANNEL_COUNT 16
+#define MIDI_NOTE_COUNT 128
+#define PROGRAM_VER 1
+
+// pitches are in fine steps above MIDI note 0
+#define OPL_PITCH_FINE 32
+#define OPL_PITCH_COUNT (MIDI_NOTE_COUNT * OPL_PITCH_FINE)
 
 typedef enum __attribute__ ((packed)) {
   NOTE_ON,
@@ -14,8 +22,18 @@ typedef enum __attribute__ ((packed)) {
   LOAD_PROGRAM,
   DRUMKIT_NOTES,
   PITCH_BEND,
+  PART_MAP,
+  PART_VOICES,
+  TUNING,
+  SAVE_PROGRAM,
 } opl_cmd_t;
 
+typedef enum {
+  OPL_SRC_DIN,
+  OPL_SRC_BLE,
+  OPL_SRC_COUNT
+} opl_src_t;
+
 typedef enum __attribute__ ((packed)) {
   KEYBOARD_4OPS,
   KEYBOARD_2OPS
@@ -34,7 +52,8 @@ typedef enum __attribute__ ((packed)) {
 typedef struct __attribute__ ((packed)) {
   uint8_t note;
   uint8_t velocity;
-  uint8_t drum_channel;
+  // MIDI channel, mapped to a part by the channel map
+  uint8_t channel;
 } opl_note_t;
 
 typedef struct __attribute__ ((packed)) {
@@ -68,8 +87,40 @@ typedef struct __attribute__ ((packed)) {
 typedef struct __attribute__((packed)) {
   uint8_t bank;
   uint8_t prg;
+  uint8_t part;
 } opl_load_prg_t;
 
+typedef struct __attribute__((packed)) {
+  int16_t value;
+  uint8_t channel;
+} opl_bend_t;
+
+// Single timbral: odd channels play the drum kit and the others the keyboard of part 0.
+// Multi timbral: each channel plays the part it maps to, or its drum kit with the drums flag set.
+typedef struct __attribute__((packed)) {
+  uint8_t multi;
+  uint8_t channel_part[MIDI_CHANNEL_COUNT];
+} opl_part_map_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t part;
+  uint8_t voices;
+} opl_part_voices_t;
+
+// Pitch bend range in semitones, 0 for the default one, and the offset in cents of each note of the octave from C
+typedef struct __attribute__((packed)) {
+  uint8_t bend_range;
+  int8_t cents[12];
+} opl_tuning_t;
+
+// The program of part 0 is saved under this bank, program and name, conn_handle is notified once it is stored
+typedef struct __attribute__((packed)) {
+  uint8_t bank;
+  uint8_t prg;
+  char name[PROGRAM_MAX_NAME_LEN];
+  uint16_t conn_handle;
+} opl_save_prg_t;
+
 typedef struct __attribute__ ((packed)) {
   opl_cmd_t cmd;
   union {
@@ -78,7 +129,11 @@ typedef struct __attribute__ ((packed)) {
     opl_channel_cfg_t channel_cfg;
     opl_load_prg_t load_prg;
     uint8_t drumkit_notes[DRUMKIT_SIZE];
-    int16_t bend;
+    opl_bend_t bend;
+    opl_part_map_t part_map;
+    opl_part_voices_t part_voices;
+    opl_tuning_t tuning;
+    opl_save_prg_t save_prg;
   } params;
 } opl_msg_t;
 
@@ -89,9 +144,17 @@ typedef struct __attribute__ ((packed)) {
   opl_4ops_channel_t keyboard;
   opl_2ops_channel_t drumkit[DRUMKIT_SIZE];
   uint8_t drumkit_notes[DRUMKIT_SIZE];
+  // since version 1, equal temperament before
+  opl_tuning_t tuning;
 } opl_program_t;
 
 void opl_srv_start();
-void opl_srv_queue_msg(const opl_msg_t* msg);
+// Wakes the OPL task to swap in the programs the loader has finished
+void opl_srv_wake();
+void opl_srv_queue_msg(opl_src_t src, const opl_msg_t* msg, uint32_t ingress_us);
+// Each source has lanes with a single producer, it has to be queued from one task only. Pitch bends do not take a lane
+// slot each, only the latest value of every MIDI channel is kept. A note off that finds its lane full is kept aside
+// until the OPL task gets to it instead of being dropped, other messages wait a little then are dropped and counted.
+void opl_srv_queue_msgs(opl_src_t src, const opl_msg_t* msgs, size_t count, uint32_t ingress_us);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include <string.h>
+
+#include "opl_stats.h"
+#include "prg_cache.h"
+
+typedef struct {
+  uint32_t bursts;
+  uint32_t msgs;
+  uint32_t coalesced;
+  uint32_t deferred;
+  uint32_t sizes[OPL_BURST_BUCKETS];
+} opl_burst_stats_t;
+
+typedef struct {
+  uint32_t buckets[OPL_LATENCY_BUCKETS];
+} opl_latency_counts_t;
+
+typedef struct {
+  uint32_t switches;
+  uint32_t issued;
+  uint32_t elided;
+  uint32_t deferred;
+} opl_prg_switch_stats_t;
+
+static opl_latency_counts_t latency[OPL_SRC_COUNT][LATENCY_STAGE_COUNT];
+static opl_burst_stats_t burst;
+static opl_prg_switch_stats_t prg_switch;
+static uint32_t lane_dropped;
+static uint32_t lane_parked;
+
+static inline int opl_stats_bucket(uint32_t val, int bucket_count) {
+  int bucket = val ? (32 - __builtin_clz(val)) : 0;
+  return bucket < bucket_count ? bucket : (bucket_count - 1);
+}
+
+void opl_stats_latency(opl_src_t src, opl_latency_stage_t stage, uint32_t us) {
+  latency[src][stage].buckets[opl_stats_bucket(us, OPL_LATENCY_BUCKETS)]++;
+}
+
+void opl_stats_burst(uint32_t size, uint32_t coalesced, uint32_t deferred) {
+  burst.bursts++;
+  burst.msgs += size;
+  burst.coalesced += coalesced;
+  burst.deferred += deferred;
+  burst.sizes[opl_stats_bucket(size, OPL_BURST_BUCKETS)]++;
+}
+
+void opl_stats_lane_drop() {
+  __atomic_fetch_add(&lane_dropped, 1, __ATOMIC_RELAXED);
+}
+
+void opl_stats_lane_park() {
+  __atomic_fetch_add(&lane_parked, 1, __ATOMIC_RELAXED);
+}
+
+void opl_stats_prg_switch(uint32_t issued, uint32_t elided, uint32_t deferred_voices) {
+  prg_switch.switches++;
+  prg_switch.issued += issued;
+  prg_switch.elided += elided;
+  prg_switch.deferred += deferred_voices;
+}
+
+void opl_stats_get(opl_stats_t* out) {
+  opl_bus_stats_t bus;
+  opl_bus_get_stats(&bus);
+
+  out->bus_issued = bus.issued;
+  out->bus_elided = bus.elided;
+  out->bursts = burst.bursts;
+  out->burst_msgs = burst.msgs;
+  out->coalesced_msgs = burst.coalesced;
+  out->deferred_note_offs = burst.deferred;
+  out->dropped_msgs = __atomic_load_n(&lane_dropped, __ATOMIC_RELAXED);
+  out->parked_note_offs = __atomic_load_n(&lane_parked, __ATOMIC_RELAXED);
+  memcpy(out->burst_sizes, burst.sizes, sizeof(burst.sizes));
+
+  out->prg_switches = prg_switch.switches;
+  out->prg_switch_issued = prg_switch.issued;
+  out->prg_switch_elided = prg_switch.elided;
+  out->prg_switch_deferred_voices = prg_switch.deferred;
+
+  prg_cache_stats_t cache;
+  prg_cache_get_stats(&cache);
+  out->prg_cache_hits = cache.hits;
+  out->prg_cache_misses = cache.misses;
+  out->prg_cache_evictions = cache.evictions;
+
+  for (int src = 0; src < OPL_SRC_COUNT; src++) {
+    for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+      for (int i = 0; i < OPL_LATENCY_BUCKETS; i++) {
+        uint32_t count = latency[src][stage].buckets[i];
+        out->latency[src][stage].buckets[i] = count < OPL_LATENCY_COUNT_MAX ? count : OPL_LATENCY_COUNT_MAX;
+      }
+    }
+  }
+}
+
+void opl_stats_reset() {
+  opl_bus_reset_stats();
+  prg_cache_reset_stats();
+  memset(&burst, 0, sizeof(burst));
+  memset(&prg_switch, 0, sizeof(prg_switch));
+  __atomic_store_n(&lane_dropped, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&lane_parked, 0, __ATOMIC_RELAXED);
+  memset(latency, 0, sizeof(latency));
+}
\ No newline at end of file
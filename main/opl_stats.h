@@ -0,0 +1,61 @@
+#ifndef __OPL_STATS__
+#define __OPL_STATS__
+
+#include <stdint.h>
+#include "opl_srv.h"
+#include "opl_bus.h"
+
+// bucket 0 counts samples under 1us, bucket n samples in [2^(n-1), 2^n) us, the last bucket is open ended
+#define OPL_LATENCY_BUCKETS 16
+// the histograms are read as 16 bit counts that stop at the maximum, writing the characteristic resets them
+#define OPL_LATENCY_COUNT_MAX 0xffff
+
+// same scheme as the latency buckets, counting messages per burst
+#define OPL_BURST_BUCKETS 8
+
+typedef enum {
+  LATENCY_INGRESS_ENQUEUE,
+  LATENCY_QUEUE_WAIT,
+  LATENCY_VOICE_ALLOC,
+  LATENCY_BUS_WRITE,
+  LATENCY_STAGE_COUNT
+} opl_latency_stage_t;
+
+typedef struct __attribute__((packed)) {
+  uint16_t buckets[OPL_LATENCY_BUCKETS];
+} opl_latency_hist_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t bus_issued;
+  uint32_t bus_elided;
+  uint32_t bursts;
+  uint32_t burst_msgs;
+  uint32_t coalesced_msgs;
+  uint32_t deferred_note_offs;
+  // messages the lanes had no room for: dropped, or note offs kept aside until there was
+  uint32_t dropped_msgs;
+  uint32_t parked_note_offs;
+  uint32_t burst_sizes[OPL_BURST_BUCKETS];
+  uint32_t prg_switches;
+  uint32_t prg_switch_issued;
+  uint32_t prg_switch_elided;
+  uint32_t prg_switch_deferred_voices;
+  uint32_t prg_cache_hits;
+  uint32_t prg_cache_misses;
+  uint32_t prg_cache_evictions;
+  opl_latency_hist_t latency[OPL_SRC_COUNT][LATENCY_STAGE_COUNT];
+} opl_stats_t;
+
+// read as a single attribute value, long reads cannot go past the ATT limit
+_Static_assert(sizeof(opl_stats_t) <= 512, "opl_stats_t does not fit in an attribute value");
+
+void opl_stats_latency(opl_src_t src, opl_latency_stage_t stage, uint32_t us);
+void opl_stats_burst(uint32_t size, uint32_t coalesced, uint32_t deferred);
+// Called by the producers of the lanes when a message finds its lane full
+void opl_stats_lane_drop();
+void opl_stats_lane_park();
+void opl_stats_prg_switch(uint32_t issued, uint32_t elided, uint32_t deferred_voices);
+void opl_stats_get(opl_stats_t* out);
+void opl_stats_reset();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include <string.h>
+
+#include "ota_patch.h"
+#include "esp_log.h"
+
+static const char *TAG = "ota_patch";
+
+static uint32_t ota_patch_get_u32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static bool ota_patch_copy(ota_patch_t* p, uint32_t offset, uint32_t len) {
+  if ((offset > p->source_size) || (len > (p->source_size - offset)) || (len > (p->target_size - p->written))) {
+    ESP_LOGE(TAG, "Patch copies %lu bytes at %lu out of range", (unsigned long) len, (unsigned long) offset);
+    return false;
+  }
+
+  if (len > 0) {
+    p->sink->copy(offset, len);
+  }
+
+  p->written += len;
+  return true;
+}
+
+static bool ota_patch_record(ota_patch_t* p) {
+  switch (p->state) {
+    case OTA_PATCH_HEADER:
+      if (memcmp(p->rec, OTA_PATCH_MAGIC, 4) != 0) {
+        ESP_LOGE(TAG, "Not a patch");
+        return false;
+      }
+
+      p->target_size = ota_patch_get_u32(&p->rec[4]);
+      memcpy(p->target_hash, &p->rec[8], OTA_PATCH_HASH_LEN);
+      p->state = OTA_PATCH_OP;
+      p->need = 1;
+      break;
+
+    case OTA_PATCH_OP:
+      // the arguments follow the op in rec
+      p->state = OTA_PATCH_ARGS;
+
+      switch (p->rec[0]) {
+        case OTA_PATCH_OP_END:
+          p->state = OTA_PATCH_END;
+          break;
+        case OTA_PATCH_OP_COPY:
+          p->need = 1 + 8;
+          break;
+        case OTA_PATCH_OP_ADD:
+          p->need = 1 + 4;
+          break;
+        default:
+          ESP_LOGE(TAG, "Unknown patch op %d", p->rec[0]);
+          return false;
+      }
+      return true;
+
+    case OTA_PATCH_ARGS:
+      p->state = OTA_PATCH_OP;
+      p->need = 1;
+
+      if (p->rec[0] == OTA_PATCH_OP_COPY) {
+        if (!ota_patch_copy(p, ota_patch_get_u32(&p->rec[1]), ota_patch_get_u32(&p->rec[5]))) {
+          return false;
+        }
+      } else {
+        p->add = ota_patch_get_u32(&p->rec[1]);
+        if (p->add > (p->target_size - p->written)) {
+          ESP_LOGE(TAG, "Patch adds %lu bytes past the image", (unsigned long) p->add);
+          return false;
+        }
+        if (p->add > 0) {
+          p->state = OTA_PATCH_ADD;
+        }
+      }
+      break;
+
+    default:
+      return false;
+  }
+
+  p->fill = 0;
+  return true;
+}
+
+void ota_patch_init(ota_patch_t* p, const ota_patch_sink_t* sink, uint32_t source_size) {
+  memset(p, 0, sizeof(ota_patch_t));
+  p->sink = sink;
+  p->source_size = source_size;
+  p->state = OTA_PATCH_HEADER;
+  p->need = OTA_PATCH_HEADER_LEN;
+}
+
+size_t ota_patch_feed(ota_patch_t* p, const uint8_t* data, size_t len) {
+  size_t taken = 0;
+
+  while ((taken < len) && (p->state != OTA_PATCH_FAILED)) {
+    size_t n;
+
+    if (p->state == OTA_PATCH_ADD) {
+      n = ((len - taken) < p->add) ? (len - taken) : p->add;
+      size_t added = p->sink->add(&data[taken], n);
+      taken += added;
+      p->add -= added;
+      p->written += added;
+
+      if (p->add == 0) {
+        p->state = OTA_PATCH_OP;
+      } else if (added < n) {
+        break;
+      }
+    } else if (p->state == OTA_PATCH_END) {
+      // nothing may follow the end
+      ESP_LOGE(TAG, "Data after the end of the patch");
+      p->state = OTA_PATCH_FAILED;
+    } else {
+      n = p->need - p->fill;
+      if (n > (len - taken)) {
+        n = len - taken;
+      }
+
+      // a COPY record is only completed once the sink can take the copy
+      if (((p->fill + n) == p->need) && (p->state == OTA_PATCH_ARGS) && (p->rec[0] == OTA_PATCH_OP_COPY) &&
+          !p->sink->copy_ready()) {
+        break;
+      }
+
+      memcpy(&p->rec[p->fill], &data[taken], n);
+      p->fill += n;
+      taken += n;
+
+      if ((p->fill == p->need) && !ota_patch_record(p)) {
+        p->state = OTA_PATCH_FAILED;
+      }
+    }
+  }
+
+  return (p->state == OTA_PATCH_FAILED) ? len : taken;
+}
+
+bool ota_patch_complete(const ota_patch_t* p) {
+  return (p->state == OTA_PATCH_END) && (p->written == p->target_size);
+}
@@ -0,0 +1,59 @@
+#ifndef __OTA_PATCH__
+#define __OTA_PATCH__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Patch against a source image, see tools/ota_delta.py:
+//   "OPD1", image size (u32), SHA-256 of the image, then records until END
+//   END 0 / COPY 1, source offset (u32), length (u32) / ADD 2, length (u32), bytes
+#define OTA_PATCH_MAGIC "OPD1"
+#define OTA_PATCH_HASH_LEN 32
+#define OTA_PATCH_HEADER_LEN (4 + 4 + OTA_PATCH_HASH_LEN)
+
+typedef enum {
+  OTA_PATCH_HEADER,
+  OTA_PATCH_OP,
+  OTA_PATCH_ARGS,
+  OTA_PATCH_ADD,
+  OTA_PATCH_END,
+  OTA_PATCH_FAILED,
+} ota_patch_state_t;
+
+typedef enum {
+  OTA_PATCH_OP_END,
+  OTA_PATCH_OP_COPY,
+  OTA_PATCH_OP_ADD,
+} ota_patch_op_t;
+
+// Receives the rebuilt image in order. add returns how many bytes it took, copy_ready is false while a copy cannot be
+// taken yet. The patch then stops and goes on from there on the next feed.
+typedef struct {
+  size_t (*add)(const uint8_t* data, size_t len);
+  bool (*copy_ready)();
+  void (*copy)(uint32_t offset, uint32_t len);
+} ota_patch_sink_t;
+
+typedef struct {
+  const ota_patch_sink_t* sink;
+  uint32_t source_size;
+  ota_patch_state_t state;
+  // the record being read, its op first
+  uint8_t rec[OTA_PATCH_HEADER_LEN];
+  uint8_t fill;
+  uint8_t need;
+  // bytes of the ADD record still to come
+  uint32_t add;
+  uint32_t written;
+  uint32_t target_size;
+  uint8_t target_hash[OTA_PATCH_HASH_LEN];
+} ota_patch_t;
+
+void ota_patch_init(ota_patch_t* p, const ota_patch_sink_t* sink, uint32_t source_size);
+// Returns how many bytes were taken, fewer when the sink is full. A broken patch takes everything and stays failed.
+size_t ota_patch_feed(ota_patch_t* p, const uint8_t* data, size_t len);
+// The patch reached its end with the whole image written, its hash is still to be checked
+bool ota_patch_complete(const ota_patch_t* p);
+
+#endif
@@ -0,0 +1,670 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ota_srv.h"
+#include "ota_patch.h"
+#include "esp_ota_ops.h"
+#include "esp_rom_crc.h"
+#include "rom/miniz.h"
+#include "mbedtls/sha256.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "host/ble_hs.h"
+#include "esp_log.h"
+
+#define OTA_SRV_STACK_SIZE 4096
+#define OTA_SRV_BLOCK_SIZE 4096
+#define OTA_SRV_BLOCK_COUNT 4
+#define OTA_SRV_WRITE_QUEUE_LEN 8
+#define OTA_SRV_SEQ_LEN 2
+#define OTA_SRV_PACKET_SIZE 512
+#define OTA_SRV_INFLATE_WINDOW (1 << OTA_SRV_INFLATE_WINDOW_BITS)
+#define OTA_SRV_CTRL_ARG_LEN (OTA_SRV_CTRL_LEN - 1)
+#define REBOOT_DEEP_SLEEP_TIMEOUT 500
+
+typedef enum {
+  OTA_MODE_NONE,
+  OTA_MODE_LEGACY,
+  OTA_MODE_STREAM,
+} ota_mode_t;
+
+// A NULL block copies len bytes at offset of the running partition, or marks a flush when len is 0
+typedef struct {
+  uint8_t* data;
+  uint32_t len;
+  uint32_t offset;
+} ota_block_t;
+
+static const char *TAG = "ota_srv";
+
+static const uint16_t* ota_control_val_handle;
+static uint8_t ota_control_val;
+
+static const esp_partition_t *update_partition;
+static esp_ota_handle_t update_handle;
+static ota_mode_t mode;
+
+// legacy mode: fixed size packets written as they arrive
+static uint8_t legacy_data[512];
+static uint16_t num_pkgs_received;
+static uint16_t packet_size;
+
+// stream mode: packets are gathered into flash sector sized blocks, written by the writer task
+static uint8_t* blocks;
+static QueueHandle_t free_queue;
+static QueueHandle_t write_queue;
+static SemaphoreHandle_t flushed;
+static volatile esp_err_t write_err;
+
+static uint8_t* block;
+static uint16_t block_fill;
+// the packet being written, its rest waits for a free block when the writer task is behind
+static uint8_t packet[OTA_SRV_PACKET_SIZE];
+static uint16_t packet_len;
+static uint16_t packet_pos;
+static uint32_t image_size;
+static uint32_t received;
+static uint32_t written;
+static uint32_t crc;
+static uint16_t next_seq;
+static uint8_t unacked;
+static bool nak_sent;
+static bool dup_acked;
+
+// compressed stream: inflated into a circular window, which also holds the back references. The output from window_out
+// to window_end is not stored yet.
+static tinfl_decompressor* inflator;
+static uint8_t* window;
+static uint16_t window_out;
+static uint16_t window_end;
+static tinfl_status inflate_status;
+
+// delta stream: a patch against the running partition, the writer task hashes what it writes
+static const esp_partition_t *running_partition;
+static uint8_t* copy_buf;
+static mbedtls_sha256_context* sha;
+static ota_patch_t patch;
+
+static bool ota_srv_drain();
+static const ota_patch_sink_t OTA_SRV_PATCH_SINK;
+
+static void ota_srv_notify(uint16_t conn_handle, uint8_t val, const uint8_t* arg, size_t arg_len) {
+  uint8_t buf[1 + OTA_SRV_CTRL_ARG_LEN];
+  buf[0] = val;
+
+  if (arg_len > 0) {
+    memcpy(&buf[1], arg, arg_len);
+  }
+
+  ota_control_val = val;
+  struct os_mbuf *om = ble_hs_mbuf_from_flat(buf, 1 + arg_len);
+  ble_gatts_notify_custom(conn_handle, *ota_control_val_handle, om);
+}
+
+static void ota_srv_notify_seq(uint16_t conn_handle, uint8_t val) {
+  const uint8_t seq[OTA_SRV_SEQ_LEN] = { next_seq & 0xff, next_seq >> 8 };
+  ota_srv_notify(conn_handle, val, seq, OTA_SRV_SEQ_LEN);
+}
+
+static void ota_srv_write(const uint8_t* data, size_t len) {
+  if (write_err != ESP_OK) {
+    return;
+  }
+
+  if (sha != NULL) {
+    mbedtls_sha256_update(sha, data, len);
+  }
+
+  esp_err_t err = esp_ota_write(update_handle, data, len);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "esp_ota_write failed (%s)!", esp_err_to_name(err));
+    write_err = err;
+  }
+}
+
+static void ota_srv_write_copy(uint32_t offset, uint32_t len) {
+  while ((len > 0) && (write_err == ESP_OK)) {
+    uint32_t n = (len < OTA_SRV_BLOCK_SIZE) ? len : OTA_SRV_BLOCK_SIZE;
+
+    esp_err_t err = esp_partition_read(running_partition, offset, copy_buf, n);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "esp_partition_read failed (%s)!", esp_err_to_name(err));
+      write_err = err;
+      break;
+    }
+
+    ota_srv_write(copy_buf, n);
+    offset += n;
+    len -= n;
+  }
+}
+
+static void ota_srv_writer_run(void *param) {
+  ota_block_t b;
+
+  while(1) {
+    if (xQueueReceive(write_queue, &b, portMAX_DELAY) == pdFALSE) {
+      continue;
+    }
+
+    if (b.data == NULL) {
+      if (b.len == 0) {
+        xSemaphoreGive(flushed);
+      } else {
+        ota_srv_write_copy(b.offset, b.len);
+      }
+      continue;
+    }
+
+    ota_srv_write(b.data, b.len);
+    xQueueSend(free_queue, &b.data, portMAX_DELAY);
+  }
+}
+
+static void ota_srv_submit(uint8_t* data, uint32_t len) {
+  const ota_block_t b = { .data = data, .len = len };
+  xQueueSend(write_queue, &b, portMAX_DELAY);
+}
+
+// Hands the full block to the writer task, false when its queue is full
+static bool ota_srv_submit_block() {
+  const ota_block_t b = { .data = block, .len = block_fill };
+  if (xQueueSend(write_queue, &b, 0) != pdTRUE) {
+    return false;
+  }
+
+  block = NULL;
+  block_fill = 0;
+  return true;
+}
+
+// Waits until every block handed to the writer task is on flash
+static esp_err_t ota_srv_flush() {
+  if (block_fill > 0) {
+    ota_srv_submit(block, block_fill);
+    block = NULL;
+    block_fill = 0;
+  }
+
+  ota_srv_submit(NULL, 0);
+  xSemaphoreTake(flushed, portMAX_DELAY);
+
+  if (block != NULL) {
+    xQueueSend(free_queue, &block, 0);
+    block = NULL;
+  }
+
+  return write_err;
+}
+
+static esp_err_t ota_srv_stream_end() {
+  esp_err_t err = ota_srv_flush();
+  xQueueReset(free_queue);
+  free(blocks);
+  free(inflator);
+  free(window);
+  free(copy_buf);
+  blocks = NULL;
+  inflator = NULL;
+  window = NULL;
+  copy_buf = NULL;
+
+  if (sha != NULL) {
+    mbedtls_sha256_free(sha);
+    free(sha);
+    sha = NULL;
+  }
+
+  return err;
+}
+
+static esp_err_t ota_srv_stream_begin(uint32_t size, uint8_t flags) {
+  blocks = malloc(OTA_SRV_BLOCK_COUNT * OTA_SRV_BLOCK_SIZE);
+  if (flags & OTA_SRV_STREAM_ZLIB) {
+    inflator = malloc(sizeof(tinfl_decompressor));
+    window = malloc(OTA_SRV_INFLATE_WINDOW);
+  }
+  if (flags & OTA_SRV_STREAM_DELTA) {
+    copy_buf = malloc(OTA_SRV_BLOCK_SIZE);
+    sha = malloc(sizeof(mbedtls_sha256_context));
+  }
+
+  if ((blocks == NULL) || ((flags & OTA_SRV_STREAM_ZLIB) && ((inflator == NULL) || (window == NULL))) ||
+      ((flags & OTA_SRV_STREAM_DELTA) && ((copy_buf == NULL) || (sha == NULL)))) {
+    free(blocks);
+    free(inflator);
+    free(window);
+    free(copy_buf);
+    free(sha);
+    blocks = NULL;
+    inflator = NULL;
+    window = NULL;
+    copy_buf = NULL;
+    sha = NULL;
+    return ESP_ERR_NO_MEM;
+  }
+
+  if (inflator != NULL) {
+    tinfl_init(inflator);
+    window_out = 0;
+    window_end = 0;
+    inflate_status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  }
+
+  if (sha != NULL) {
+    running_partition = esp_ota_get_running_partition();
+    mbedtls_sha256_init(sha);
+    mbedtls_sha256_starts(sha, 0);
+    ota_patch_init(&patch, &OTA_SRV_PATCH_SINK, running_partition->size);
+  }
+
+  for (int i = 0; i < OTA_SRV_BLOCK_COUNT; i++) {
+    uint8_t* b = &blocks[i * OTA_SRV_BLOCK_SIZE];
+    xQueueSend(free_queue, &b, 0);
+  }
+
+  block = NULL;
+  block_fill = 0;
+  packet_len = 0;
+  packet_pos = 0;
+  image_size = size;
+  received = 0;
+  written = 0;
+  crc = 0;
+  next_seq = 0;
+  unacked = 0;
+  nak_sent = false;
+  dup_acked = false;
+  write_err = ESP_OK;
+
+  return ESP_OK;
+}
+
+// Drops the update in progress with its stream buffers
+static void ota_srv_abort() {
+  if (mode == OTA_MODE_NONE) {
+    return;
+  }
+
+  if (mode == OTA_MODE_STREAM) {
+    ota_srv_stream_end();
+  }
+
+  esp_ota_abort(update_handle);
+  mode = OTA_MODE_NONE;
+}
+
+static void ota_srv_request(uint16_t conn_handle, ota_mode_t req_mode, const uint8_t* arg, size_t arg_len) {
+  ESP_LOGI(TAG, "OTA has been requested via BLE.");
+
+  ota_srv_abort();
+
+  update_partition = esp_ota_get_next_update_partition(NULL);
+  esp_err_t err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
+
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+    esp_ota_abort(update_handle);
+  } else if (req_mode == OTA_MODE_STREAM) {
+    uint32_t size = 0;
+    uint8_t flags = (arg_len > sizeof(size)) ? arg[sizeof(size)] : 0;
+    memcpy(&size, arg, arg_len < sizeof(size) ? arg_len : sizeof(size));
+    err = ota_srv_stream_begin(size, flags);
+
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "No memory for the OTA buffers");
+      esp_ota_abort(update_handle);
+    } else {
+      ESP_LOGI(TAG, "Streaming %lu bytes%s%s", (unsigned long) size, (flags & OTA_SRV_STREAM_ZLIB) ? ", compressed" : "", (flags & OTA_SRV_STREAM_DELTA) ? ", delta" : "");
+    }
+  } else {
+    packet_size = (legacy_data[1] << 8) + legacy_data[0];
+    ESP_LOGD(TAG, "Packet size is: %d", packet_size);
+    num_pkgs_received = 0;
+  }
+
+  if (err == ESP_OK) {
+    mode = req_mode;
+  }
+
+  ota_srv_notify(conn_handle, (err == ESP_OK) ? SVR_CHR_OTA_CONTROL_REQUEST_ACK : SVR_CHR_OTA_CONTROL_REQUEST_NAK, NULL, 0);
+  ESP_LOGI(TAG, "OTA request acknowledgement has been sent.");
+}
+
+static void ota_srv_done(uint16_t conn_handle, const uint8_t* arg, size_t arg_len) {
+  esp_err_t err = ESP_OK;
+
+  if (mode == OTA_MODE_NONE) {
+    err = ESP_ERR_INVALID_STATE;
+  } else if (mode == OTA_MODE_STREAM) {
+    // the rest of the last packet, nothing follows to carry it
+    while (!ota_srv_drain()) {
+      vTaskDelay(1);
+    }
+
+    uint32_t expected_crc = 0;
+    memcpy(&expected_crc, arg, arg_len < sizeof(expected_crc) ? arg_len : sizeof(expected_crc));
+
+    bool inflated = (inflator == NULL) || (inflate_status == TINFL_STATUS_DONE);
+    bool patched = true;
+
+    if (sha != NULL) {
+      // the hash is final once the writer task is flushed
+      uint8_t hash[OTA_PATCH_HASH_LEN];
+      err = ota_srv_flush();
+      mbedtls_sha256_finish(sha, hash);
+      patched = ota_patch_complete(&patch) && (memcmp(hash, patch.target_hash, sizeof(hash)) == 0);
+    }
+
+    esp_err_t end_err = ota_srv_stream_end();
+    if (err == ESP_OK) {
+      err = end_err;
+    }
+
+    if ((err == ESP_OK) && ((received != image_size) || (crc != expected_crc) || !inflated || !patched)) {
+      ESP_LOGE(TAG, "Image check failed: %lu/%lu bytes, crc %08lx expected %08lx%s", (unsigned long) received, (unsigned long) image_size, (unsigned long) crc, (unsigned long) expected_crc, patched ? "" : ", patched image mismatch");
+      err = ESP_ERR_INVALID_CRC;
+    } else if (err == ESP_OK) {
+      ESP_LOGI(TAG, "Received %lu bytes, wrote %lu", (unsigned long) received, (unsigned long) written);
+    }
+
+    if (err != ESP_OK) {
+      esp_ota_abort(update_handle);
+    }
+  }
+
+  if ((mode != OTA_MODE_NONE) && (err == ESP_OK)) {
+    err = esp_ota_end(update_handle);
+    if (err != ESP_OK) {
+      if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+        ESP_LOGE(TAG, "Image validation failed, image is corrupted!");
+      } else {
+        ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
+      }
+    } else {
+      err = esp_ota_set_boot_partition(update_partition);
+      if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
+      }
+    }
+  }
+
+  mode = OTA_MODE_NONE;
+
+  ota_srv_notify(conn_handle, (err == ESP_OK) ? SVR_CHR_OTA_CONTROL_DONE_ACK : SVR_CHR_OTA_CONTROL_DONE_NAK, NULL, 0);
+  ESP_LOGI(TAG, "OTA DONE acknowledgement has been sent.");
+
+  // restart the ESP to finish the OTA
+  if (err == ESP_OK) {
+    ESP_LOGI(TAG, "Preparing to restart!");
+    vTaskDelay(pdMS_TO_TICKS(REBOOT_DEEP_SLEEP_TIMEOUT));
+    esp_restart();
+  }
+}
+
+int ota_srv_control(uint16_t conn_handle, const uint8_t* ctrl, size_t len) {
+  if (len < 1) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  ota_control_val = ctrl[0];
+
+  switch (ctrl[0]) {
+    case SVR_CHR_OTA_CONTROL_REQUEST:
+      ota_srv_request(conn_handle, OTA_MODE_LEGACY, NULL, 0);
+      break;
+    case SVR_CHR_OTA_CONTROL_REQUEST_STREAM:
+      ota_srv_request(conn_handle, OTA_MODE_STREAM, &ctrl[1], len - 1);
+      break;
+    case SVR_CHR_OTA_CONTROL_DONE:
+      ota_srv_done(conn_handle, &ctrl[1], len - 1);
+      break;
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+static int ota_srv_legacy_data(struct os_mbuf* om) {
+  uint16_t om_len = OS_MBUF_PKTLEN(om);
+  if (om_len > sizeof(legacy_data)) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  if (ble_hs_mbuf_to_flat(om, legacy_data, sizeof(legacy_data), NULL) != 0) {
+    return BLE_ATT_ERR_UNLIKELY;
+  }
+
+  if (mode == OTA_MODE_LEGACY) {
+    esp_err_t err = esp_ota_write(update_handle, (const void *)legacy_data, packet_size);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "esp_ota_write failed (%s)!", esp_err_to_name(err));
+    }
+
+    num_pkgs_received++;
+    ESP_LOGD(TAG, "Received packet %d", num_pkgs_received);
+  }
+
+  return 0;
+}
+
+// Appends image bytes to the current block, handing full blocks to the writer task. It never waits for the writer task,
+// returns how many bytes were taken before running out of free blocks.
+static size_t ota_srv_store(const uint8_t* data, size_t len) {
+  size_t stored = 0;
+
+  while (stored < len) {
+    if ((block != NULL) && (block_fill == OTA_SRV_BLOCK_SIZE) && !ota_srv_submit_block()) {
+      break;
+    }
+
+    if (block == NULL) {
+      if (xQueueReceive(free_queue, &block, 0) == pdFALSE) {
+        break;
+      }
+
+      block_fill = 0;
+    }
+
+    size_t n = len - stored;
+    if (n > (OTA_SRV_BLOCK_SIZE - block_fill)) {
+      n = OTA_SRV_BLOCK_SIZE - block_fill;
+    }
+
+    memcpy(&block[block_fill], &data[stored], n);
+    block_fill += n;
+    stored += n;
+  }
+
+  if ((block != NULL) && (block_fill == OTA_SRV_BLOCK_SIZE)) {
+    ota_srv_submit_block();
+  }
+
+  written += stored;
+  return stored;
+}
+
+// Copies from the running partition happen in the writer task, after the pending data. Each takes two slots of the
+// write queue, one for the partial block before it.
+static bool ota_srv_copy_ready() {
+  return uxQueueSpacesAvailable(write_queue) >= 2;
+}
+
+static void ota_srv_copy(uint32_t offset, uint32_t len) {
+  if (block_fill > 0) {
+    ota_srv_submit(block, block_fill);
+    block = NULL;
+    block_fill = 0;
+  }
+
+  const ota_block_t b = { .data = NULL, .len = len, .offset = offset };
+  xQueueSend(write_queue, &b, portMAX_DELAY);
+  written += len;
+}
+
+static const ota_patch_sink_t OTA_SRV_PATCH_SINK = {
+  .add = ota_srv_store,
+  .copy_ready = ota_srv_copy_ready,
+  .copy = ota_srv_copy,
+};
+
+static size_t ota_srv_emit(const uint8_t* data, size_t len) {
+  return (sha == NULL) ? ota_srv_store(data, len) : ota_patch_feed(&patch, data, len);
+}
+
+// Stores the output of the last inflate call, false when part of it has to wait for the writer task
+static bool ota_srv_inflate_emit() {
+  window_out += ota_srv_emit(&window[window_out], window_end - window_out);
+  if (window_out < window_end) {
+    return false;
+  }
+
+  window_end &= (OTA_SRV_INFLATE_WINDOW - 1);
+  window_out = window_end;
+  return true;
+}
+
+// Returns how many input bytes were taken, it stops when the output cannot all be stored. The window keeps that output,
+// it is stored first on the next call.
+static size_t ota_srv_inflate(const uint8_t* data, size_t len, bool more) {
+  const uint32_t flags = TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32 | (more ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+  size_t taken = 0;
+
+  while (ota_srv_inflate_emit()) {
+    if (inflate_status == TINFL_STATUS_DONE) {
+      if (taken < len) {
+        ESP_LOGE(TAG, "Data after the end of the compressed image");
+        inflate_status = TINFL_STATUS_FAILED;
+      }
+      return len;
+    }
+
+    if ((taken == len) && (inflate_status != TINFL_STATUS_HAS_MORE_OUTPUT)) {
+      break;
+    }
+
+    size_t in_len = len - taken;
+    size_t out_len = OTA_SRV_INFLATE_WINDOW - window_end;
+    inflate_status = tinfl_decompress(inflator, &data[taken], &in_len, window, &window[window_end], &out_len, flags);
+    taken += in_len;
+    window_end += out_len;
+
+    if (inflate_status < TINFL_STATUS_DONE) {
+      ESP_LOGE(TAG, "Inflating the image failed (%d)", inflate_status);
+      window_out = window_end;
+      return len;
+    }
+  }
+
+  return taken;
+}
+
+// Passes the rest of the current packet on, false while it waits for the writer task. A failed inflate drops it, the
+// image then fails at DONE.
+static bool ota_srv_drain() {
+  if (inflator == NULL) {
+    packet_pos += ota_srv_emit(&packet[packet_pos], packet_len - packet_pos);
+    return packet_pos == packet_len;
+  }
+
+  if (inflate_status < TINFL_STATUS_DONE) {
+    packet_pos = packet_len;
+    return true;
+  }
+
+  packet_pos += ota_srv_inflate(&packet[packet_pos], packet_len - packet_pos, received < image_size);
+  return (packet_pos == packet_len) && (window_out == window_end);
+}
+
+static int ota_srv_stream_data(uint16_t conn_handle, struct os_mbuf* om) {
+  uint16_t om_len = OS_MBUF_PKTLEN(om);
+  if (om_len < OTA_SRV_SEQ_LEN) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  uint8_t seq_buf[OTA_SRV_SEQ_LEN];
+  os_mbuf_copydata(om, 0, OTA_SRV_SEQ_LEN, seq_buf);
+  uint16_t seq = seq_buf[0] | (seq_buf[1] << 8);
+
+  if (seq != next_seq) {
+    if ((int16_t) (seq - next_seq) > 0) {
+      // a packet was lost, the sender goes back to it. Only the first packet past the gap is NAKed.
+      if (!nak_sent) {
+        ota_srv_notify_seq(conn_handle, SVR_CHR_OTA_CONTROL_DATA_NAK);
+        nak_sent = true;
+      }
+    } else if (!dup_acked) {
+      // resent after a lost ACK
+      ota_srv_notify_seq(conn_handle, SVR_CHR_OTA_CONTROL_DATA_ACK);
+      dup_acked = true;
+    }
+
+    return 0;
+  }
+
+  // the writer task is behind with the last packet, the sender goes back to this one until a block is free
+  if (!ota_srv_drain()) {
+    ota_srv_notify_seq(conn_handle, SVR_CHR_OTA_CONTROL_DATA_NAK);
+    nak_sent = true;
+    return 0;
+  }
+
+  nak_sent = false;
+  dup_acked = false;
+
+  uint16_t len = om_len - OTA_SRV_SEQ_LEN;
+  if (((received + len) > image_size) || (len > sizeof(packet))) {
+    ESP_LOGE(TAG, "Data past the end of the image");
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  os_mbuf_copydata(om, OTA_SRV_SEQ_LEN, len, packet);
+  crc = esp_rom_crc32_le(crc, packet, len);
+  received += len;
+
+  // what the blocks cannot take yet goes with the next packet, a broken image is still acknowledged so the sender gets
+  // to DONE
+  packet_len = len;
+  packet_pos = 0;
+  ota_srv_drain();
+
+  next_seq++;
+
+  if ((++unacked == OTA_SRV_ACK_INTERVAL) || (received == image_size)) {
+    ota_srv_notify_seq(conn_handle, SVR_CHR_OTA_CONTROL_DATA_ACK);
+    unacked = 0;
+  }
+
+  return 0;
+}
+
+int ota_srv_data(uint16_t conn_handle, struct os_mbuf* om) {
+  if (mode == OTA_MODE_STREAM) {
+    return ota_srv_stream_data(conn_handle, om);
+  } else {
+    return ota_srv_legacy_data(om);
+  }
+}
+
+void ota_srv_disconnect() {
+  if (mode != OTA_MODE_NONE) {
+    ESP_LOGW(TAG, "Connection lost, OTA aborted");
+    ota_srv_abort();
+  }
+}
+
+uint8_t ota_srv_control_val() {
+  return ota_control_val;
+}
+
+void ota_srv_init(const uint16_t* control_val_handle) {
+  ota_control_val_handle = control_val_handle;
+  free_queue = xQueueCreate(OTA_SRV_BLOCK_COUNT, sizeof(uint8_t*));
+  write_queue = xQueueCreate(OTA_SRV_WRITE_QUEUE_LEN, sizeof(ota_block_t));
+  flushed = xSemaphoreCreateBinary();
+  xTaskCreate(ota_srv_writer_run, "ota_writer", OTA_SRV_STACK_SIZE, NULL, 5, NULL);
+}
@@ -0,0 +1,51 @@
+#ifndef __OTA_SRV__
+#define __OTA_SRV__
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct os_mbuf;
+
+typedef enum {
+  SVR_CHR_OTA_CONTROL_NOP,
+  SVR_CHR_OTA_CONTROL_REQUEST,
+  SVR_CHR_OTA_CONTROL_REQUEST_ACK,
+  SVR_CHR_OTA_CONTROL_REQUEST_NAK,
+  SVR_CHR_OTA_CONTROL_DONE,
+  SVR_CHR_OTA_CONTROL_DONE_ACK,
+  SVR_CHR_OTA_CONTROL_DONE_NAK,
+  SVR_CHR_OTA_CONTROL_REQUEST_STREAM,
+  SVR_CHR_OTA_CONTROL_DATA_ACK,
+  SVR_CHR_OTA_CONTROL_DATA_NAK,
+} svr_chr_ota_control_val_t;
+
+// Stream mode:
+//   control REQUEST_STREAM, stream size (u32), flags (u8, optional) -> REQUEST_ACK / REQUEST_NAK
+//   data    sequence number (u16), image bytes, written without response
+//           -> DATA_ACK, next expected sequence number (u16) every OTA_SRV_ACK_INTERVAL packets and at the end
+//           -> DATA_NAK, next expected sequence number (u16) on the first packet past a gap, or on the next
+//              expected packet while the flash writes are behind, that packet is dropped
+//   control DONE, CRC32 of the stream (u32) -> DONE_ACK / DONE_NAK
+// With OTA_SRV_STREAM_ZLIB the stream is the image compressed by zlib with a window of at most
+// 1 << OTA_SRV_INFLATE_WINDOW_BITS bytes, it is inflated as it arrives and its Adler-32 is checked as well.
+// With OTA_SRV_STREAM_DELTA the (inflated) stream is a patch against the running partition, see tools/ota_delta.py:
+//   "OPD1", image size (u32), SHA-256 of the image, then records until END
+//   END 0 / COPY 1, partition offset (u32), length (u32) / ADD 2, length (u32), bytes
+// The rebuilt image must match the hash before it is made bootable.
+// The sender keeps at most a window of packets unacknowledged and resends from the acknowledged or NAKed sequence
+// number, duplicates are dropped and acknowledged again.
+#define OTA_SRV_ACK_INTERVAL 8
+#define OTA_SRV_CTRL_LEN 6
+#define OTA_SRV_STREAM_ZLIB 0x01
+#define OTA_SRV_STREAM_DELTA 0x02
+#define OTA_SRV_INFLATE_WINDOW_BITS 13
+
+// The handle is read when notifying, it is only known once the service is registered
+void ota_srv_init(const uint16_t* control_val_handle);
+uint8_t ota_srv_control_val();
+int ota_srv_control(uint16_t conn_handle, const uint8_t* ctrl, size_t len);
+int ota_srv_data(uint16_t conn_handle, struct os_mbuf* om);
+// Aborts an update left open by the connection and frees its buffers
+void ota_srv_disconnect();
+
+#endif
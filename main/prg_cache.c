@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "prg_cache.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#define PRG_CACHE_KEY(bank, prg) ((uint16_t) (((bank) << 8) | (prg)))
+
+typedef struct {
+  uint32_t last_used;
+  uint16_t key;
+  bool valid;
+  opl_program_t program;
+} prg_cache_entry_t;
+
+static const char *TAG = "prg_cache";
+
+static prg_cache_entry_t* entries;
+static size_t capacity;
+static uint32_t use_clock;
+static prg_cache_stats_t stats;
+static SemaphoreHandle_t lock;
+
+void prg_cache_init(size_t size_bytes) {
+  capacity = size_bytes / sizeof(prg_cache_entry_t);
+  entries = calloc(capacity, sizeof(prg_cache_entry_t));
+
+  if (entries == NULL) {
+    capacity = 0;
+  }
+
+  lock = xSemaphoreCreateMutex();
+  ESP_LOGI(TAG, "%u programs", (unsigned) capacity);
+}
+
+static prg_cache_entry_t* prg_cache_find(uint16_t key) {
+  for (int i = 0; i < capacity; i++) {
+    if (entries[i].valid && entries[i].key == key) {
+      return &entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+bool prg_cache_get(uint8_t bank, uint8_t prg, opl_program_t* out) {
+  xSemaphoreTake(lock, portMAX_DELAY);
+  prg_cache_entry_t* entry = prg_cache_find(PRG_CACHE_KEY(bank, prg));
+
+  if (entry) {
+    entry->last_used = ++use_clock;
+    memcpy(out, &entry->program, sizeof(opl_program_t));
+    stats.hits++;
+  } else {
+    stats.misses++;
+  }
+
+  xSemaphoreGive(lock);
+  return entry != NULL;
+}
+
+bool prg_cache_contains(uint8_t bank, uint8_t prg) {
+  xSemaphoreTake(lock, portMAX_DELAY);
+  bool found = prg_cache_find(PRG_CACHE_KEY(bank, prg)) != NULL;
+  xSemaphoreGive(lock);
+
+  return found;
+}
+
+static void prg_cache_store(uint8_t bank, uint8_t prg, const opl_program_t* program, bool replace) {
+  if (capacity == 0) {
+    return;
+  }
+
+  uint16_t key = PRG_CACHE_KEY(bank, prg);
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  prg_cache_entry_t* entry = prg_cache_find(key);
+
+  if (entry && !replace) {
+    xSemaphoreGive(lock);
+    return;
+  } else if (entry == NULL) {
+    entry = &entries[0];
+
+    for (int i = 0; i < capacity; i++) {
+      if (!entries[i].valid) {
+        entry = &entries[i];
+        break;
+      } else if (entries[i].last_used < entry->last_used) {
+        entry = &entries[i];
+      }
+    }
+
+    if (entry->valid) {
+      stats.evictions++;
+    }
+
+    entry->key = key;
+    entry->valid = true;
+  }
+
+  entry->last_used = ++use_clock;
+  memcpy(&entry->program, program, sizeof(opl_program_t));
+  xSemaphoreGive(lock);
+}
+
+void prg_cache_put(uint8_t bank, uint8_t prg, const opl_program_t* program) {
+  prg_cache_store(bank, prg, program, true);
+}
+
+void prg_cache_add(uint8_t bank, uint8_t prg, const opl_program_t* program) {
+  prg_cache_store(bank, prg, program, false);
+}
+
+void prg_cache_get_stats(prg_cache_stats_t* out) {
+  *out = stats;
+}
+
+void prg_cache_reset_stats() {
+  memset(&stats, 0, sizeof(prg_cache_stats_t));
+}
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef __PRG_CACHE__
+#define __PRG_CACHE__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "opl_srv.h"
+
+typedef struct {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+} prg_cache_stats_t;
+
+// The capacity is the number of whole programs fitting in size_bytes
+void prg_cache_init(size_t size_bytes);
+bool prg_cache_get(uint8_t bank, uint8_t prg, opl_program_t* out);
+// Does not touch the hit/miss counters or the LRU order
+bool prg_cache_contains(uint8_t bank, uint8_t prg);
+void prg_cache_put(uint8_t bank, uint8_t prg, const opl_program_t* program);
+// Like prg_cache_put but keeps an entry already present, for data that might be older than it
+void prg_cache_add(uint8_t bank, uint8_t prg, const opl_program_t* program);
+void prg_cache_get_stats(prg_cache_stats_t* out);
+void prg_cache_reset_stats();
+
+#endif
\ No newline at end of file
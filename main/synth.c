@@ -1,18 +1,109 @@
+#include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "synth.h"
+#include "prg_cache.h"
 #include "gatt_svr.h"
-#include "esp_timer.h"
 #include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
 
 #define PROGRAM_PART_NAME "prgs"
 #define PROGRAM_NS "prg"
+#define PROGRAM_INDEX_NS "prg_idx"
+#define PROGRAM_INDEX_KEY "names"
+// set while a save may leave the index behind the stored programs
+#define PROGRAM_INDEX_DIRTY_KEY "dirty"
+#define PROGRAM_INDEX_GROW 32
+
+#ifdef CONFIG_SYNTH_PRG_CACHE_SIZE
+#define PRG_CACHE_SIZE CONFIG_SYNTH_PRG_CACHE_SIZE
+#else
+#define PRG_CACHE_SIZE 4096
+#endif
+
+#define PREFETCH_STACK_SIZE 4096
+#define PREFETCH_QUEUE_LEN 8
+#define LOADER_STACK_SIZE 4096
+#define LOADER_QUEUE_LEN 8
+#define SAVE_STACK_SIZE 4096
+#define SAVE_JOURNAL_LEN 8
+
+#define PRG_BUFS 3
+#define PRG_LOADED 0x80
+
+// failed snapshot reads before a reader sleeps, in case it preempted the publish on the same core
+#define SNAPSHOT_SPINS 8
+
+#define MIDI_DRUM_CHANNEL 9
+
+// the drum kit of a part is a voice owner of its own, its notes are not the ones of the keyboard
+#define SYNTH_VOICE_OWNER(part) (((part) & SYNTH_PART_DRUMS) ? (SYNTH_MAX_PARTS + ((part) & ~SYNTH_PART_DRUMS)) : (part))
+
+_Static_assert((SYNTH_MAX_PARTS * 2) <= VOICE_ALLOC_MAX_OWNERS, "more parts and drum kits than voice owners");
 
 const char* const HEX_DIGITS = "0123456789abcdef";
 const int KEYBOARD_POLY_CFG[2] = { 6, 12 };
 
+// channels that can be joined into a 4 op voice, in the order of their enable bits
+static const uint8_t POOL_4OPS_PAIRS[][2] = { {0, 3}, {1, 4}, {2, 5}, {9, 12}, {10, 13}, {11, 14} };
+#define POOL_4OPS_PAIR_COUNT (sizeof(POOL_4OPS_PAIRS) / sizeof(POOL_4OPS_PAIRS[0]))
+
 synth_t g_synth;
 
+static const char *TAG = "synth";
+
+static QueueHandle_t prefetch_queue;
+static QueueHandle_t loader_queue;
+
+// Each part has three program buffers: the active one, the one the loader fills and a loaded one waiting to be swapped
+// in. The loader hands its buffer over by exchanging it with the waiting one and the OPL task takes the waiting one by
+// exchanging it with the active one, so the loader never writes a buffer the OPL task reads and only the newest load of
+// a part is kept.
+static synth_prg_dump_t prg_bufs[SYNTH_MAX_PARTS][PRG_BUFS];
+// OPL task side
+static uint8_t prg_active[SYNTH_MAX_PARTS];
+// loader side
+static uint8_t prg_filling[SYNTH_MAX_PARTS];
+// waiting buffer, with PRG_LOADED when the loader has filled it since the last swap
+static uint8_t prg_waiting[SYNTH_MAX_PARTS];
+
+// (bank, prg, name) of every stored program sorted by bank and program, persisted as a single blob. The BLE host task
+// and the save task both use it under the lock.
+static synth_prg_desc_t* prg_index;
+static uint16_t prg_index_count;
+static uint16_t prg_index_capacity;
+static SemaphoreHandle_t index_lock;
+// saves and imports between writing their programs and the index, the dirty marker is set while there are any. Once
+// one fails to update the index, it stays set until the next boot rebuilds the index.
+static uint8_t index_writers;
+static bool index_stale;
+
+typedef struct {
+  synth_prg_dump_t dump;
+  uint16_t conn_handle;
+  // set while the save task stores it, cleared when a newer save of the program replaces it
+  bool saving;
+} synth_save_t;
+
+// Programs waiting for the save task, oldest first. Saving a program already waiting replaces it in place. An entry
+// stays until its program is stored, loads take it from here first and the cache only gets it once NVS has it.
+static synth_save_t save_journal[SAVE_JOURNAL_LEN];
+static uint8_t save_count;
+static SemaphoreHandle_t save_lock;
+static TaskHandle_t save_task;
+
+// Copies for the tasks other than the OPL task. The sequence is odd while the OPL task writes the snapshot and readers
+// copy it again when the sequence moved under them, so publishing never waits. The part numbers fit in one word each.
+static synth_prg_dump_t prg_snapshot;
+static uint32_t prg_snapshot_seq;
+// bank << 8 | program
+static uint16_t part_ids[SYNTH_MAX_PARTS];
+
 static inline uint8_t base16_hexlet_decode(char c) {
   if ((c >= '0') && (c <= '9')) {
     return c - '0';
@@ -33,42 +124,27 @@ static uint8_t synth_add_drumkit_voice(opl_note_t* note) {
   }
 
   g_synth.drumkit_voices |= (1 << ch);
-  note->note = g_synth.prg.drumkit_notes[ch];
+  note->note = g_synth.prg->drumkit_notes[ch];
 
   return ch; 
 }
 
-static uint8_t synth_add_keyboard_voice(const opl_note_t* note) {
-  int voice = VOICE_NONE;
-  uint64_t first_played = UINT64_MAX;
-  int stolen_voice = VOICE_NONE;
-
-  for (int i = 0; i < KEYBOARD_POLY_CFG[g_synth.prg.config.map]; i++) {
-    if ((g_synth.keyboard_voices[i].note & 0x7f) == note->note) {
-      voice = i;
-      break;
-    } else if (g_synth.keyboard_voices[i].note & SYNTH_NOTE_OFF) {
-      if ((voice == VOICE_NONE) || 
-        (g_synth.keyboard_voices[i].last_modified < g_synth.keyboard_voices[voice].last_modified)) {
-        voice = i;
-      }
-    } else if (g_synth.keyboard_voices[i].last_modified < first_played) {
-      first_played = g_synth.keyboard_voices[i].last_modified;
-      stolen_voice = i;
-    }
-  }
+static inline voice_alloc_t* synth_keyboard_voices() {
+  int poly = KEYBOARD_POLY_CFG[g_synth.prg->config.map];
 
-  if (voice == VOICE_NONE) {
-    voice = stolen_voice;
+  if (g_synth.voices.count != poly) {
+    voice_alloc_resize(&g_synth.voices, poly);
   }
 
-  g_synth.keyboard_voices[voice].last_modified = esp_timer_get_time();
-  g_synth.keyboard_voices[voice].note = note->note;
-  return DRUMKIT_SIZE + voice;
+  return &g_synth.voices;
+}
+
+static uint8_t synth_add_keyboard_voice(const opl_note_t* note) {
+  return DRUMKIT_SIZE + voice_alloc_note_on(synth_keyboard_voices(), 0, note->note);
 }
 
 uint8_t synth_add_voice(opl_note_t* note) {
-  if (note->drum_channel) {
+  if (synth_channel_part(note->channel) & SYNTH_PART_DRUMS) {
     return synth_add_drumkit_voice(note);
   } else {
     return synth_add_keyboard_voice(note);
@@ -91,25 +167,98 @@ static uint8_t synth_remove_drumkit_voice(const opl_note_t* note) {
 }
 
 static uint8_t synth_remove_keyboard_voice(const opl_note_t* note) {
-  for (int i = 0; i < KEYBOARD_POLY_CFG[g_synth.prg.config.map]; i++) {
-    if (g_synth.keyboard_voices[i].note == note->note) {
-      g_synth.keyboard_voices[i].last_modified = esp_timer_get_time();
-      g_synth.keyboard_voices[i].note |= SYNTH_NOTE_OFF;
-      return DRUMKIT_SIZE + i;
-    }
-  }
-
-  return VOICE_NONE;
+  uint8_t voice = voice_alloc_note_off(synth_keyboard_voices(), 0, note->note);
+  return voice == VOICE_ALLOC_NONE ? VOICE_NONE : (DRUMKIT_SIZE + voice);
 }
 
 uint8_t synth_remove_voice(const opl_note_t* note) {
-  if (note->drum_channel) {
+  if (synth_channel_part(note->channel) & SYNTH_PART_DRUMS) {
     return synth_remove_drumkit_voice(note);
   } else {
     return synth_remove_keyboard_voice(note);
   }
 }
 
+uint8_t synth_channel_part(uint8_t channel) {
+  if (!g_synth.multi) {
+    return (channel & 0x1) ? SYNTH_PART_DRUMS : 0;
+  }
+
+  return g_synth.channel_part[channel & 0xf];
+}
+
+static void synth_voices_init() {
+  g_synth.drumkit_voices = 0;
+
+  if (!g_synth.multi) {
+    voice_alloc_init(&g_synth.voices, KEYBOARD_POLY_CFG[g_synth.prg->config.map]);
+    return;
+  }
+
+  voice_alloc_init(&g_synth.voices, SYNTH_POOL_SIZE);
+  voice_alloc_set_pairs(&g_synth.voices, POOL_4OPS_PAIRS, POOL_4OPS_PAIR_COUNT);
+
+  for (int i = 0; i < SYNTH_MAX_PARTS; i++) {
+    voice_alloc_set_budget(&g_synth.voices, i, g_synth.parts[i].voices);
+    voice_alloc_set_budget(&g_synth.voices, SYNTH_VOICE_OWNER(i | SYNTH_PART_DRUMS), g_synth.parts[i].voices);
+  }
+}
+
+bool synth_set_part_map(const opl_part_map_t* map) {
+  for (int i = 0; i < MIDI_CHANNEL_COUNT; i++) {
+    uint8_t part = map->channel_part[i];
+    g_synth.channel_part[i] = ((part & ~SYNTH_PART_DRUMS) < SYNTH_MAX_PARTS) ? part : SYNTH_PART_NONE;
+  }
+
+  uint8_t multi = map->multi ? 1 : 0;
+  if (g_synth.multi == multi) {
+    return false;
+  }
+
+  g_synth.multi = multi;
+  synth_voices_init();
+
+  return true;
+}
+
+void synth_set_part_voices(const opl_part_voices_t* voices) {
+  if (voices->part >= SYNTH_MAX_PARTS) {
+    return;
+  }
+
+  uint8_t count = (voices->voices < SYNTH_POOL_SIZE) ? voices->voices : SYNTH_POOL_SIZE;
+  g_synth.parts[voices->part].voices = count;
+
+  if (g_synth.multi) {
+    voice_alloc_set_budget(&g_synth.voices, voices->part, count);
+    voice_alloc_set_budget(&g_synth.voices, SYNTH_VOICE_OWNER(voices->part | SYNTH_PART_DRUMS), count);
+  }
+}
+
+uint8_t synth_add_part_voice(uint8_t part, uint8_t note, bool four_ops) {
+  if (four_ops) {
+    return voice_alloc_note_on_pair(&g_synth.voices, SYNTH_VOICE_OWNER(part), note);
+  } else {
+    return voice_alloc_note_on(&g_synth.voices, SYNTH_VOICE_OWNER(part), note);
+  }
+}
+
+uint8_t synth_pool_4ops_mask() {
+  uint8_t mask = 0;
+
+  for (int i = 0; i < POOL_4OPS_PAIR_COUNT; i++) {
+    if (g_synth.voices.voices[POOL_4OPS_PAIRS[i][0]].link != VOICE_ALLOC_NONE) {
+      mask |= (1 << i);
+    }
+  }
+
+  return mask;
+}
+
+uint8_t synth_remove_part_voice(uint8_t part, uint8_t note) {
+  return voice_alloc_note_off(&g_synth.voices, SYNTH_VOICE_OWNER(part), note);
+}
+
 static inline void prg_to_key(uint8_t bank, uint8_t prg, char key[5]) {
   key[0] = HEX_DIGITS[bank >> 4];
   key[1] = HEX_DIGITS[bank & 0xf];
@@ -123,81 +272,599 @@ static inline void key_to_prog(const char *key, uint8_t* bank, uint8_t* prg) {
   *prg = (base16_hexlet_decode(key[2]) << 4) | base16_hexlet_decode(key[3]);
 }
 
-void synth_load_prg(const opl_load_prg_t* prg) {
+static void synth_read_prg(uint8_t bank, uint8_t prg, opl_program_t* out) {
   char key[5];
-  prg_to_key(prg->bank, prg->prg, key);
+  prg_to_key(bank, prg, key);
   size_t len = sizeof(opl_program_t);
-  if (nvs_get_blob(g_synth.storage, key, &g_synth.prg, &len) != ESP_OK) {
-    memset(&g_synth.prg, 0, sizeof(opl_program_t));
+  if (nvs_get_blob(g_synth.storage, key, out, &len) != ESP_OK) {
+    memset(out, 0, sizeof(opl_program_t));
+    len = 0;
+  }
+
+  // programs saved before the tuning existed are shorter, they play in equal temperament
+  if ((len < sizeof(opl_program_t)) || (out->ver < PROGRAM_VER)) {
+    memset(&out->tuning, 0, sizeof(opl_tuning_t));
+    out->ver = PROGRAM_VER;
+  }
+}
+
+static void synth_prefetch(uint8_t bank, uint8_t prg) {
+  if (prg < 0xff) {
+    const opl_load_prg_t next = { .bank = bank, .prg = (prg + 1) };
+    xQueueSend(prefetch_queue, &next, 0);
+  }
+
+  if (prg > 0) {
+    const opl_load_prg_t prev = { .bank = bank, .prg = (prg - 1) };
+    xQueueSend(prefetch_queue, &prev, 0);
+  }
+
+  if (prg > 1) {
+    const opl_load_prg_t first = { .bank = bank, .prg = 0 };
+    xQueueSend(prefetch_queue, &first, 0);
+  }
+}
+
+// Program waiting in the save journal, newer than the one in NVS and the cache
+static bool synth_save_pending(uint8_t bank, uint8_t prg, opl_program_t* out) {
+  xSemaphoreTake(save_lock, portMAX_DELAY);
+
+  int pos = 0;
+  while ((pos < save_count) && ((save_journal[pos].dump.bank_num != bank) || (save_journal[pos].dump.prg_num != prg))) {
+    pos++;
+  }
+
+  bool found = pos < save_count;
+  if (found) {
+    memcpy(out, &save_journal[pos].dump.prg, sizeof(opl_program_t));
+  }
+
+  xSemaphoreGive(save_lock);
+
+  return found;
+}
+
+static void synth_prefetch_run(void *param) {
+  opl_load_prg_t req;
+  opl_program_t program;
+
+  while(1) {
+    if (xQueueReceive(prefetch_queue, &req, portMAX_DELAY) == pdFALSE) {
+      continue;
+    }
+
+    if (prg_cache_contains(req.bank, req.prg)) {
+      continue;
+    }
+
+    ESP_LOGD(TAG, "Prefetch program: %d, bank: %d", req.prg, req.bank);
+    synth_read_prg(req.bank, req.prg, &program);
+    prg_cache_add(req.bank, req.prg, &program);
+  }
+}
+
+// A request for SYNTH_PART_NONE notifies the program characteristic once part 0 has swapped programs
+static void synth_loader_run(void *param) {
+  opl_load_prg_t req;
+
+  while(1) {
+    if (xQueueReceive(loader_queue, &req, portMAX_DELAY) == pdFALSE) {
+      continue;
+    }
+
+    if (req.part == SYNTH_PART_NONE) {
+      ble_synth_notify_program();
+      continue;
+    }
+
+    synth_prg_dump_t* buf = &prg_bufs[req.part][prg_filling[req.part]];
+
+    // a save completing meanwhile puts the newer program in the cache, the one read here does not replace it
+    if (!synth_save_pending(req.bank, req.prg, &buf->prg) && !prg_cache_get(req.bank, req.prg, &buf->prg)) {
+      synth_read_prg(req.bank, req.prg, &buf->prg);
+      prg_cache_add(req.bank, req.prg, &buf->prg);
+    }
+
+    buf->bank_num = req.bank;
+    buf->prg_num = req.prg;
+
+    uint8_t filled = prg_filling[req.part] | PRG_LOADED;
+    prg_filling[req.part] = __atomic_exchange_n(&prg_waiting[req.part], filled, __ATOMIC_ACQ_REL) & ~PRG_LOADED;
+    opl_srv_wake();
+
+    synth_prefetch(req.bank, req.prg);
+  }
+}
+
+void synth_load_prg(const opl_load_prg_t* prg) {
+  if (prg->part >= SYNTH_MAX_PARTS) {
+    ESP_LOGW(TAG, "Invalid part: %d", prg->part);
+    return;
+  }
+
+  if (xQueueSend(loader_queue, prg, 0) != pdTRUE) {
+    ESP_LOGW(TAG, "Program load dropped, part: %d", prg->part);
+  }
+}
+
+uint32_t synth_prg_loaded() {
+  uint32_t loaded = 0;
+
+  for (int i = 0; i < SYNTH_MAX_PARTS; i++) {
+    if (__atomic_load_n(&prg_waiting[i], __ATOMIC_ACQUIRE) & PRG_LOADED) {
+      loaded |= (1 << i);
+    }
+  }
+
+  return loaded;
+}
+
+bool synth_swap_prg(uint8_t part) {
+  if (!(__atomic_load_n(&prg_waiting[part], __ATOMIC_ACQUIRE) & PRG_LOADED)) {
+    return false;
+  }
+
+  prg_active[part] = __atomic_exchange_n(&prg_waiting[part], prg_active[part], __ATOMIC_ACQ_REL) & ~PRG_LOADED;
+
+  synth_part_t* p = &g_synth.parts[part];
+  synth_prg_dump_t* buf = &prg_bufs[part][prg_active[part]];
+
+  __atomic_store_n(&p->prg, &buf->prg, __ATOMIC_RELEASE);
+  p->bank_num = buf->bank_num;
+  p->prg_num = buf->prg_num;
+  synth_tune_part(part);
+
+  if (part == 0) {
+    __atomic_store_n(&g_synth.prg, &buf->prg, __ATOMIC_RELEASE);
+  }
+
+  synth_publish();
+
+  if (part == 0) {
+    const opl_load_prg_t notify = { .part = SYNTH_PART_NONE };
+    xQueueSend(loader_queue, &notify, 0);
+  }
+
+  return true;
+}
+
+void synth_set_pitch_bend(uint8_t part, int16_t value) {
+  synth_part_t* p = &g_synth.parts[part];
+  uint8_t range = p->prg->tuning.bend_range ? p->prg->tuning.bend_range : SYNTH_BEND_RANGE;
+
+  // the bend spans -256..255 for the whole range
+  p->pitch_bend = value;
+  p->bend_steps = (value * range * OPL_PITCH_FINE) >> 8;
+}
+
+void synth_tune_part(uint8_t part) {
+  synth_part_t* p = &g_synth.parts[part];
+  int16_t offsets[12];
+
+  for (int i = 0; i < 12; i++) {
+    int cents = p->prg->tuning.cents[i];
+    offsets[i] = ((cents * OPL_PITCH_FINE) + ((cents < 0) ? -50 : 50)) / 100;
+  }
+
+  for (int i = 0; i < MIDI_NOTE_COUNT; i++) {
+    p->note_pitch[i] = (i * OPL_PITCH_FINE) + offsets[i % 12];
   }
 
-  g_synth.bank_num = prg->bank;
-  g_synth.prg_num = prg->prg;
+  synth_set_pitch_bend(part, p->pitch_bend);
+}
+
+void synth_publish() {
+  uint32_t seq = prg_snapshot_seq;
+
+  __atomic_store_n(&prg_snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  prg_snapshot.bank_num = g_synth.parts[0].bank_num;
+  prg_snapshot.prg_num = g_synth.parts[0].prg_num;
+  memcpy(&prg_snapshot.prg, g_synth.prg, sizeof(opl_program_t));
 
-  ble_synth_notify_program();
+  __atomic_store_n(&prg_snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+
+  for (int i = 0; i < SYNTH_MAX_PARTS; i++) {
+    __atomic_store_n(&part_ids[i], (g_synth.parts[i].bank_num << 8) | g_synth.parts[i].prg_num, __ATOMIC_RELAXED);
+  }
 }
 
 void synth_prg_dump(synth_prg_dump_t* out) {
-  out->bank_num = g_synth.bank_num;
-  out->prg_num = g_synth.prg_num;
-  memcpy(&out->prg, &g_synth.prg, sizeof(opl_program_t));
+  for (int tries = 1; ; tries++) {
+    uint32_t seq = __atomic_load_n(&prg_snapshot_seq, __ATOMIC_ACQUIRE);
+
+    if (!(seq & 1)) {
+      memcpy(out, &prg_snapshot, sizeof(synth_prg_dump_t));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+      if (__atomic_load_n(&prg_snapshot_seq, __ATOMIC_RELAXED) == seq) {
+        return;
+      }
+    }
+
+    if ((tries % SNAPSHOT_SPINS) == 0) {
+      vTaskDelay(1);
+    }
+  }
 }
 
-esp_err_t synth_prg_write(const synth_prg_desc_t* prg_desc) {
-  memcpy(&g_synth.prg.name, &prg_desc->prg_name, PROGRAM_MAX_NAME_LEN);
-  
-  char key[5];
-  prg_to_key(prg_desc->bank_num, prg_desc->prg_num, key);
-  if (nvs_set_blob(g_synth.storage, key, &g_synth.prg, sizeof(opl_program_t)) != ESP_OK) {
-    return ESP_FAIL;
+uint8_t synth_part_bank(uint8_t part) {
+  return __atomic_load_n(&part_ids[part], __ATOMIC_RELAXED) >> 8;
+}
+
+static int synth_index_find(uint8_t bank, uint8_t prg, bool* found) {
+  uint16_t key = (bank << 8) | prg;
+  int lo = 0;
+  int hi = prg_index_count;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    uint16_t mid_key = (prg_index[mid].bank_num << 8) | prg_index[mid].prg_num;
+
+    if (mid_key == key) {
+      *found = true;
+      return mid;
+    } else if (mid_key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
 
-  g_synth.bank_num = prg_desc->bank_num;
-  g_synth.prg_num = prg_desc->prg_num;
+  *found = false;
+  return lo;
+}
+
+static esp_err_t synth_index_set(uint8_t bank, uint8_t prg, const char* name) {
+  bool found;
+  int pos = synth_index_find(bank, prg, &found);
 
+  if (!found) {
+    if (prg_index_count == prg_index_capacity) {
+      synth_prg_desc_t* grown = realloc(prg_index, (prg_index_capacity + PROGRAM_INDEX_GROW) * sizeof(synth_prg_desc_t));
+      if (grown == NULL) {
+        return ESP_ERR_NO_MEM;
+      }
+
+      prg_index = grown;
+      prg_index_capacity += PROGRAM_INDEX_GROW;
+    }
+
+    memmove(&prg_index[pos + 1], &prg_index[pos], (prg_index_count - pos) * sizeof(synth_prg_desc_t));
+    prg_index[pos].bank_num = bank;
+    prg_index[pos].prg_num = prg;
+    prg_index_count++;
+  }
+
+  memcpy(prg_index[pos].prg_name, name, PROGRAM_MAX_NAME_LEN);
   return ESP_OK;
 }
 
-void synth_prg_list(synth_prg_list_t* out) {
+static esp_err_t synth_index_save() {
+  return nvs_set_blob(g_synth.index_storage, PROGRAM_INDEX_KEY, prg_index, prg_index_count * sizeof(synth_prg_desc_t));
+}
+
+static void synth_index_rebuild() {
+  nvs_iterator_t it;
+  esp_err_t err = nvs_entry_find(PROGRAM_PART_NAME, PROGRAM_NS, NVS_TYPE_BLOB, &it);
+  opl_program_t prg;
+
+  while (err == ESP_OK) {
+    nvs_entry_info_t info;
+    nvs_entry_info(it, &info);
+
+    uint8_t bank_num, prg_num;
+    size_t len = sizeof(opl_program_t);
+    key_to_prog(info.key, &bank_num, &prg_num);
+
+    if (nvs_get_blob(g_synth.storage, info.key, &prg, &len) == ESP_OK) {
+      synth_index_set(bank_num, prg_num, prg.name);
+    }
+
+    err = nvs_entry_next(&it);
+  }
+
+  nvs_release_iterator(it);
+  synth_index_save();
+
+  ESP_LOGI(TAG, "Rebuilt program index, %d programs", prg_index_count);
+}
+
+static void synth_index_load() {
+  size_t len = 0;
+  uint8_t dirty;
+
+  // a save was cut short, the program blob is either the old or the new one but the index might not match it
+  if (nvs_get_u8(g_synth.index_storage, PROGRAM_INDEX_DIRTY_KEY, &dirty) == ESP_OK) {
+    ESP_LOGW(TAG, "Program index out of date");
+    nvs_erase_all(g_synth.index_storage);
+    synth_index_rebuild();
+    nvs_commit(g_synth.index_storage);
+    return;
+  }
+
+  if (nvs_get_blob(g_synth.index_storage, PROGRAM_INDEX_KEY, NULL, &len) != ESP_OK) {
+    synth_index_rebuild();
+    return;
+  }
+
+  prg_index_capacity = (len / sizeof(synth_prg_desc_t)) + PROGRAM_INDEX_GROW;
+  prg_index = malloc(prg_index_capacity * sizeof(synth_prg_desc_t));
+  assert(prg_index != NULL);
+
+  nvs_get_blob(g_synth.index_storage, PROGRAM_INDEX_KEY, prg_index, &len);
+  prg_index_count = len / sizeof(synth_prg_desc_t);
+}
+
+// Sets the dirty marker before programs are written, unless another save or import already did
+static esp_err_t synth_index_begin() {
   esp_err_t err = ESP_OK;
 
-  if (g_synth.prg_list_it == NULL) {
-    out->count = SYNTH_DESC_LIST_FIRST;
-    err = nvs_entry_find(PROGRAM_PART_NAME, PROGRAM_NS, NVS_TYPE_BLOB, &g_synth.prg_list_it);
-    
-    if (err != ESP_OK) {
-      g_synth.prg_list_it = NULL;
-      out->count |= SYNTH_DESC_LIST_LAST;
-      return;    
+  xSemaphoreTake(index_lock, portMAX_DELAY);
+
+  if (index_writers == 0) {
+    err = nvs_set_u8(g_synth.index_storage, PROGRAM_INDEX_DIRTY_KEY, 1);
+    if (err == ESP_OK) {
+      err = nvs_commit(g_synth.index_storage);
     }
   }
 
-  uint8_t count = 0;
-  opl_program_t prg;
+  if (err == ESP_OK) {
+    index_writers++;
+  }
 
-  while(err == ESP_OK) {
-    nvs_entry_info_t info;
-    nvs_entry_info(g_synth.prg_list_it, &info);
-    
-    size_t len;
-    nvs_get_blob(g_synth.storage, info.key, &prg, &len);
-    memcpy(out->descriptors[count].prg_name, prg.name, PROGRAM_MAX_NAME_LEN);
-    key_to_prog(info.key, &out->descriptors[count].bank_num, &out->descriptors[count].prg_num);
-    
-    err = nvs_entry_next(&g_synth.prg_list_it);
+  xSemaphoreGive(index_lock);
 
-    if (++count >= DESCRIPTOR_MAX_COUNT) {
-      break;
+  return err;
+}
+
+// Clears the marker once the last writer is done, with index_lock held
+static void synth_index_end(bool updated) {
+  if (!updated) {
+    // the programs are stored, the next boot finds them while rebuilding the index
+    ESP_LOGW(TAG, "Program index not updated");
+    index_stale = true;
+  }
+
+  if ((--index_writers == 0) && !index_stale) {
+    nvs_erase_key(g_synth.index_storage, PROGRAM_INDEX_DIRTY_KEY);
+  }
+
+  nvs_commit(g_synth.index_storage);
+}
+
+// NVS replaces a blob only once the new one is complete, the marker covers the index written after it
+static esp_err_t synth_save_store(const synth_prg_dump_t* dump) {
+  char key[5];
+  prg_to_key(dump->bank_num, dump->prg_num, key);
+
+  esp_err_t err = synth_index_begin();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  err = nvs_set_blob(g_synth.storage, key, &dump->prg, sizeof(opl_program_t));
+  if (err == ESP_OK) {
+    err = nvs_commit(g_synth.storage);
+  }
+
+  xSemaphoreTake(index_lock, portMAX_DELAY);
+  synth_index_end((err != ESP_OK) || ((synth_index_set(dump->bank_num, dump->prg_num, dump->prg.name) == ESP_OK) && (synth_index_save() == ESP_OK)));
+  xSemaphoreGive(index_lock);
+
+  return err;
+}
+
+static bool synth_save_take(synth_save_t* out) {
+  xSemaphoreTake(save_lock, portMAX_DELAY);
+
+  bool taken = save_count > 0;
+  if (taken) {
+    save_journal[0].saving = true;
+    *out = save_journal[0];
+  }
+
+  xSemaphoreGive(save_lock);
+
+  return taken;
+}
+
+// Drops the stored entry unless a newer save replaced it meanwhile, that one is stored next. Only a program NVS holds
+// goes to the cache, a failed save leaves the cache with the previous one.
+static void synth_save_done(const synth_save_t* save, bool stored) {
+  xSemaphoreTake(save_lock, portMAX_DELAY);
+
+  if (save_journal[0].saving) {
+    if (stored) {
+      prg_cache_put(save->dump.bank_num, save->dump.prg_num, &save->dump.prg);
     }
+
+    save_count--;
+    memmove(&save_journal[0], &save_journal[1], save_count * sizeof(synth_save_t));
+  }
+
+  xSemaphoreGive(save_lock);
+}
+
+static void synth_save_run(void *param) {
+  synth_save_t save;
+
+  while(1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while (synth_save_take(&save)) {
+      esp_err_t err = synth_save_store(&save.dump);
+      if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Program %d, bank %d not saved: %s", save.dump.prg_num, save.dump.bank_num, esp_err_to_name(err));
+      }
+
+      synth_save_done(&save, err == ESP_OK);
+
+      ble_synth_notify_saved(save.conn_handle, save.dump.bank_num, save.dump.prg_num, err == ESP_OK);
+    }
+  }
+}
+
+void synth_save_prg(const opl_save_prg_t* save_prg) {
+  memcpy(g_synth.prg->name, save_prg->name, PROGRAM_MAX_NAME_LEN);
+  g_synth.parts[0].bank_num = save_prg->bank;
+  g_synth.parts[0].prg_num = save_prg->prg;
+
+  xSemaphoreTake(save_lock, portMAX_DELAY);
+
+  int pos = 0;
+  while ((pos < save_count) && ((save_journal[pos].dump.bank_num != save_prg->bank) || (save_journal[pos].dump.prg_num != save_prg->prg))) {
+    pos++;
+  }
+
+  if (pos == SAVE_JOURNAL_LEN) {
+    xSemaphoreGive(save_lock);
+    ESP_LOGW(TAG, "Program %d, bank %d not saved: journal full", save_prg->prg, save_prg->bank);
+    ble_synth_notify_saved(save_prg->conn_handle, save_prg->bank, save_prg->prg, false);
+    return;
+  }
+
+  if (pos == save_count) {
+    save_count++;
+  }
+
+  synth_save_t* save = &save_journal[pos];
+  save->dump.bank_num = save_prg->bank;
+  save->dump.prg_num = save_prg->prg;
+  memcpy(&save->dump.prg, g_synth.prg, sizeof(opl_program_t));
+  save->conn_handle = save_prg->conn_handle;
+  save->saving = false;
+
+  xSemaphoreGive(save_lock);
+  xTaskNotifyGive(save_task);
+}
+
+void synth_prg_list(synth_prg_list_t* out) {
+  xSemaphoreTake(index_lock, portMAX_DELAY);
+
+  if (g_synth.prg_list_pos == 0) {
+    out->count = SYNTH_DESC_LIST_FIRST;
+  } else {
+    out->count = 0;
+  }
+
+  uint8_t count = 0;
+
+  while ((g_synth.prg_list_pos < prg_index_count) && (count < DESCRIPTOR_MAX_COUNT)) {
+    memcpy(&out->descriptors[count++], &prg_index[g_synth.prg_list_pos++], sizeof(synth_prg_desc_t));
   }
 
   out->count |= count;
 
-  if (err != ESP_OK) {
+  if (g_synth.prg_list_pos >= prg_index_count) {
     out->count |= SYNTH_DESC_LIST_LAST;
-    nvs_release_iterator(g_synth.prg_list_it);
-    g_synth.prg_list_it = NULL;
+    g_synth.prg_list_pos = 0;
+  }
+
+  xSemaphoreGive(index_lock);
+}
+
+uint16_t synth_prg_range(uint8_t first_bank, uint8_t first_prg, uint8_t last_bank, uint8_t last_prg, uint16_t* pos) {
+  bool found;
+  xSemaphoreTake(index_lock, portMAX_DELAY);
+  int first = synth_index_find(first_bank, first_prg, &found);
+  int last = synth_index_find(last_bank, last_prg, &found);
+  xSemaphoreGive(index_lock);
+
+  // last is included
+  if (found) {
+    last++;
   }
+
+  *pos = first;
+  return (last > first) ? (last - first) : 0;
+}
+
+bool synth_prg_export(uint16_t pos, synth_prg_dump_t* out) {
+  xSemaphoreTake(index_lock, portMAX_DELAY);
+
+  bool valid = pos < prg_index_count;
+  if (valid) {
+    out->bank_num = prg_index[pos].bank_num;
+    out->prg_num = prg_index[pos].prg_num;
+  }
+
+  xSemaphoreGive(index_lock);
+
+  if (!valid) {
+    return false;
+  }
+
+  // bypasses the program cache, a bulk read would evict everything in it
+  if (!synth_save_pending(out->bank_num, out->prg_num, &out->prg)) {
+    synth_read_prg(out->bank_num, out->prg_num, &out->prg);
+  }
+
+  return true;
+}
+
+// A save still waiting would store its older program over an imported one, it stores the imported one instead. One
+// being stored is stored again. Called with save_lock held.
+static void synth_save_merge(const synth_prg_dump_t* dump) {
+  for (int i = 0; i < save_count; i++) {
+    if ((save_journal[i].dump.bank_num == dump->bank_num) && (save_journal[i].dump.prg_num == dump->prg_num)) {
+      memcpy(&save_journal[i].dump.prg, &dump->prg, sizeof(opl_program_t));
+      save_journal[i].saving = false;
+    }
+  }
+}
+
+esp_err_t synth_prg_import(const synth_prg_dump_t* prgs, size_t count) {
+  opl_program_t stored;
+  size_t done = 0;
+
+  esp_err_t err = synth_index_begin();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  xSemaphoreTake(save_lock, portMAX_DELAY);
+
+  for (size_t i = 0; i < count; i++) {
+    synth_save_merge(&prgs[i]);
+  }
+
+  xSemaphoreGive(save_lock);
+
+  for (; done < count; done++) {
+    const synth_prg_dump_t* dump = &prgs[done];
+    char key[5];
+    prg_to_key(dump->bank_num, dump->prg_num, key);
+
+    // restoring a backup mostly finds the same programs, rewriting them only wears the flash
+    size_t len = sizeof(opl_program_t);
+    if ((nvs_get_blob(g_synth.storage, key, &stored, &len) != ESP_OK) || (len != sizeof(opl_program_t)) || (memcmp(&stored, &dump->prg, sizeof(opl_program_t)) != 0)) {
+      err = nvs_set_blob(g_synth.storage, key, &dump->prg, sizeof(opl_program_t));
+      if (err != ESP_OK) {
+        break;
+      }
+    }
+
+    if (prg_cache_contains(dump->bank_num, dump->prg_num)) {
+      prg_cache_put(dump->bank_num, dump->prg_num, &dump->prg);
+    }
+  }
+
+  nvs_commit(g_synth.storage);
+
+  // the index is only locked for itself, listing programs does not wait for the blobs
+  xSemaphoreTake(index_lock, portMAX_DELAY);
+
+  bool updated = true;
+  for (size_t i = 0; i < done; i++) {
+    updated = (synth_index_set(prgs[i].bank_num, prgs[i].prg_num, prgs[i].prg.name) == ESP_OK) && updated;
+  }
+
+  synth_index_end(updated && (synth_index_save() == ESP_OK));
+  xSemaphoreGive(index_lock);
+
+  return err;
 }
 
 void synth_init() {
@@ -211,7 +878,39 @@ void synth_init() {
   ret = nvs_open_from_partition(PROGRAM_PART_NAME, PROGRAM_NS, NVS_READWRITE, &g_synth.storage);
   ESP_ERROR_CHECK(ret);
 
-  for (int i = 0; i < KEYBOARD_MAX_POLY; i++) {
-    g_synth.keyboard_voices[i].note |= SYNTH_NOTE_OFF;   
+  ret = nvs_open_from_partition(PROGRAM_PART_NAME, PROGRAM_INDEX_NS, NVS_READWRITE, &g_synth.index_storage);
+  ESP_ERROR_CHECK(ret);
+
+  index_lock = xSemaphoreCreateMutex();
+  save_lock = xSemaphoreCreateMutex();
+  synth_index_load();
+
+  // parts start on an empty program, the OPL task queues their first load
+  for (int i = 0; i < SYNTH_MAX_PARTS; i++) {
+    prg_active[i] = 0;
+    prg_waiting[i] = 1;
+    prg_filling[i] = 2;
+    g_synth.parts[i].prg = &prg_bufs[i][0].prg;
+    g_synth.parts[i].voices = SYNTH_POOL_SIZE / SYNTH_MAX_PARTS;
+    synth_tune_part(i);
   }
+
+  g_synth.prg = g_synth.parts[0].prg;
+  synth_publish();
+
+  for (int i = 0; i < MIDI_CHANNEL_COUNT; i++) {
+    g_synth.channel_part[i] = (i < SYNTH_MAX_PARTS) ? i : SYNTH_PART_NONE;
+  }
+
+  g_synth.channel_part[MIDI_DRUM_CHANNEL] = SYNTH_PART_DRUMS;
+  synth_voices_init();
+
+  prg_cache_init(PRG_CACHE_SIZE);
+  prefetch_queue = xQueueCreate(PREFETCH_QUEUE_LEN, sizeof(opl_load_prg_t));
+  xTaskCreate(synth_prefetch_run, "synth_prefetch", PREFETCH_STACK_SIZE, NULL, 2, NULL);
+  // below the OPL task, above the prefetch
+  loader_queue = xQueueCreate(LOADER_QUEUE_LEN, sizeof(opl_load_prg_t));
+  xTaskCreate(synth_loader_run, "synth_loader", LOADER_STACK_SIZE, NULL, 5, NULL);
+  // the slowest writes, below everything that plays
+  xTaskCreate(synth_save_run, "synth_save", SAVE_STACK_SIZE, NULL, 1, &save_task);
 }
\ No newline at end of file
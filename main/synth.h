@@ -1,33 +1,62 @@
 #ifndef __SYNTH__
 #define __SYNTH__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "opl_srv.h"
+#include "voice_alloc.h"
 #include "nvs_flash.h"
 
 #define KEYBOARD_MAX_POLY 12
-#define SYNTH_NOTE_OFF 0x80
+#define SYNTH_NOTE_OFF VOICE_NOTE_OFF
 #define VOICE_NONE SYNTH_NOTE_OFF
 #define DESCRIPTOR_MAX_COUNT 20
 #define SYNTH_DESC_LIST_FIRST 0x40
 #define SYNTH_DESC_LIST_LAST 0x80
 
-extern const int KEYBOARD_POLY_CFG[2];
+#ifdef CONFIG_SYNTH_PARTS
+#define SYNTH_MAX_PARTS CONFIG_SYNTH_PARTS
+#else
+#define SYNTH_MAX_PARTS 4
+#endif
 
-typedef struct {
-  uint64_t last_modified;
-  uint8_t note;
-} voice_t;
+#define SYNTH_POOL_SIZE VOICE_ALLOC_MAX
+#ifdef CONFIG_SYNTH_BEND_RANGE
+#define SYNTH_BEND_RANGE CONFIG_SYNTH_BEND_RANGE
+#else
+#define SYNTH_BEND_RANGE 2
+#endif
+
+#define SYNTH_PART_DRUMS 0x40
+#define SYNTH_PART_NONE 0xff
+
+extern const int KEYBOARD_POLY_CFG[2];
 
 typedef struct {
-  nvs_handle_t storage;
-  nvs_iterator_t prg_list_it;
+  opl_program_t* prg;
   int16_t pitch_bend;
+  // pitch bend and tuned pitch of each note in OPL_PITCH_FINE steps, from the program
+  int16_t bend_steps;
+  int16_t note_pitch[MIDI_NOTE_COUNT];
   uint8_t bank_num;
   uint8_t prg_num;
+  // voices the part keeps when the pool is full
+  uint8_t voices;
+} synth_part_t;
+
+typedef struct {
+  nvs_handle_t storage;
+  nvs_handle_t index_storage;
+  uint16_t prg_list_pos;
+  uint8_t multi;
   uint8_t drumkit_voices;
-  voice_t keyboard_voices[KEYBOARD_MAX_POLY];
-  opl_program_t prg;
+  uint8_t channel_part[MIDI_CHANNEL_COUNT];
+  // keyboard voices in single timbral mode, the pool of every OPL channel in multi timbral mode where 4 op voices take
+  // a pair of channels
+  voice_alloc_t voices;
+  synth_part_t parts[SYNTH_MAX_PARTS];
+  // program of part 0, the one edited and saved over BLE, follows parts[0].prg
+  opl_program_t* prg;
 } synth_t;
 
 typedef struct __attribute__((packed)) {
@@ -52,8 +81,42 @@ extern synth_t g_synth;
 void synth_init();
 uint8_t synth_add_voice(opl_note_t* note);
 uint8_t synth_remove_voice(const opl_note_t* note);
+// Part of a MIDI channel with SYNTH_PART_DRUMS when it plays the drum kit, or SYNTH_PART_NONE
+uint8_t synth_channel_part(uint8_t channel);
+// Returns true when the mode changed, every voice is then released
+bool synth_set_part_map(const opl_part_map_t* map);
+void synth_set_part_voices(const opl_part_voices_t* voices);
+// A 4 op voice takes a pair of pool channels, unless no pair can be formed for a note that already plays unpaired. The
+// part keeps SYNTH_PART_DRUMS for its drum kit, whose notes are allocated apart from the keyboard ones.
+uint8_t synth_add_part_voice(uint8_t part, uint8_t note, bool four_ops);
+uint8_t synth_remove_part_voice(uint8_t part, uint8_t note);
+// 4 op enable bits of the pool channel pairs
+uint8_t synth_pool_4ops_mask();
+// Hands the program fetch to the loader task, the part keeps playing its current program until synth_swap_prg
 void synth_load_prg(const opl_load_prg_t* prg);
+// Parts with a loaded program waiting to be swapped in, one bit each
+uint32_t synth_prg_loaded();
+// Makes the waiting program of a part its active one, false when there is none
+bool synth_swap_prg(uint8_t part);
+// Recomputes the note pitches and the bend after the program tuning changed
+void synth_tune_part(uint8_t part);
+void synth_set_pitch_bend(uint8_t part, int16_t value);
+// Makes the current program of part 0 and the bank and program numbers of every part visible to the other tasks.
+// Called by the OPL task, it never waits for them.
+void synth_publish();
+// Last published program of part 0 with its numbers, never torn by a concurrent publish
 void synth_prg_dump(synth_prg_dump_t* out);
-esp_err_t synth_prg_write(const synth_prg_desc_t* prg_desc);
+// Last published bank of a part, lock free
+uint8_t synth_part_bank(uint8_t part);
+// Called by the OPL task. The program of part 0 takes the name and numbers it is saved under and is queued for the save
+// task, which writes it and notifies conn_handle. With SAVE_JOURNAL_LEN other programs waiting it is notified as not
+// stored right away.
+void synth_save_prg(const opl_save_prg_t* save);
 void synth_prg_list(synth_prg_list_t* out);
+// Index position of the first stored program from (first_bank, first_prg) to (last_bank, last_prg), returns how many
+uint16_t synth_prg_range(uint8_t first_bank, uint8_t first_prg, uint8_t last_bank, uint8_t last_prg, uint16_t* pos);
+// Stored program at an index position, false when the index has shrunk since
+bool synth_prg_export(uint16_t pos, synth_prg_dump_t* out);
+// Stores a batch of programs, rewriting only the changed ones and saving the index once
+esp_err_t synth_prg_import(const synth_prg_dump_t* prgs, size_t count);
 #endif
\ No newline at end of file
@@ -0,0 +1,316 @@
+#include <string.h>
+
+#include "voice_alloc.h"
+
+static inline voice_list_t* voice_list_of(voice_alloc_t* va, uint8_t v) {
+  return (va->voices[v].note & VOICE_NOTE_OFF) ? &va->released : &va->active[va->voices[v].owner];
+}
+
+static inline void voice_list_remove(voice_alloc_t* va, voice_list_t* list, uint8_t v) {
+  voice_t* voice = &va->voices[v];
+
+  if (voice->prev != VOICE_ALLOC_NONE) {
+    va->voices[voice->prev].next = voice->next;
+  } else {
+    list->head = voice->next;
+  }
+
+  if (voice->next != VOICE_ALLOC_NONE) {
+    va->voices[voice->next].prev = voice->prev;
+  } else {
+    list->tail = voice->prev;
+  }
+}
+
+static inline void voice_list_push(voice_alloc_t* va, voice_list_t* list, uint8_t v) {
+  voice_t* voice = &va->voices[v];
+  voice->prev = list->tail;
+  voice->next = VOICE_ALLOC_NONE;
+
+  if (list->tail != VOICE_ALLOC_NONE) {
+    va->voices[list->tail].next = v;
+  } else {
+    list->head = v;
+  }
+
+  list->tail = v;
+}
+
+static void voice_list_insert_ordered(voice_alloc_t* va, voice_list_t* list, uint8_t v) {
+  uint8_t after = list->tail;
+
+  while ((after != VOICE_ALLOC_NONE) && (va->voices[after].stamp > va->voices[v].stamp)) {
+    after = va->voices[after].prev;
+  }
+
+  if (after == list->tail) {
+    voice_list_push(va, list, v);
+    return;
+  }
+
+  voice_t* voice = &va->voices[v];
+  voice->prev = after;
+
+  if (after != VOICE_ALLOC_NONE) {
+    voice->next = va->voices[after].next;
+    va->voices[after].next = v;
+  } else {
+    voice->next = list->head;
+    list->head = v;
+  }
+
+  va->voices[voice->next].prev = v;
+}
+
+static inline uint8_t voice_is_secondary(const voice_alloc_t* va, uint8_t v) {
+  return (va->voices[v].link != VOICE_ALLOC_NONE) && (va->partner[v] == VOICE_ALLOC_NONE);
+}
+
+// Removes the voice from its list and forgets the note it played
+static void voice_claim(voice_alloc_t* va, uint8_t v) {
+  voice_t* voice = &va->voices[v];
+  voice_list_remove(va, voice_list_of(va, v), v);
+
+  if (!(voice->note & VOICE_NOTE_OFF)) {
+    va->active_count[voice->owner]--;
+  }
+
+  uint8_t* mapped = &va->note_map[voice->owner][voice->note & 0x7f];
+  if (*mapped == v) {
+    *mapped = VOICE_ALLOC_NONE;
+  }
+}
+
+static void voice_assign(voice_alloc_t* va, uint8_t v, uint8_t owner, uint8_t note) {
+  voice_t* voice = &va->voices[v];
+  voice->note = note;
+  voice->owner = owner;
+  voice->stamp = ++va->clock;
+  voice_list_push(va, &va->active[owner], v);
+  va->active_count[owner]++;
+  va->note_map[owner][note] = v;
+}
+
+static void voice_link(voice_alloc_t* va, uint8_t v) {
+  uint8_t s = va->partner[v];
+  voice_claim(va, s);
+  va->voices[s].note = VOICE_NOTE_OFF;
+  va->voices[v].link = s;
+  va->voices[s].link = v;
+}
+
+// The secondary voice of a pair taken alone goes back to the released voices with the age of the pair
+static void voice_unlink(voice_alloc_t* va, uint8_t v) {
+  uint8_t s = va->voices[v].link;
+  if (s == VOICE_ALLOC_NONE) {
+    return;
+  }
+
+  va->voices[v].link = VOICE_ALLOC_NONE;
+  va->voices[s].link = VOICE_ALLOC_NONE;
+  va->voices[s].owner = 0;
+  va->voices[s].stamp = va->voices[v].stamp;
+  voice_list_insert_ordered(va, &va->released, s);
+}
+
+void voice_alloc_init(voice_alloc_t* va, uint8_t count) {
+  memset(va, 0, sizeof(voice_alloc_t));
+
+  for (int i = 0; i < VOICE_ALLOC_MAX; i++) {
+    va->voices[i].note = VOICE_NOTE_OFF;
+    va->voices[i].link = VOICE_ALLOC_NONE;
+    va->partner[i] = VOICE_ALLOC_NONE;
+  }
+
+  memset(va->budget, count, VOICE_ALLOC_MAX_OWNERS);
+  voice_alloc_resize(va, count);
+}
+
+void voice_alloc_resize(voice_alloc_t* va, uint8_t count) {
+  // rare enough that the lists are simply rebuilt, the stamps keep the age order
+  va->count = count;
+  va->released.head = va->released.tail = VOICE_ALLOC_NONE;
+  memset(va->note_map, VOICE_ALLOC_NONE, sizeof(va->note_map));
+  memset(va->active_count, 0, VOICE_ALLOC_MAX_OWNERS);
+
+  for (int i = 0; i < VOICE_ALLOC_MAX_OWNERS; i++) {
+    va->active[i].head = va->active[i].tail = VOICE_ALLOC_NONE;
+  }
+
+  for (int i = 0; i < count; i++) {
+    voice_t* voice = &va->voices[i];
+
+    if (voice_is_secondary(va, i)) {
+      continue;
+    }
+
+    voice_list_insert_ordered(va, voice_list_of(va, i), i);
+
+    if (!(voice->note & VOICE_NOTE_OFF)) {
+      va->active_count[voice->owner]++;
+    }
+
+    if (voice->stamp) {
+      va->note_map[voice->owner][voice->note & 0x7f] = i;
+    }
+  }
+}
+
+void voice_alloc_set_budget(voice_alloc_t* va, uint8_t owner, uint8_t budget) {
+  va->budget[owner] = budget;
+}
+
+void voice_alloc_set_pairs(voice_alloc_t* va, const uint8_t (*pairs)[2], uint8_t count) {
+  for (int i = 0; i < count; i++) {
+    va->partner[pairs[i][0]] = pairs[i][1];
+    va->pairable |= (1 << pairs[i][0]) | (1 << pairs[i][1]);
+  }
+}
+
+static inline int voice_excess(const voice_alloc_t* va, uint8_t owner, uint8_t requester) {
+  // the requesting owner counts the voice it is about to take
+  return va->active_count[owner] + (owner == requester) - va->budget[owner];
+}
+
+static uint8_t voice_alloc_steal(voice_alloc_t* va, uint8_t owner) {
+  uint8_t victim = VOICE_ALLOC_NONE;
+  int victim_excess = 0;
+
+  for (int i = 0; i < VOICE_ALLOC_MAX_OWNERS; i++) {
+    uint8_t head = va->active[i].head;
+    if (head == VOICE_ALLOC_NONE) {
+      continue;
+    }
+
+    int excess = voice_excess(va, i, owner);
+
+    if ((victim == VOICE_ALLOC_NONE) || (excess > victim_excess) ||
+        ((excess == victim_excess) && (va->voices[head].stamp < va->voices[victim].stamp))) {
+      victim = head;
+      victim_excess = excess;
+    }
+  }
+
+  return victim;
+}
+
+// Prefers the released voices that cannot be part of a pair, so that pairs stay available
+static uint8_t voice_alloc_released(voice_alloc_t* va) {
+  uint8_t v = va->released.head;
+
+  while ((v != VOICE_ALLOC_NONE) && (va->pairable & (1 << v))) {
+    v = va->voices[v].next;
+  }
+
+  return (v != VOICE_ALLOC_NONE) ? v : va->released.head;
+}
+
+uint8_t voice_alloc_note_on(voice_alloc_t* va, uint8_t owner, uint8_t note) {
+  note &= 0x7f;
+  uint8_t v = va->note_map[owner][note];
+
+  if (v == VOICE_ALLOC_NONE) {
+    v = (va->released.head != VOICE_ALLOC_NONE) ? voice_alloc_released(va) : voice_alloc_steal(va, owner);
+
+    if (v == VOICE_ALLOC_NONE) {
+      return VOICE_ALLOC_NONE;
+    }
+  }
+
+  voice_claim(va, v);
+  voice_unlink(va, v);
+  voice_assign(va, v, owner, note);
+
+  return v;
+}
+
+// Cost of taking a pair: the voices it steals, then how far the owners of those voices are under their budget, then
+// the age of the newest of its voices
+static void voice_pair_cost(voice_alloc_t* va, uint8_t p, uint8_t owner, int cost[3]) {
+  uint8_t pair[2] = { p, va->voices[p].link == VOICE_ALLOC_NONE ? va->partner[p] : VOICE_ALLOC_NONE };
+  cost[0] = 0;
+  cost[1] = -VOICE_ALLOC_MAX;
+  cost[2] = 0;
+
+  for (int i = 0; i < 2; i++) {
+    if (pair[i] == VOICE_ALLOC_NONE) {
+      continue;
+    }
+
+    const voice_t* voice = &va->voices[pair[i]];
+
+    if (!(voice->note & VOICE_NOTE_OFF)) {
+      int excess = voice_excess(va, voice->owner, owner);
+      cost[0]++;
+      cost[1] = (-excess > cost[1]) ? -excess : cost[1];
+    }
+
+    if ((int) voice->stamp > cost[2]) {
+      cost[2] = voice->stamp;
+    }
+  }
+}
+
+static inline uint8_t voice_cost_less(const int a[3], const int b[3]) {
+  for (int i = 0; i < 3; i++) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i];
+    }
+  }
+
+  return 0;
+}
+
+uint8_t voice_alloc_note_on_pair(voice_alloc_t* va, uint8_t owner, uint8_t note) {
+  note &= 0x7f;
+  uint8_t v = va->note_map[owner][note];
+
+  if (v == VOICE_ALLOC_NONE) {
+    int best[3];
+
+    for (int i = 0; i < va->count; i++) {
+      if (va->partner[i] == VOICE_ALLOC_NONE) {
+        continue;
+      }
+
+      int cost[3];
+      voice_pair_cost(va, i, owner, cost);
+
+      if ((v == VOICE_ALLOC_NONE) || voice_cost_less(cost, best)) {
+        v = i;
+        memcpy(best, cost, sizeof(best));
+      }
+    }
+
+    if (v == VOICE_ALLOC_NONE) {
+      return voice_alloc_note_on(va, owner, note);
+    }
+  }
+
+  voice_claim(va, v);
+
+  // a note that was playing unpaired on a voice that cannot pair keeps it
+  if ((va->voices[v].link == VOICE_ALLOC_NONE) && (va->partner[v] != VOICE_ALLOC_NONE)) {
+    voice_link(va, v);
+  }
+
+  voice_assign(va, v, owner, note);
+
+  return v;
+}
+
+uint8_t voice_alloc_note_off(voice_alloc_t* va, uint8_t owner, uint8_t note) {
+  uint8_t v = va->note_map[owner][note & 0x7f];
+
+  if ((v == VOICE_ALLOC_NONE) || (va->voices[v].note & VOICE_NOTE_OFF)) {
+    return VOICE_ALLOC_NONE;
+  }
+
+  voice_list_remove(va, &va->active[owner], v);
+  va->active_count[owner]--;
+  va->voices[v].note |= VOICE_NOTE_OFF;
+  va->voices[v].stamp = ++va->clock;
+  voice_list_push(va, &va->released, v);
+
+  return v;
+}
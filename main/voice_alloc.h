@@ -0,0 +1,58 @@
+#ifndef __VOICE_ALLOC__
+#define __VOICE_ALLOC__
+
+#include <stdint.h>
+
+#define VOICE_ALLOC_MAX 18
+#define VOICE_ALLOC_MAX_OWNERS 8
+#define VOICE_ALLOC_NONE 0xff
+#define VOICE_NOTE_OFF 0x80
+#define VOICE_NOTE_COUNT 128
+
+typedef struct {
+  uint8_t note;
+  uint8_t owner;
+  // other voice of a pair, the secondary voice is on no list while linked
+  uint8_t link;
+  uint8_t prev;
+  uint8_t next;
+  uint32_t stamp;
+} voice_t;
+
+typedef struct {
+  uint8_t head;
+  uint8_t tail;
+} voice_list_t;
+
+// Note on, note off and steal within an owner are O(1): each voice is either on the active list of its owner or on the
+// shared released list, all ordered from the oldest to the newest event, and each owner has a note map giving the voice
+// last assigned to each of its notes. Stealing across owners is O(owners).
+typedef struct {
+  uint8_t count;
+  uint32_t clock;
+  voice_list_t active[VOICE_ALLOC_MAX_OWNERS];
+  uint8_t active_count[VOICE_ALLOC_MAX_OWNERS];
+  uint8_t budget[VOICE_ALLOC_MAX_OWNERS];
+  voice_list_t released;
+  voice_t voices[VOICE_ALLOC_MAX];
+  // secondary voice of each voice that can lead a pair
+  uint8_t partner[VOICE_ALLOC_MAX];
+  uint32_t pairable;
+  uint8_t note_map[VOICE_ALLOC_MAX_OWNERS][VOICE_NOTE_COUNT];
+} voice_alloc_t;
+
+void voice_alloc_init(voice_alloc_t* va, uint8_t count);
+// Keeps the state of the voices below the new count
+void voice_alloc_resize(voice_alloc_t* va, uint8_t count);
+// Voices an owner can keep when the pool is full, owners above their budget lose voices first
+void voice_alloc_set_budget(voice_alloc_t* va, uint8_t owner, uint8_t budget);
+void voice_alloc_set_pairs(voice_alloc_t* va, const uint8_t (*pairs)[2], uint8_t count);
+// Reuses the voice playing the same note of the owner, else takes the oldest released voice preferring those that cannot
+// pair, else steals the oldest active voice of the owner furthest above its budget. A pair it takes is split.
+uint8_t voice_alloc_note_on(voice_alloc_t* va, uint8_t owner, uint8_t note);
+// Same for a note needing two linked voices, the leading voice is returned. Picks the pair stealing the fewest voices,
+// from the owners furthest above their budget, else the oldest. Falls back to a single voice when no pair is set.
+uint8_t voice_alloc_note_on_pair(voice_alloc_t* va, uint8_t owner, uint8_t note);
+uint8_t voice_alloc_note_off(voice_alloc_t* va, uint8_t owner, uint8_t note);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,209 @@
+import argparse
+import asyncio
+import datetime
+import struct
+import zlib
+from bleak import BleakClient, BleakScanner
+
+
+BANK_UUID = '78790006-60FE-4153-9038-A770B4D65767'
+
+BANK_EXPORT = 0x01
+BANK_IMPORT = 0x02
+BANK_REQUEST_ACK = 0x03
+BANK_REQUEST_NAK = 0x04
+BANK_DATA = 0x05
+BANK_DATA_ACK = 0x06
+BANK_DATA_NAK = 0x07
+BANK_END = 0x08
+BANK_END_ACK = 0x09
+BANK_END_NAK = 0x0a
+
+# synth_prg_dump_t: bank, program, opl_program_t
+RECORD_SIZE = 123
+# before programs had a tuning, the device treats the zeroed tuning as equal temperament
+RECORD_SIZE_V0 = 110
+# op, sequence number, CRC32
+DATA_OVERHEAD = 7
+# the device acks every 4 packets
+WINDOW = 8
+TIMEOUT = 2.0
+
+
+async def _search_for_device():
+    print("Searching for SynthOPL...")
+    dev = None
+
+    devices = await BleakScanner.discover()
+    for device in devices:
+        if device.name == "Synth OPL":
+            dev = device
+
+    if dev is not None:
+        print("SynthOPL found!")
+    else:
+        print("SynthOPL has not been found.")
+        assert dev is not None
+
+    return dev
+
+
+def _parse_prg(arg):
+    bank, prg = arg.split(":")
+    return int(bank, 0), int(prg, 0)
+
+
+def _data_packet(seq, records):
+    body = struct.pack("<H", seq & 0xffff) + records
+    return bytes([BANK_DATA]) + body + struct.pack("<I", zlib.crc32(body))
+
+
+async def _export(client, notifications, first, last):
+    records = {}
+    expected = 0
+    count = None
+
+    await client.write_gatt_char(BANK_UUID, bytes([BANK_EXPORT, *first, *last]), response=True)
+
+    while True:
+        try:
+            msg = await asyncio.wait_for(notifications.get(), TIMEOUT)
+        except asyncio.TimeoutError:
+            # a notification could not be sent, acking again resumes the device
+            await client.write_gatt_char(BANK_UUID, bytes([BANK_DATA_ACK]) + struct.pack("<H", expected), response=True)
+            continue
+
+        op = msg[0]
+
+        if op == BANK_REQUEST_NAK:
+            print("SynthOPL did not accept the export request.")
+            return None
+        elif op == BANK_REQUEST_ACK:
+            count, = struct.unpack_from("<H", msg, 1)
+            print(f"Exporting {count} programs.")
+        elif op == BANK_DATA:
+            seq, = struct.unpack_from("<H", msg, 1)
+            body = msg[1:-4]
+            crc, = struct.unpack_from("<I", msg, len(msg) - 4)
+
+            if zlib.crc32(body) != crc:
+                await client.write_gatt_char(BANK_UUID, bytes([BANK_DATA_NAK]) + struct.pack("<H", expected), response=True)
+                continue
+
+            if seq == expected:
+                records[seq] = bytes(msg[3:-4])
+                expected += 1
+                await client.write_gatt_char(BANK_UUID, bytes([BANK_DATA_ACK]) + struct.pack("<H", expected), response=True)
+        elif op == BANK_END:
+            total, crc = struct.unpack_from("<HI", msg, 1)
+            data = b"".join(records[i] for i in range(expected))
+
+            if total != len(data) // RECORD_SIZE or zlib.crc32(data) != crc:
+                print("Export checksum mismatch.")
+                return None
+
+            return data
+
+
+async def _import(client, notifications, data):
+    count = len(data) // RECORD_SIZE
+    per_packet = (client.mtu_size - 3 - DATA_OVERHEAD) // RECORD_SIZE
+    packets = [data[i:i + per_packet * RECORD_SIZE] for i in range(0, len(data), per_packet * RECORD_SIZE)]
+
+    await client.write_gatt_char(BANK_UUID, bytes([BANK_IMPORT]) + struct.pack("<H", count), response=True)
+    if (await asyncio.wait_for(notifications.get(), TIMEOUT))[0] != BANK_REQUEST_ACK:
+        print("SynthOPL did not accept the import request.")
+        return False
+
+    print(f"Importing {count} programs in {len(packets)} packets.")
+    base = 0
+    sent = 0
+
+    while base < len(packets):
+        while sent < len(packets) and (sent - base) < WINDOW:
+            await client.write_gatt_char(BANK_UUID, _data_packet(sent, packets[sent]), response=False)
+            sent += 1
+
+        try:
+            msg = await asyncio.wait_for(notifications.get(), TIMEOUT)
+        except asyncio.TimeoutError:
+            sent = base
+            continue
+
+        if msg[0] not in (BANK_DATA_ACK, BANK_DATA_NAK):
+            continue
+
+        seq, = struct.unpack_from("<H", msg, 1)
+        delta = (seq - base) & 0xffff
+
+        # acks come once the programs are stored, one can trail a NAK that already moved past it
+        if delta >= 0x8000:
+            continue
+
+        pos = base + delta
+
+        if msg[0] == BANK_DATA_NAK:
+            base = sent = pos
+        elif pos > base:
+            base = pos
+
+    await client.write_gatt_char(BANK_UUID, bytes([BANK_END]) + struct.pack("<HI", count, zlib.crc32(data)), response=True)
+
+    while True:
+        msg = await notifications.get()
+        if msg[0] in (BANK_END_ACK, BANK_END_NAK):
+            return msg[0] == BANK_END_ACK
+
+
+async def main(args):
+    t0 = datetime.datetime.now()
+    notifications = asyncio.Queue()
+
+    dev = await _search_for_device()
+    async with BleakClient(dev) as client:
+
+        async def _notification_handler(sender: int, data: bytearray):
+            await notifications.put(bytes(data))
+
+        await client.start_notify(BANK_UUID, _notification_handler)
+
+        if args.cmd == "export":
+            data = await _export(client, notifications, args.first, args.last)
+            if data is None:
+                return
+
+            with open(args.file, "wb") as file:
+                file.write(data)
+
+            print(f"Exported {len(data) // RECORD_SIZE} programs in {datetime.datetime.now() - t0}.")
+        else:
+            with open(args.file, "rb") as file:
+                data = file.read()
+
+            if len(data) % RECORD_SIZE != 0 and len(data) % RECORD_SIZE_V0 == 0:
+                pad = bytes(RECORD_SIZE - RECORD_SIZE_V0)
+                data = b"".join(data[i:i + RECORD_SIZE_V0] + pad for i in range(0, len(data), RECORD_SIZE_V0))
+
+            if len(data) % RECORD_SIZE != 0:
+                print(f"{args.file} is not a bank file.")
+                return
+
+            if await _import(client, notifications, data):
+                print(f"Imported {len(data) // RECORD_SIZE} programs in {datetime.datetime.now() - t0}.")
+            else:
+                print("Import failed.")
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Back up or restore SynthOPL programs")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    export = sub.add_parser("export", help="save the stored programs to a file")
+    export.add_argument("file")
+    export.add_argument("--first", type=_parse_prg, default=(0, 0), help="first BANK:PROGRAM, 0:0 by default")
+    export.add_argument("--last", type=_parse_prg, default=(255, 255), help="last BANK:PROGRAM, 255:255 by default")
+
+    imp = sub.add_parser("import", help="store the programs of a file")
+    imp.add_argument("file")
+
+    asyncio.run(main(parser.parse_args()))
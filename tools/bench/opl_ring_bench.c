@@ -0,0 +1,212 @@
+// Host stress benchmark of the OPL lanes: one producer thread per source into its own lock-free ring, against the
+// previous single queue shared by every source, modelled by a mutex and two condition variables like a FreeRTOS queue.
+// Built by tools/host, the event count can be given to run it quickly. Fails when an event arrives out of order.
+// opl_ring_bench [events]
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "opl_ring.h"
+
+#define PRODUCERS 2
+#define EVENT_COUNT 4000000
+#define ROUNDS 3
+#define RING_LEN 64
+#define QUEUE_LEN 32
+
+static uint32_t event_count = EVENT_COUNT;
+
+// same layouts as the note lane events and the queued events of opl_srv.c
+typedef struct {
+  uint32_t ingress_us;
+  uint32_t enqueue_us;
+  uint16_t seq;
+  uint8_t cmd;
+  uint8_t note[3];
+} note_ev_t;
+
+typedef struct {
+  uint8_t msg[23];
+  uint32_t src;
+  uint16_t seq;
+  uint32_t ingress_us;
+  uint32_t enqueue_us;
+} event_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  event_t items[QUEUE_LEN];
+  uint32_t head;
+  uint32_t count;
+} queue_t;
+
+static opl_ring_t rings[PRODUCERS];
+static note_ev_t ring_bufs[PRODUCERS][RING_LEN];
+static queue_t queue;
+static uint32_t full_spins[PRODUCERS];
+
+static double now_s() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* ring_producer(void* arg) {
+  int src = (int) (intptr_t) arg;
+  note_ev_t ev = { .cmd = 0 };
+
+  for (uint32_t i = 0; i < event_count; i++) {
+    ev.seq = i;
+    ev.ingress_us = i;
+    ev.note[0] = i & 0x7f;
+
+    while (!opl_ring_push(&rings[src], &ev)) {
+      full_spins[src]++;
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+// polls every ring like the OPL task does after a notification, returns the events taken
+static uint64_t ring_consume() {
+  uint32_t expected[PRODUCERS] = { 0 };
+  uint64_t total = 0;
+
+  while (total < (uint64_t) event_count * PRODUCERS) {
+    uint8_t idle = 1;
+
+    for (int src = 0; src < PRODUCERS; src++) {
+      const note_ev_t* ev;
+
+      while ((ev = opl_ring_peek(&rings[src])) != NULL) {
+        if ((ev->seq != (uint16_t) expected[src]) || (ev->ingress_us != expected[src])) {
+          fprintf(stderr, "ring %d: got event %u, expected %u\n", src, ev->ingress_us, expected[src]);
+          exit(1);
+        }
+
+        expected[src]++;
+        total++;
+        idle = 0;
+        opl_ring_pop(&rings[src]);
+      }
+    }
+
+    if (idle) {
+      sched_yield();
+    }
+  }
+
+  return total;
+}
+
+static void* queue_producer(void* arg) {
+  int src = (int) (intptr_t) arg;
+  event_t ev = { .src = src };
+
+  for (uint32_t i = 0; i < event_count; i++) {
+    ev.seq = i;
+    ev.ingress_us = i;
+    ev.msg[1] = i & 0x7f;
+
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == QUEUE_LEN) {
+      pthread_cond_wait(&queue.not_full, &queue.lock);
+    }
+
+    queue.items[(queue.head + queue.count) % QUEUE_LEN] = ev;
+    queue.count++;
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+  }
+
+  return NULL;
+}
+
+static uint64_t queue_consume() {
+  uint32_t expected[PRODUCERS] = { 0 };
+  uint64_t total = 0;
+  event_t ev;
+
+  while (total < (uint64_t) event_count * PRODUCERS) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == 0) {
+      pthread_cond_wait(&queue.not_empty, &queue.lock);
+    }
+
+    ev = queue.items[queue.head];
+    queue.head = (queue.head + 1) % QUEUE_LEN;
+    queue.count--;
+    pthread_cond_signal(&queue.not_full);
+    pthread_mutex_unlock(&queue.lock);
+
+    if (ev.ingress_us != expected[ev.src]) {
+      fprintf(stderr, "queue source %u: got event %u, expected %u\n", ev.src, ev.ingress_us, expected[ev.src]);
+      exit(1);
+    }
+
+    expected[ev.src]++;
+    total++;
+  }
+
+  return total;
+}
+
+static double run(void* (*producer)(void*), uint64_t (*consume)()) {
+  pthread_t threads[PRODUCERS];
+  double t0 = now_s();
+
+  for (int src = 0; src < PRODUCERS; src++) {
+    pthread_create(&threads[src], NULL, producer, (void*) (intptr_t) src);
+  }
+
+  uint64_t total = consume();
+
+  for (int src = 0; src < PRODUCERS; src++) {
+    pthread_join(threads[src], NULL);
+  }
+
+  return total / (now_s() - t0);
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    event_count = atoi(argv[1]);
+  }
+
+  printf("%d producers, %u events each, %zu byte lane events, %zu byte queue events\n",
+    PRODUCERS, event_count, sizeof(note_ev_t), sizeof(event_t));
+
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int src = 0; src < PRODUCERS; src++) {
+      opl_ring_init(&rings[src], ring_bufs[src], sizeof(note_ev_t), RING_LEN);
+      full_spins[src] = 0;
+    }
+
+    double ring_rate = run(ring_producer, ring_consume);
+    uint32_t spins = 0;
+
+    for (int src = 0; src < PRODUCERS; src++) {
+      spins += full_spins[src];
+    }
+
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+
+    double queue_rate = run(queue_producer, queue_consume);
+
+    printf("round %d: rings %.1f M events/s (%u full), queue %.1f M events/s, %.1fx\n", round,
+      ring_rate / 1e6, spins, queue_rate / 1e6, ring_rate / queue_rate);
+  }
+
+  return 0;
+}
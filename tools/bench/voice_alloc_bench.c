@@ -0,0 +1,198 @@
+// Host microbenchmark of the keyboard voice allocator against the previous linear scan.
+// Built by tools/host, the event count can be given to run it quickly. Fails when the allocators choose differently.
+// voice_alloc_bench [events]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "voice_alloc.h"
+
+#define EVENT_COUNT 1000000
+#define ROUNDS 5
+
+typedef struct {
+  uint8_t on;
+  uint8_t note;
+} event_t;
+
+typedef struct {
+  uint64_t last_modified;
+  uint8_t note;
+} scan_voice_t;
+
+static scan_voice_t scan_voices[VOICE_ALLOC_MAX];
+static uint64_t scan_clock;
+
+static void scan_init(int poly) {
+  for (int i = 0; i < poly; i++) {
+    scan_voices[i].last_modified = 0;
+    scan_voices[i].note = VOICE_NOTE_OFF;
+  }
+}
+
+static uint8_t scan_note_on(int poly, uint8_t note) {
+  int voice = VOICE_ALLOC_NONE;
+  uint64_t first_played = UINT64_MAX;
+  int stolen_voice = VOICE_ALLOC_NONE;
+
+  for (int i = 0; i < poly; i++) {
+    if ((scan_voices[i].note & 0x7f) == note) {
+      voice = i;
+      break;
+    } else if (scan_voices[i].note & VOICE_NOTE_OFF) {
+      if ((voice == VOICE_ALLOC_NONE) || (scan_voices[i].last_modified < scan_voices[voice].last_modified)) {
+        voice = i;
+      }
+    } else if (scan_voices[i].last_modified < first_played) {
+      first_played = scan_voices[i].last_modified;
+      stolen_voice = i;
+    }
+  }
+
+  if (voice == VOICE_ALLOC_NONE) {
+    voice = stolen_voice;
+  }
+
+  scan_voices[voice].last_modified = ++scan_clock;
+  scan_voices[voice].note = note;
+  return voice;
+}
+
+static uint8_t scan_note_off(int poly, uint8_t note) {
+  for (int i = 0; i < poly; i++) {
+    if (scan_voices[i].note == note) {
+      scan_voices[i].last_modified = ++scan_clock;
+      scan_voices[i].note |= VOICE_NOTE_OFF;
+      return i;
+    }
+  }
+
+  return VOICE_ALLOC_NONE;
+}
+
+// notes are picked at random and released once more than max_held are down
+static void gen_random(event_t* evs, int count, int max_held) {
+  uint8_t held[VOICE_NOTE_COUNT];
+  int held_count = 0;
+
+  for (int i = 0; i < count; i++) {
+    if ((held_count > max_held) || (held_count && (rand() & 1))) {
+      int idx = rand() % held_count;
+      evs[i].on = 0;
+      evs[i].note = held[idx];
+      held[idx] = held[--held_count];
+    } else {
+      evs[i].on = 1;
+      evs[i].note = 36 + (rand() % 60);
+      held[held_count++] = evs[i].note;
+    }
+  }
+}
+
+// four note chords struck together and released together, the chords overlap so voices get stolen
+static void gen_chords(event_t* evs, int count) {
+  static const uint8_t shapes[4][4] = { {0, 4, 7, 12}, {0, 3, 7, 10}, {0, 4, 7, 11}, {0, 5, 7, 14} };
+  uint8_t prev[4] = {0};
+  int has_prev = 0;
+  int i = 0;
+
+  while (i < count) {
+    uint8_t root = 36 + (rand() % 36);
+    const uint8_t* shape = shapes[rand() % 4];
+
+    for (int n = 0; (n < 4) && (i < count); n++) {
+      evs[i].on = 1;
+      evs[i++].note = root + shape[n];
+    }
+
+    for (int n = 0; has_prev && (n < 4) && (i < count); n++) {
+      evs[i].on = 0;
+      evs[i++].note = prev[n];
+    }
+
+    for (int n = 0; n < 4; n++) {
+      prev[n] = root + shape[n];
+    }
+
+    has_prev = 1;
+  }
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1e9) + ts.tv_nsec;
+}
+
+static double run_scan(const event_t* evs, int count, int poly, uint32_t* check) {
+  double best = 1e30;
+
+  for (int r = 0; r < ROUNDS; r++) {
+    scan_init(poly);
+    uint32_t sum = 0;
+    double start = now_ns();
+
+    for (int i = 0; i < count; i++) {
+      sum = sum * 31 + (evs[i].on ? scan_note_on(poly, evs[i].note) : scan_note_off(poly, evs[i].note));
+    }
+
+    double elapsed = (now_ns() - start) / count;
+    best = elapsed < best ? elapsed : best;
+    *check = sum;
+  }
+
+  return best;
+}
+
+static double run_alloc(const event_t* evs, int count, int poly, uint32_t* check) {
+  static voice_alloc_t va;
+  double best = 1e30;
+
+  for (int r = 0; r < ROUNDS; r++) {
+    voice_alloc_init(&va, poly);
+    uint32_t sum = 0;
+    double start = now_ns();
+
+    for (int i = 0; i < count; i++) {
+      sum = sum * 31 + (evs[i].on ? voice_alloc_note_on(&va, 0, evs[i].note) : voice_alloc_note_off(&va, 0, evs[i].note));
+    }
+
+    double elapsed = (now_ns() - start) / count;
+    best = elapsed < best ? elapsed : best;
+    *check = sum;
+  }
+
+  return best;
+}
+
+int main(int argc, char** argv) {
+  static const int polys[2] = { 6, 12 };
+  int count = (argc > 1) ? atoi(argv[1]) : EVENT_COUNT;
+  event_t* evs = malloc(sizeof(event_t) * count);
+  int differ = 0;
+
+  printf("%-8s %5s %12s %12s %8s\n", "stream", "poly", "scan ns/ev", "lists ns/ev", "same");
+
+  for (int s = 0; s < 2; s++) {
+    for (int p = 0; p < 2; p++) {
+      srand(1234);
+      if (s == 0) {
+        gen_random(evs, count, polys[p] + 4);
+      } else {
+        gen_chords(evs, count);
+      }
+
+      // the order sensitive checksum of the returned voices shows both allocators make the same choices
+      uint32_t scan_check, alloc_check;
+      double scan = run_scan(evs, count, polys[p], &scan_check);
+      double alloc = run_alloc(evs, count, polys[p], &alloc_check);
+      printf("%-8s %5d %12.2f %12.2f %8s\n", s ? "chords" : "random", polys[p], scan, alloc, scan_check == alloc_check ? "yes" : "no");
+      differ += scan_check != alloc_check;
+    }
+  }
+
+  free(evs);
+  return differ ? 1 : 0;
+}
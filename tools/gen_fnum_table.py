@@ -0,0 +1,40 @@
+"""Generates main/opl_fnum_table.h, one octave of OPL F-Numbers at OPL_PITCH_FINE steps per semitone.
+
+    python3 tools/gen_fnum_table.py > main/opl_fnum_table.h
+
+The octave starts at F-Number 512 so every entry keeps 10 significant bits, opl_srv.c expands it to the 128 MIDI
+notes choosing the block for each pitch.
+"""
+
+import math
+
+OPL_SAMPLE_RATE = 49716
+FINE = 32
+STEPS = 12 * FINE
+
+# pitch in fine steps above MIDI note 0 where block 0 reaches F-Number 512
+f512 = 512 * OPL_SAMPLE_RATE / (1 << 20)
+base = FINE * (69 + 12 * math.log2(f512 / 440))
+base_step = math.ceil(base)
+# the table starts at the first whole step, the fraction is folded into it
+offset = base_step - base
+
+fnums = [round(512 * 2 ** ((i + offset) / STEPS)) for i in range(STEPS)]
+assert all(512 <= f <= 1023 for f in fnums)
+
+print("// Generated by tools/gen_fnum_table.py, do not edit")
+print("#ifndef __OPL_FNUM_TABLE__")
+print("#define __OPL_FNUM_TABLE__")
+print()
+print("#include <stdint.h>")
+print()
+print(f"#define OPL_FNUM_OCTAVE_STEPS {STEPS}")
+print("// pitch, in fine steps above MIDI note 0, of the first entry at block 0")
+print(f"#define OPL_FNUM_OCTAVE_BASE {base_step}")
+print()
+print("static const uint16_t OPL_FNUM_OCTAVE[OPL_FNUM_OCTAVE_STEPS] = {")
+for i in range(0, STEPS, 16):
+    print("  " + ", ".join(str(f) for f in fnums[i:i + 16]) + ",")
+print("};")
+print()
+print("#endif")
@@ -0,0 +1,76 @@
+// ESP-IDF stand-ins: the timer, error names, the MIDI UART and the BLE notifications the synth core calls
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "driver/uart.h"
+#include "gatt_svr.h"
+#include "nvs.h"
+
+static int64_t set_us = -1;
+
+int64_t esp_timer_get_time() {
+  static int64_t start_us = -1;
+  int64_t fixed_us = __atomic_load_n(&set_us, __ATOMIC_ACQUIRE);
+  if (fixed_us >= 0) {
+    return fixed_us;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  int64_t now_us = (ts.tv_sec * 1000000ll) + (ts.tv_nsec / 1000);
+  if (start_us < 0) {
+    start_us = now_us;
+  }
+
+  return now_us - start_us;
+}
+
+void host_timer_set(int64_t now_us) {
+  __atomic_store_n(&set_us, now_us, __ATOMIC_RELEASE);
+}
+
+const char* esp_err_to_name(esp_err_t err) {
+  switch (err) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+    case ESP_ERR_NVS_NOT_ENOUGH_SPACE: return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+    default: return "ERROR";
+  }
+}
+
+esp_err_t uart_driver_install(uart_port_t port, int rx_size, int tx_size, int queue_size, void* queue, int flags) {
+  return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t* config) {
+  return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts) {
+  return ESP_ERR_INVALID_STATE;
+}
+
+int uart_read_bytes(uart_port_t port, void* buf, uint32_t len, TickType_t wait) {
+  return -1;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t* len) {
+  *len = 0;
+  return ESP_ERR_INVALID_STATE;
+}
+
+void ble_synth_notify_program(void) {
+}
+
+void ble_synth_notify_saved(uint16_t conn_handle, uint8_t bank, uint8_t prg, bool stored) {
+}
@@ -0,0 +1,253 @@
+// FreeRTOS stand-ins on pthreads: tasks are threads, queues and task notifications a mutex and a condition variable
+// each, blocking times are rounded to ticks like on the device.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#define HOST_TASK_MAX 16
+
+struct host_task {
+  pthread_t thread;
+  char name[16];
+  TaskFunction_t fn;
+  void* param;
+  pthread_mutex_t lock;
+  pthread_cond_t notified;
+  uint32_t notify_count;
+};
+
+struct host_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  uint8_t* items;
+  UBaseType_t len;
+  UBaseType_t item_size;
+  UBaseType_t head;
+  UBaseType_t count;
+};
+
+struct host_mutex {
+  pthread_mutex_t lock;
+};
+
+static struct host_task tasks[HOST_TASK_MAX];
+static int task_count;
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct host_task* current_task;
+
+static void host_deadline(TickType_t ticks, struct timespec* out) {
+  uint64_t ns = (uint64_t) ticks * (1000000000ull / configTICK_RATE_HZ);
+  clock_gettime(CLOCK_MONOTONIC, out);
+  out->tv_sec += ns / 1000000000ull;
+  out->tv_nsec += ns % 1000000000ull;
+
+  if (out->tv_nsec >= 1000000000) {
+    out->tv_sec++;
+    out->tv_nsec -= 1000000000;
+  }
+}
+
+static void host_cond_init(pthread_cond_t* cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// Waits on cond until pred holds or the ticks run out, the lock is held around it
+#define HOST_WAIT(cond, lock, pred, wait, ok) do { \
+    struct timespec deadline_; \
+    if ((wait) != portMAX_DELAY) { \
+      host_deadline((wait), &deadline_); \
+    } \
+    (ok) = 1; \
+    while (!(pred)) { \
+      if ((wait) == 0) { \
+        (ok) = 0; \
+        break; \
+      } else if ((wait) == portMAX_DELAY) { \
+        pthread_cond_wait((cond), (lock)); \
+      } else if (pthread_cond_timedwait((cond), (lock), &deadline_) == ETIMEDOUT) { \
+        (ok) = (pred); \
+        break; \
+      } \
+    } \
+  } while (0)
+
+static void* host_task_run(void* arg) {
+  struct host_task* task = arg;
+  current_task = task;
+  task->fn(task->param);
+  return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t prio, TaskHandle_t* out, BaseType_t core) {
+  pthread_mutex_lock(&tasks_lock);
+
+  if (task_count == HOST_TASK_MAX) {
+    pthread_mutex_unlock(&tasks_lock);
+    return pdFALSE;
+  }
+
+  struct host_task* task = &tasks[task_count++];
+  pthread_mutex_unlock(&tasks_lock);
+
+  strncpy(task->name, name, sizeof(task->name) - 1);
+  task->fn = fn;
+  task->param = param;
+  task->notify_count = 0;
+  pthread_mutex_init(&task->lock, NULL);
+  host_cond_init(&task->notified);
+
+  // the handle is known before the task runs, as with FreeRTOS
+  if (out != NULL) {
+    *out = task;
+  }
+
+  pthread_create(&task->thread, NULL, host_task_run, task);
+  pthread_detach(task->thread);
+
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t prio, TaskHandle_t* out) {
+  return xTaskCreatePinnedToCore(fn, name, stack, param, prio, out, 0);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  uint64_t ns = (uint64_t) ticks * (1000000000ull / configTICK_RATE_HZ);
+  struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+
+  if (ticks == 0) {
+    sched_yield();
+    return;
+  }
+
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+}
+
+TickType_t xTaskGetTickCount() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (TickType_t) ((ts.tv_sec * configTICK_RATE_HZ) + (ts.tv_nsec / (1000000000 / configTICK_RATE_HZ)));
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) {
+  struct host_task* task = current_task;
+  int ok;
+
+  pthread_mutex_lock(&task->lock);
+  HOST_WAIT(&task->notified, &task->lock, task->notify_count > 0, wait, ok);
+
+  uint32_t count = task->notify_count;
+  if (ok) {
+    task->notify_count = clear ? 0 : (count - 1);
+  }
+
+  pthread_mutex_unlock(&task->lock);
+
+  return ok ? count : 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  pthread_mutex_lock(&task->lock);
+  task->notify_count++;
+  pthread_cond_signal(&task->notified);
+  pthread_mutex_unlock(&task->lock);
+
+  return pdPASS;
+}
+
+uint64_t host_task_cpu_ns(const char* name) {
+  for (int i = 0; i < task_count; i++) {
+    if (strcmp(tasks[i].name, name) != 0) {
+      continue;
+    }
+
+    clockid_t clock;
+    struct timespec ts;
+    if ((pthread_getcpuclockid(tasks[i].thread, &clock) != 0) || (clock_gettime(clock, &ts) != 0)) {
+      return 0;
+    }
+
+    return (ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+  }
+
+  return 0;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size) {
+  struct host_queue* q = calloc(1, sizeof(struct host_queue));
+  q->items = malloc(len * item_size);
+  q->len = len;
+  q->item_size = item_size;
+  pthread_mutex_init(&q->lock, NULL);
+  host_cond_init(&q->not_empty);
+  host_cond_init(&q->not_full);
+
+  return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t wait) {
+  int ok;
+
+  pthread_mutex_lock(&q->lock);
+  HOST_WAIT(&q->not_full, &q->lock, q->count < q->len, wait, ok);
+
+  if (ok) {
+    memcpy(&q->items[((q->head + q->count) % q->len) * q->item_size], item, q->item_size);
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+  }
+
+  pthread_mutex_unlock(&q->lock);
+
+  return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void* out, TickType_t wait) {
+  int ok;
+
+  pthread_mutex_lock(&q->lock);
+  HOST_WAIT(&q->not_empty, &q->lock, q->count > 0, wait, ok);
+
+  if (ok) {
+    memcpy(out, &q->items[q->head * q->item_size], q->item_size);
+    q->head = (q->head + 1) % q->len;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+  }
+
+  pthread_mutex_unlock(&q->lock);
+
+  return ok ? pdTRUE : pdFALSE;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  struct host_mutex* m = calloc(1, sizeof(struct host_mutex));
+  pthread_mutex_init(&m->lock, NULL);
+  return m;
+}
+
+// the stand-in only waits forever, as every caller in the synth core does
+BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t wait) {
+  pthread_mutex_lock(&m->lock);
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t m) {
+  pthread_mutex_unlock(&m->lock);
+  return pdTRUE;
+}
@@ -0,0 +1,167 @@
+// Feeds byte sequences to the MIDI stream parser as the DIN task reads them from the UART and compares the messages it
+// returns, then their translation to OPL messages.
+//
+// midi_parser_test
+
+#include <stdio.h>
+#include <string.h>
+
+#include "midi_parser.h"
+#include "midi_srv.h"
+
+#define TEST_READ_MAX 4
+#define TEST_READ_LEN 16
+#define TEST_MSG_MAX 8
+
+typedef struct {
+  uint8_t len;
+  uint8_t bytes[TEST_READ_LEN];
+} test_read_t;
+
+typedef struct {
+  const char* name;
+  // the parser is kept from one read to the next
+  test_read_t reads[TEST_READ_MAX];
+  uint8_t msg_count;
+  midi_msg_t msgs[TEST_MSG_MAX];
+} test_case_t;
+
+static const test_case_t CASES[] = {
+  {
+    .name = "note on",
+    .reads = { { 3, { 0x90, 60, 100 } } },
+    .msg_count = 1,
+    .msgs = { { 0x90, { 60, 100 } } },
+  },
+  {
+    .name = "running status across reads",
+    .reads = { { 4, { 0x91, 60, 100, 64 } }, { 3, { 90, 62, 0 } }, { 1, { 70 } }, { 1, { 1 } } },
+    .msg_count = 4,
+    .msgs = { { 0x91, { 60, 100 } }, { 0x91, { 64, 90 } }, { 0x91, { 62, 0 } }, { 0x91, { 70, 1 } } },
+  },
+  {
+    .name = "clock inside a note on",
+    .reads = { { 5, { 0x90, 0xf8, 60, 0xf8, 100 } } },
+    .msg_count = 3,
+    .msgs = { { 0xf8 }, { 0xf8 }, { 0x90, { 60, 100 } } },
+  },
+  {
+    .name = "realtime keeps running status",
+    .reads = { { 3, { 0x90, 60, 100 } }, { 3, { 0xfe, 62, 100 } } },
+    .msg_count = 3,
+    .msgs = { { 0x90, { 60, 100 } }, { 0xfe }, { 0x90, { 62, 100 } } },
+  },
+  {
+    .name = "sysex dropped",
+    .reads = { { 5, { 0xf0, 0x7e, 0x7f, 0x09, 0xf7 } }, { 3, { 0x80, 60, 64 } } },
+    .msg_count = 1,
+    .msgs = { { 0x80, { 60, 64 } } },
+  },
+  {
+    .name = "sysex interrupted by a status byte",
+    .reads = { { 4, { 0xf0, 0x43, 0x10, 0x4c } }, { 5, { 0x90, 60, 100, 62, 100 } } },
+    .msg_count = 2,
+    .msgs = { { 0x90, { 60, 100 } }, { 0x90, { 62, 100 } } },
+  },
+  {
+    .name = "sysex content across reads",
+    .reads = { { 2, { 0xf0, 0x43 } }, { 3, { 0x10, 60, 100 } }, { 4, { 0xf7, 0xc0, 5, 6 } } },
+    .msg_count = 2,
+    .msgs = { { 0xc0, { 5 } }, { 0xc0, { 6 } } },
+  },
+  {
+    .name = "system common cancels running status",
+    .reads = { { 3, { 0x90, 60, 100 } }, { 2, { 0xf3, 4 } }, { 2, { 62, 100 } } },
+    .msg_count = 2,
+    .msgs = { { 0x90, { 60, 100 } }, { 0xf3, { 4 } } },
+  },
+  {
+    .name = "data before any status",
+    .reads = { { 2, { 60, 100 } }, { 3, { 0xe0, 0, 64 } } },
+    .msg_count = 1,
+    .msgs = { { 0xe0, { 0, 64 } } },
+  },
+  {
+    .name = "note on with velocity 0",
+    .reads = { { 3, { 0x92, 60, 100 } }, { 2, { 60, 0 } } },
+    .msg_count = 2,
+    .msgs = { { 0x92, { 60, 100 } }, { 0x92, { 60, 0 } } },
+  },
+};
+
+#define CASE_COUNT (sizeof(CASES) / sizeof(CASES[0]))
+
+static int run_case(const test_case_t* c) {
+  midi_parser_t parser;
+  midi_msg_t msgs[TEST_MSG_MAX];
+  int count = 0;
+
+  midi_parser_reset(&parser);
+
+  for (int r = 0; (r < TEST_READ_MAX) && (c->reads[r].len > 0); r++) {
+    for (int i = 0; i < c->reads[r].len; i++) {
+      midi_msg_t msg;
+      memset(&msg, 0, sizeof(msg));
+
+      if (midi_parser_feed(&parser, c->reads[r].bytes[i], &msg)) {
+        if (count == TEST_MSG_MAX) {
+          printf("FAIL %s: more than %d messages\n", c->name, TEST_MSG_MAX);
+          return 1;
+        }
+
+        msgs[count++] = msg;
+      }
+    }
+  }
+
+  if (count != c->msg_count) {
+    printf("FAIL %s: %d messages, expected %d\n", c->name, count, c->msg_count);
+    return 1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const midi_msg_t* want = &c->msgs[i];
+    // data bytes of messages shorter than two are left over from earlier ones
+    int data_len = (want->status >= MIDI_REALTIME) ? 0 : (((want->status & 0xe0) == MIDI_PRG_CHANGE) || (want->status == 0xf3)) ? 1 : 2;
+
+    if ((msgs[i].status != want->status) || memcmp(msgs[i].data, want->data, data_len)) {
+      printf("FAIL %s: message %d is %02x %d %d, expected %02x %d %d\n", c->name, i, msgs[i].status, msgs[i].data[0],
+        msgs[i].data[1], want->status, want->data[0], want->data[1]);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Senders using running status release notes with a zero velocity note on
+static int check_note_off_velocity() {
+  const midi_msg_t on = { 0x92, { 60, 100 } };
+  const midi_msg_t off = { 0x92, { 60, 0 } };
+  opl_msg_t msg;
+
+  if (!midi_srv_to_opl(&on, &msg) || (msg.cmd != NOTE_ON) || (msg.params.note.note != 60) || (msg.params.note.channel != 2)) {
+    printf("FAIL note on: not translated to NOTE_ON\n");
+    return 1;
+  }
+
+  if (!midi_srv_to_opl(&off, &msg) || (msg.cmd != NOTE_OFF) || (msg.params.note.note != 60) || (msg.params.note.channel != 2)) {
+    printf("FAIL note on with velocity 0: not translated to NOTE_OFF\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int failed = 0;
+
+  for (int i = 0; i < CASE_COUNT; i++) {
+    failed += run_case(&CASES[i]);
+  }
+
+  failed += check_note_off_velocity();
+  printf("%d of %d checks failed\n", failed, (int) CASE_COUNT + 1);
+
+  return failed ? 1 : 0;
+}
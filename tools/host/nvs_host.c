@@ -0,0 +1,370 @@
+// NVS stand-in keeping every partition in memory, loaded from one file on init and saved back on every commit. Each
+// record of the file is partition, namespace and key (16 bytes each), type (u8), length (u32) and data.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#define HOST_NVS_NAMESPACE_MAX 16
+
+typedef struct {
+  char part[NVS_KEY_NAME_MAX_SIZE];
+  char ns[NVS_KEY_NAME_MAX_SIZE];
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_type_t type;
+  uint32_t len;
+  uint8_t* data;
+} host_nvs_entry_t;
+
+typedef struct {
+  char part[NVS_KEY_NAME_MAX_SIZE];
+  char ns[NVS_KEY_NAME_MAX_SIZE];
+} host_nvs_namespace_t;
+
+struct host_nvs_iterator {
+  char part[NVS_KEY_NAME_MAX_SIZE];
+  char ns[NVS_KEY_NAME_MAX_SIZE];
+  nvs_type_t type;
+  size_t pos;
+};
+
+static const char* path = "synth_host.nvs";
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static host_nvs_entry_t* entries;
+static size_t entry_count;
+static size_t entry_capacity;
+// handles are 1 + the index of their namespace
+static host_nvs_namespace_t namespaces[HOST_NVS_NAMESPACE_MAX];
+static int namespace_count;
+
+void host_nvs_set_path(const char* p) {
+  path = p;
+}
+
+static void host_nvs_name(char dst[NVS_KEY_NAME_MAX_SIZE], const char* src) {
+  memset(dst, 0, NVS_KEY_NAME_MAX_SIZE);
+  strncpy(dst, src, NVS_KEY_NAME_MAX_SIZE - 1);
+}
+
+static host_nvs_entry_t* host_nvs_find(nvs_handle_t handle, const char* key) {
+  const host_nvs_namespace_t* ns = &namespaces[handle - 1];
+
+  for (size_t i = 0; i < entry_count; i++) {
+    host_nvs_entry_t* e = &entries[i];
+    if ((strcmp(e->part, ns->part) == 0) && (strcmp(e->ns, ns->ns) == 0) && (strncmp(e->key, key, NVS_KEY_NAME_MAX_SIZE - 1) == 0)) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+static void host_nvs_remove(host_nvs_entry_t* e) {
+  free(e->data);
+  *e = entries[--entry_count];
+}
+
+static esp_err_t host_nvs_set(nvs_handle_t handle, const char* key, nvs_type_t type, const void* value, size_t len) {
+  if ((handle == 0) || (handle > namespace_count)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  uint8_t* data = malloc(len ? len : 1);
+  if (data == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  memcpy(data, value, len);
+  pthread_mutex_lock(&lock);
+
+  host_nvs_entry_t* e = host_nvs_find(handle, key);
+  if (e == NULL) {
+    if (entry_count == entry_capacity) {
+      entry_capacity = entry_capacity ? (entry_capacity * 2) : 64;
+      entries = realloc(entries, entry_capacity * sizeof(host_nvs_entry_t));
+    }
+
+    e = &entries[entry_count++];
+    host_nvs_name(e->part, namespaces[handle - 1].part);
+    host_nvs_name(e->ns, namespaces[handle - 1].ns);
+    host_nvs_name(e->key, key);
+  } else {
+    free(e->data);
+  }
+
+  e->type = type;
+  e->len = len;
+  e->data = data;
+
+  pthread_mutex_unlock(&lock);
+
+  return ESP_OK;
+}
+
+static esp_err_t host_nvs_get(nvs_handle_t handle, const char* key, nvs_type_t type, void* out, size_t* len) {
+  if ((handle == 0) || (handle > namespace_count)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  esp_err_t err = ESP_OK;
+  pthread_mutex_lock(&lock);
+
+  host_nvs_entry_t* e = host_nvs_find(handle, key);
+  if (e == NULL) {
+    err = ESP_ERR_NVS_NOT_FOUND;
+  } else if (e->type != type) {
+    err = ESP_ERR_NVS_TYPE_MISMATCH;
+  } else if (out == NULL) {
+    *len = e->len;
+  } else if (*len < e->len) {
+    err = ESP_ERR_NVS_INVALID_LENGTH;
+  } else {
+    memcpy(out, e->data, e->len);
+    *len = e->len;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return err;
+}
+
+static esp_err_t host_nvs_save() {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    return ESP_FAIL;
+  }
+
+  for (size_t i = 0; i < entry_count; i++) {
+    const host_nvs_entry_t* e = &entries[i];
+    uint8_t type = e->type;
+
+    fwrite(e->part, 1, NVS_KEY_NAME_MAX_SIZE, file);
+    fwrite(e->ns, 1, NVS_KEY_NAME_MAX_SIZE, file);
+    fwrite(e->key, 1, NVS_KEY_NAME_MAX_SIZE, file);
+    fwrite(&type, 1, 1, file);
+    fwrite(&e->len, sizeof(e->len), 1, file);
+    fwrite(e->data, 1, e->len, file);
+  }
+
+  return (fclose(file) == 0) ? ESP_OK : ESP_FAIL;
+}
+
+static void host_nvs_load() {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    return;
+  }
+
+  host_nvs_entry_t e;
+  uint8_t type;
+
+  while ((fread(e.part, 1, NVS_KEY_NAME_MAX_SIZE, file) == NVS_KEY_NAME_MAX_SIZE) &&
+      (fread(e.ns, 1, NVS_KEY_NAME_MAX_SIZE, file) == NVS_KEY_NAME_MAX_SIZE) &&
+      (fread(e.key, 1, NVS_KEY_NAME_MAX_SIZE, file) == NVS_KEY_NAME_MAX_SIZE) &&
+      (fread(&type, 1, 1, file) == 1) && (fread(&e.len, sizeof(e.len), 1, file) == 1)) {
+    e.type = type;
+    e.data = malloc(e.len ? e.len : 1);
+
+    if (fread(e.data, 1, e.len, file) != e.len) {
+      free(e.data);
+      break;
+    }
+
+    if (entry_count == entry_capacity) {
+      entry_capacity = entry_capacity ? (entry_capacity * 2) : 64;
+      entries = realloc(entries, entry_capacity * sizeof(host_nvs_entry_t));
+    }
+
+    entries[entry_count++] = e;
+  }
+
+  fclose(file);
+}
+
+esp_err_t nvs_flash_init() {
+  return nvs_flash_init_partition("nvs");
+}
+
+esp_err_t nvs_flash_init_partition(const char* part) {
+  pthread_mutex_lock(&lock);
+
+  static int loaded;
+  if (!loaded) {
+    host_nvs_load();
+    loaded = 1;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase() {
+  pthread_mutex_lock(&lock);
+
+  while (entry_count > 0) {
+    host_nvs_remove(&entries[0]);
+  }
+
+  esp_err_t err = host_nvs_save();
+  pthread_mutex_unlock(&lock);
+
+  return err;
+}
+
+esp_err_t nvs_open_from_partition(const char* part, const char* ns, nvs_open_mode_t mode, nvs_handle_t* out) {
+  pthread_mutex_lock(&lock);
+
+  int i = 0;
+  while ((i < namespace_count) && ((strcmp(namespaces[i].part, part) != 0) || (strcmp(namespaces[i].ns, ns) != 0))) {
+    i++;
+  }
+
+  if (i == HOST_NVS_NAMESPACE_MAX) {
+    pthread_mutex_unlock(&lock);
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+  }
+
+  if (i == namespace_count) {
+    host_nvs_name(namespaces[i].part, part);
+    host_nvs_name(namespaces[i].ns, ns);
+    namespace_count++;
+  }
+
+  *out = i + 1;
+  pthread_mutex_unlock(&lock);
+
+  return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out, size_t* len) {
+  return host_nvs_get(handle, key, NVS_TYPE_BLOB, out, len);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t len) {
+  return host_nvs_set(handle, key, NVS_TYPE_BLOB, value, len);
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char* key, uint8_t* out) {
+  size_t len = 1;
+  return host_nvs_get(handle, key, NVS_TYPE_U8, out, &len);
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char* key, uint8_t value) {
+  return host_nvs_set(handle, key, NVS_TYPE_U8, &value, 1);
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+  if ((handle == 0) || (handle > namespace_count)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  pthread_mutex_lock(&lock);
+
+  host_nvs_entry_t* e = host_nvs_find(handle, key);
+  if (e != NULL) {
+    host_nvs_remove(e);
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return (e != NULL) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+  if ((handle == 0) || (handle > namespace_count)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  const host_nvs_namespace_t* ns = &namespaces[handle - 1];
+  pthread_mutex_lock(&lock);
+
+  for (size_t i = 0; i < entry_count; ) {
+    if ((strcmp(entries[i].part, ns->part) == 0) && (strcmp(entries[i].ns, ns->ns) == 0)) {
+      host_nvs_remove(&entries[i]);
+    } else {
+      i++;
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  pthread_mutex_lock(&lock);
+  esp_err_t err = host_nvs_save();
+  pthread_mutex_unlock(&lock);
+
+  return err;
+}
+
+static bool host_nvs_iterator_match(const struct host_nvs_iterator* it, const host_nvs_entry_t* e) {
+  return (strcmp(e->part, it->part) == 0) && ((it->ns[0] == '\0') || (strcmp(e->ns, it->ns) == 0)) &&
+    ((it->type == NVS_TYPE_ANY) || (e->type == it->type));
+}
+
+// Iterators see the entries in place, they must not outlive a change to the store
+static esp_err_t host_nvs_iterator_seek(struct host_nvs_iterator* it) {
+  pthread_mutex_lock(&lock);
+
+  while ((it->pos < entry_count) && !host_nvs_iterator_match(it, &entries[it->pos])) {
+    it->pos++;
+  }
+
+  esp_err_t err = (it->pos < entry_count) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+  pthread_mutex_unlock(&lock);
+
+  return err;
+}
+
+esp_err_t nvs_entry_find(const char* part, const char* ns, nvs_type_t type, nvs_iterator_t* out) {
+  struct host_nvs_iterator* it = calloc(1, sizeof(struct host_nvs_iterator));
+  host_nvs_name(it->part, part);
+  host_nvs_name(it->ns, ns ? ns : "");
+  it->type = type;
+
+  esp_err_t err = host_nvs_iterator_seek(it);
+  if (err != ESP_OK) {
+    free(it);
+    it = NULL;
+  }
+
+  *out = it;
+  return err;
+}
+
+esp_err_t nvs_entry_next(nvs_iterator_t* it) {
+  (*it)->pos++;
+
+  esp_err_t err = host_nvs_iterator_seek(*it);
+  if (err != ESP_OK) {
+    free(*it);
+    *it = NULL;
+  }
+
+  return err;
+}
+
+esp_err_t nvs_entry_info(nvs_iterator_t it, nvs_entry_info_t* out) {
+  pthread_mutex_lock(&lock);
+
+  const host_nvs_entry_t* e = &entries[it->pos];
+  memcpy(out->namespace_name, e->ns, NVS_KEY_NAME_MAX_SIZE);
+  memcpy(out->key, e->key, NVS_KEY_NAME_MAX_SIZE);
+  out->type = e->type;
+
+  pthread_mutex_unlock(&lock);
+
+  return ESP_OK;
+}
+
+void nvs_release_iterator(nvs_iterator_t it) {
+  free(it);
+}
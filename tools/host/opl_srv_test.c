@@ -0,0 +1,261 @@
+// Queues short note sequences to the OPL task of the host build and checks the key-on bits it writes to the recording
+// bus: a note released in the burst that struck it only keys off after the minimum gate time, a note struck again
+// before that keeps sounding, note offs that find the lane full still release their notes, and a drum hit does not take
+// the voice of a keyboard note of the same number in multi timbral mode.
+//
+// opl_srv_test
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "opl_bus_rec.h"
+#include "opl_srv.h"
+#include "opl_stats.h"
+#include "synth.h"
+
+#define TEST_NVS_PATH "opl_srv_test.nvs"
+// the minimum gate time of the OPL task
+#define TEST_GATE_US 5000
+// the note lane of a source
+#define TEST_LANE_LEN 64
+// long enough for any deferred note off to land, a wakeup may come a tick late
+#define TEST_SETTLE_MS 50
+
+#define TEST_DRUM_CHANNEL 9
+
+#define OPL_CH_KEYON_BLOCK_FREQH_BASE 0xb0
+#define OPL_CH_KEY_ON 0x20
+
+typedef struct {
+  bool keyed;
+  // last key-on and key-off, 0 when none
+  uint32_t on_us;
+  uint32_t off_us;
+} test_key_t;
+
+static inline bool is_keyon_reg(uint16_t addr) {
+  return ((addr & 0xff) >= OPL_CH_KEYON_BLOCK_FREQH_BASE) && ((addr & 0xff) <= (OPL_CH_KEYON_BLOCK_FREQH_BASE + 8));
+}
+
+static void note(opl_msg_t* msg, opl_cmd_t cmd, uint8_t n) {
+  msg->cmd = cmd;
+  msg->params.note.note = n;
+  msg->params.note.velocity = (cmd == NOTE_ON) ? 100 : 0;
+  msg->params.note.channel = 0;
+}
+
+// State of the only keyboard channel the recording touches, false when it touches none or several
+static bool keyed_channel(test_key_t* out) {
+  size_t count;
+  const opl_bus_rec_entry_t* entries = opl_bus_rec_entries(&count);
+  int addr = -1;
+
+  memset(out, 0, sizeof(*out));
+
+  for (size_t i = 0; i < count; i++) {
+    if (!is_keyon_reg(entries[i].addr)) {
+      continue;
+    }
+
+    if ((addr >= 0) && (addr != entries[i].addr)) {
+      return false;
+    }
+
+    addr = entries[i].addr;
+    out->keyed = (entries[i].data & OPL_CH_KEY_ON) != 0;
+
+    if (out->keyed) {
+      out->on_us = entries[i].timestamp_us;
+    } else {
+      out->off_us = entries[i].timestamp_us;
+    }
+  }
+
+  return addr >= 0;
+}
+
+// Keyboard channels whose last write keys them on
+static int keyed_channels() {
+  size_t count;
+  const opl_bus_rec_entry_t* entries = opl_bus_rec_entries(&count);
+  uint8_t keyed[0x200] = { 0 };
+  int total = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    if (is_keyon_reg(entries[i].addr)) {
+      keyed[entries[i].addr & 0x1ff] = (entries[i].data & OPL_CH_KEY_ON) != 0;
+    }
+  }
+
+  for (int i = 0; i < sizeof(keyed); i++) {
+    total += keyed[i];
+  }
+
+  return total;
+}
+
+static void release_all() {
+  opl_msg_t msg;
+
+  for (int n = 0; n < MIDI_NOTE_COUNT; n++) {
+    note(&msg, NOTE_OFF, n);
+    opl_srv_queue_msg(OPL_SRC_DIN, &msg, (uint32_t) esp_timer_get_time());
+  }
+
+  vTaskDelay(pdMS_TO_TICKS(TEST_SETTLE_MS));
+  opl_bus_rec_clear();
+}
+
+// On, off and on again in one burst: the off is dropped and the note keeps sounding
+static int test_restrike() {
+  opl_msg_t msgs[3];
+  test_key_t key;
+
+  note(&msgs[0], NOTE_ON, 60);
+  note(&msgs[1], NOTE_OFF, 60);
+  note(&msgs[2], NOTE_ON, 60);
+  opl_srv_queue_msgs(OPL_SRC_DIN, msgs, 3, (uint32_t) esp_timer_get_time());
+  vTaskDelay(pdMS_TO_TICKS(TEST_SETTLE_MS));
+
+  if (!keyed_channel(&key) || !key.keyed || key.off_us) {
+    printf("FAIL restrike: the note was keyed off while held\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// On and off in one burst: the off lands after the gate time, even when other traffic wakes the task before
+static int test_gate() {
+  opl_msg_t msgs[2];
+  opl_msg_t other;
+  test_key_t key;
+
+  note(&msgs[0], NOTE_ON, 62);
+  note(&msgs[1], NOTE_OFF, 62);
+  opl_srv_queue_msgs(OPL_SRC_DIN, msgs, 2, (uint32_t) esp_timer_get_time());
+
+  // a program change of another part wakes the OPL task without adding keyboard writes of part 0
+  usleep(1000);
+  other.cmd = LOAD_PROGRAM;
+  other.params.load_prg.bank = 0;
+  other.params.load_prg.prg = 0;
+  other.params.load_prg.part = 1;
+  opl_srv_queue_msg(OPL_SRC_DIN, &other, (uint32_t) esp_timer_get_time());
+  vTaskDelay(pdMS_TO_TICKS(TEST_SETTLE_MS));
+
+  if (!keyed_channel(&key) || key.keyed || !key.on_us || !key.off_us) {
+    printf("FAIL gate: the note was not keyed on then off\n");
+    return 1;
+  }
+
+  if ((key.off_us - key.on_us) < TEST_GATE_US) {
+    printf("FAIL gate: keyed off %u us after its key-on\n", key.off_us - key.on_us);
+    return 1;
+  }
+
+  return 0;
+}
+
+// Note ons fill the lane before the OPL task is woken, the note offs that follow find it full
+static int test_lane_full() {
+  static opl_msg_t msgs[TEST_LANE_LEN * 2];
+  opl_stats_t stats;
+
+  for (int n = 0; n < TEST_LANE_LEN; n++) {
+    note(&msgs[n], NOTE_ON, 24 + n);
+    note(&msgs[TEST_LANE_LEN + n], NOTE_OFF, 24 + n);
+  }
+
+  opl_stats_reset();
+  opl_srv_queue_msgs(OPL_SRC_DIN, msgs, TEST_LANE_LEN * 2, (uint32_t) esp_timer_get_time());
+  vTaskDelay(pdMS_TO_TICKS(TEST_SETTLE_MS));
+  opl_stats_get(&stats);
+
+  if ((stats.dropped_msgs != 0) || (stats.parked_note_offs != TEST_LANE_LEN)) {
+    printf("FAIL lane full: %u dropped, %u note offs parked\n", stats.dropped_msgs, stats.parked_note_offs);
+    return 1;
+  }
+
+  int keyed = keyed_channels();
+  if (keyed != 0) {
+    printf("FAIL lane full: %d channels still keyed on\n", keyed);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void queue_note(uint8_t channel, opl_cmd_t cmd, uint8_t n) {
+  opl_msg_t msg;
+
+  note(&msg, cmd, n);
+  msg.params.note.channel = channel;
+  opl_srv_queue_msg(OPL_SRC_DIN, &msg, (uint32_t) esp_timer_get_time());
+  vTaskDelay(pdMS_TO_TICKS(TEST_SETTLE_MS));
+}
+
+// Part 0 plays a keyboard note, its drum kit a drum of the same note number, then the keyboard note is released: the
+// drum keeps sounding on a voice of its own
+static int test_drum_collision() {
+  opl_msg_t map;
+
+  map.cmd = PART_MAP;
+  map.params.part_map.multi = 1;
+  for (int i = 0; i < MIDI_CHANNEL_COUNT; i++) {
+    map.params.part_map.channel_part[i] = (i < SYNTH_MAX_PARTS) ? i : SYNTH_PART_NONE;
+  }
+  map.params.part_map.channel_part[TEST_DRUM_CHANNEL] = 0 | SYNTH_PART_DRUMS;
+  opl_srv_queue_msg(OPL_SRC_DIN, &map, (uint32_t) esp_timer_get_time());
+  vTaskDelay(pdMS_TO_TICKS(TEST_SETTLE_MS));
+  opl_bus_rec_clear();
+
+  queue_note(0, NOTE_ON, 36);
+  queue_note(TEST_DRUM_CHANNEL, NOTE_ON, 36);
+
+  int keyed = keyed_channels();
+  if (keyed != 2) {
+    printf("FAIL drum collision: %d channels keyed on for a keyboard note and a drum\n", keyed);
+    return 1;
+  }
+
+  queue_note(0, NOTE_OFF, 36);
+
+  keyed = keyed_channels();
+  if (keyed != 1) {
+    printf("FAIL drum collision: %d channels keyed on after the keyboard note off, expected the drum\n", keyed);
+    return 1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int failed = 0;
+
+  unlink(TEST_NVS_PATH);
+  host_nvs_set_path(TEST_NVS_PATH);
+
+  synth_init();
+  opl_srv_start();
+  // lets every part load its first program
+  vTaskDelay(pdMS_TO_TICKS(100));
+
+  release_all();
+  failed += test_restrike();
+  release_all();
+  failed += test_gate();
+  release_all();
+  failed += test_lane_full();
+  release_all();
+  failed += test_drum_collision();
+
+  printf("%d of 4 checks failed\n", failed);
+  return failed ? 1 : 0;
+}
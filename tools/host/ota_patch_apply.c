@@ -0,0 +1,136 @@
+// Rebuilds an image from a delta OTA patch with the patch reader of the device, for tools/ota_delta_test.py. The patch
+// is fed in chunks the size of a stream packet and the sink only takes a few blocks and copies at a time, as the OTA
+// writer task does when it is behind, so every record is also resumed partway.
+//
+// ota_patch_apply SOURCE PATCH OUT
+// Exits with 1 when the patch is rejected or does not rebuild the whole image. The hash is left to the caller.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ota_patch.h"
+
+#define APPLY_CHUNK 509
+// what the sink takes before it has to be drained
+#define APPLY_ADD_BUDGET 700
+#define APPLY_COPY_BUDGET 2
+// rounds without progress before the patch counts as stuck
+#define APPLY_STALL_MAX 2
+
+static uint8_t* source;
+static size_t source_len;
+static uint8_t* out;
+static size_t out_len;
+static size_t out_cap;
+static size_t add_budget;
+static int copy_budget;
+
+static uint8_t* read_file(const char* path, size_t* len) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  *len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  uint8_t* data = malloc(*len ? *len : 1);
+  if ((data != NULL) && (fread(data, 1, *len, file) != *len)) {
+    perror(path);
+    free(data);
+    data = NULL;
+  }
+
+  fclose(file);
+  return data;
+}
+
+static void out_append(const uint8_t* data, size_t len) {
+  if (out_len + len > out_cap) {
+    out_cap = (out_len + len) * 2;
+    out = realloc(out, out_cap);
+  }
+
+  memcpy(&out[out_len], data, len);
+  out_len += len;
+}
+
+static size_t sink_add(const uint8_t* data, size_t len) {
+  size_t n = (len < add_budget) ? len : add_budget;
+  add_budget -= n;
+  out_append(data, n);
+  return n;
+}
+
+static bool sink_copy_ready() {
+  return copy_budget > 0;
+}
+
+static void sink_copy(uint32_t offset, uint32_t len) {
+  copy_budget--;
+  out_append(&source[offset], len);
+}
+
+static const ota_patch_sink_t SINK = {
+  .add = sink_add,
+  .copy_ready = sink_copy_ready,
+  .copy = sink_copy,
+};
+
+int main(int argc, char** argv) {
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s SOURCE PATCH OUT\n", argv[0]);
+    return 2;
+  }
+
+  size_t patch_len;
+  uint8_t* patch_data;
+  source = read_file(argv[1], &source_len);
+  patch_data = read_file(argv[2], &patch_len);
+  if ((source == NULL) || (patch_data == NULL)) {
+    return 2;
+  }
+
+  ota_patch_t patch;
+  ota_patch_init(&patch, &SINK, source_len);
+
+  size_t pos = 0;
+  int stalls = 0;
+
+  while (pos < patch_len) {
+    size_t chunk_end = ((pos / APPLY_CHUNK) + 1) * APPLY_CHUNK;
+    size_t n = ((chunk_end < patch_len) ? chunk_end : patch_len) - pos;
+    size_t taken = ota_patch_feed(&patch, &patch_data[pos], n);
+
+    pos += taken;
+    stalls = taken ? 0 : (stalls + 1);
+
+    if (stalls > APPLY_STALL_MAX) {
+      fprintf(stderr, "patch stuck at %zu\n", pos);
+      return 1;
+    }
+
+    if (taken < n) {
+      // the writer task catches up
+      add_budget = APPLY_ADD_BUDGET;
+      copy_budget = APPLY_COPY_BUDGET;
+    }
+  }
+
+  if (!ota_patch_complete(&patch)) {
+    fprintf(stderr, "patch rejected or incomplete: %zu of %u bytes written\n", out_len, patch.target_size);
+    return 1;
+  }
+
+  FILE* file = fopen(argv[3], "wb");
+  if ((file == NULL) || (fwrite(out, 1, out_len, file) != out_len)) {
+    perror(argv[3]);
+    return 2;
+  }
+
+  fclose(file);
+  return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef __HOST_ESP_LOG__
+#define __HOST_ESP_LOG__
+
+#include <stdio.h>
+
+// warnings and errors go to stderr, the rest only keeps its arguments checked
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) do { if (0) fprintf(stderr, fmt, ##__VA_ARGS__); (void) (tag); } while (0)
+#define ESP_LOGD(tag, fmt, ...) do { if (0) fprintf(stderr, fmt, ##__VA_ARGS__); (void) (tag); } while (0)
+#define ESP_LOGV(tag, fmt, ...) do { if (0) fprintf(stderr, fmt, ##__VA_ARGS__); (void) (tag); } while (0)
+
+#endif
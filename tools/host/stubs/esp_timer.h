@@ -0,0 +1,11 @@
+#ifndef __HOST_ESP_TIMER__
+#define __HOST_ESP_TIMER__
+
+#include <stdint.h>
+
+// Microseconds since the first call, from the monotonic clock until host_timer_set takes over
+int64_t esp_timer_get_time();
+// From now on the time is now_us, until the next call
+void host_timer_set(int64_t now_us);
+
+#endif
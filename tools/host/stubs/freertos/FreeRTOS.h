@@ -0,0 +1,19 @@
+#ifndef __HOST_FREERTOS__
+#define __HOST_FREERTOS__
+
+#include <stdint.h>
+#include "freertos/FreeRTOSConfig.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define portMAX_DELAY ((TickType_t) 0xffffffffu)
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t) (((uint64_t) (ms) * configTICK_RATE_HZ) / 1000))
+#define pdTICKS_TO_MS(ticks) ((TickType_t) (((uint64_t) (ticks) * 1000) / configTICK_RATE_HZ))
+
+#endif
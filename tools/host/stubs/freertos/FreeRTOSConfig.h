@@ -0,0 +1,7 @@
+#ifndef __HOST_FREERTOS_CONFIG__
+#define __HOST_FREERTOS_CONFIG__
+
+// the ESP-IDF default tick, timeouts round the same way as on the device
+#define configTICK_RATE_HZ 100
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef __HOST_QUEUE__
+#define __HOST_QUEUE__
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+typedef struct host_queue* QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t q, void* out, TickType_t wait);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __HOST_SEMPHR__
+#define __HOST_SEMPHR__
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct host_mutex* SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t m);
+
+#endif
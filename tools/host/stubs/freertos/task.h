@@ -0,0 +1,22 @@
+#ifndef __HOST_TASK__
+#define __HOST_TASK__
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+// Tasks are threads, priorities and cores are ignored
+typedef struct host_task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t prio, TaskHandle_t* out, BaseType_t core);
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t prio, TaskHandle_t* out);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+// Only from a task created above
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+
+// CPU time the thread of a task has used, 0 when no task has that name
+uint64_t host_task_cpu_ns(const char* name);
+
+#endif
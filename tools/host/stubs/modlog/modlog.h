@@ -0,0 +1,4 @@
+#ifndef __HOST_MODLOG__
+#define __HOST_MODLOG__
+
+#endif
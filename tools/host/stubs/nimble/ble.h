@@ -0,0 +1,6 @@
+#ifndef __HOST_NIMBLE_BLE__
+#define __HOST_NIMBLE_BLE__
+
+// gatt_svr.h only needs the declarations it makes itself
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __HOST_NVS__
+#define __HOST_NVS__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define ESP_ERR_NVS_BASE 0x1100
+#define ESP_ERR_NVS_NOT_INITIALIZED (ESP_ERR_NVS_BASE + 0x01)
+#define ESP_ERR_NVS_NOT_FOUND (ESP_ERR_NVS_BASE + 0x02)
+#define ESP_ERR_NVS_TYPE_MISMATCH (ESP_ERR_NVS_BASE + 0x03)
+#define ESP_ERR_NVS_NOT_ENOUGH_SPACE (ESP_ERR_NVS_BASE + 0x05)
+#define ESP_ERR_NVS_INVALID_LENGTH (ESP_ERR_NVS_BASE + 0x0c)
+#define ESP_ERR_NVS_NO_FREE_PAGES (ESP_ERR_NVS_BASE + 0x0d)
+#define ESP_ERR_NVS_NEW_VERSION_FOUND (ESP_ERR_NVS_BASE + 0x10)
+
+#define NVS_KEY_NAME_MAX_SIZE 16
+
+typedef uint32_t nvs_handle_t;
+
+typedef enum {
+  NVS_READONLY,
+  NVS_READWRITE
+} nvs_open_mode_t;
+
+typedef enum {
+  NVS_TYPE_U8 = 0x01,
+  NVS_TYPE_BLOB = 0x42,
+  NVS_TYPE_ANY = 0xff
+} nvs_type_t;
+
+typedef struct {
+  char namespace_name[NVS_KEY_NAME_MAX_SIZE];
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_type_t type;
+} nvs_entry_info_t;
+
+typedef struct host_nvs_iterator* nvs_iterator_t;
+
+esp_err_t nvs_open_from_partition(const char* part, const char* ns, nvs_open_mode_t mode, nvs_handle_t* out);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out, size_t* len);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t len);
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char* key, uint8_t* out);
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char* key, uint8_t value);
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key);
+esp_err_t nvs_erase_all(nvs_handle_t handle);
+esp_err_t nvs_commit(nvs_handle_t handle);
+esp_err_t nvs_entry_find(const char* part, const char* ns, nvs_type_t type, nvs_iterator_t* out);
+esp_err_t nvs_entry_next(nvs_iterator_t* it);
+esp_err_t nvs_entry_info(nvs_iterator_t it, nvs_entry_info_t* out);
+void nvs_release_iterator(nvs_iterator_t it);
+
+// File the partitions are loaded from on init and saved to on every commit
+void host_nvs_set_path(const char* path);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __HOST_NVS_FLASH__
+#define __HOST_NVS_FLASH__
+
+#include "nvs.h"
+
+esp_err_t nvs_flash_init();
+esp_err_t nvs_flash_init_partition(const char* part);
+esp_err_t nvs_flash_erase();
+
+#endif
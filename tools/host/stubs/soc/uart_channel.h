@@ -0,0 +1,6 @@
+#ifndef __HOST_UART_CHANNEL__
+#define __HOST_UART_CHANNEL__
+
+#define UART_NUM_1_RXD_DIRECT_GPIO_NUM 18
+
+#endif
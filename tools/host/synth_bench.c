@@ -0,0 +1,551 @@
+// Replays MIDI streams through the synth core built for the host, DIN input to recorded OPL register writes, and reports
+// for each stream the events handled per second of OPL task CPU time, the bus writes per event and the latency
+// percentiles of the DIN note ons. The streams are generated from a fixed seed so that runs compare, or read from raw
+// MIDI files. Bytes are fed at the DIN rate like the UART delivers them.
+//
+// With --lockstep the time is the one of the stream instead of the clock and every message is taken by the OPL task,
+// along with the program it switches to, before the next one is queued. Each makes a burst of its own whatever the host
+// scheduling, so the bus writes are the same on every run and every machine, the rates and latencies mean nothing.
+// --check then only compares the writes.
+//
+// synth_bench [--lockstep] [--raw FILE]... [--write-baseline FILE] [--check FILE]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "midi_parser.h"
+#include "midi_srv.h"
+#include "opl_bus_rec.h"
+#include "opl_srv.h"
+#include "opl_stats.h"
+#include "synth.h"
+
+#define BENCH_NVS_PATH "synth_bench.nvs"
+#define BENCH_SEED 0x5eed
+#define BENCH_PRG_COUNT 16
+#define BENCH_STREAM_MAX 8192
+#define BENCH_SCENARIO_MAX 16
+// 10 bits per byte at 31250 baud
+#define DIN_BYTE_US 320
+#define DRAIN_TIMEOUT_MS 5000
+#define STEP_POLL_US 50
+// leaves deferred note offs and program swaps that follow the last message time to land
+#define SETTLE_MS 20
+
+// regression thresholds of --check
+#define CHECK_WRITES_TOLERANCE 0.05
+#define CHECK_MIN_RATE 0.5
+#define CHECK_MAX_P99 4
+// host scheduling noise stays under it, a wakeup missed until the next tick does not
+#define CHECK_P99_FLOOR_US 2048
+
+typedef struct {
+  // earliest time from the previous message, the DIN rate may delay it further
+  uint32_t delta_us;
+  uint8_t len;
+  uint8_t bytes[3];
+} bench_ev_t;
+
+typedef struct {
+  bench_ev_t evs[BENCH_STREAM_MAX];
+  size_t count;
+} bench_stream_t;
+
+static const opl_latency_stage_t STAGES[] = { LATENCY_QUEUE_WAIT, LATENCY_VOICE_ALLOC, LATENCY_BUS_WRITE };
+#define STAGE_COUNT (sizeof(STAGES) / sizeof(STAGES[0]))
+static const char* const STAGE_NAMES[STAGE_COUNT] = { "queue_wait", "voice_alloc", "bus_write" };
+
+typedef struct {
+  char name[32];
+  uint32_t events;
+  double events_per_s;
+  double issued_per_event;
+  double elided_per_event;
+  // p50, p90 and p99 of each stage, upper bounds of their histogram buckets in us
+  uint32_t pct[STAGE_COUNT][3];
+} bench_result_t;
+
+static bench_stream_t stream;
+static uint32_t lcg_state;
+static bool lockstep;
+
+static uint32_t lcg_next(uint32_t range) {
+  lcg_state = lcg_state * 1664525u + 1013904223u;
+  return (lcg_state >> 8) % range;
+}
+
+static void stream_add(uint32_t delta_us, uint8_t status, uint8_t d0, uint8_t d1) {
+  if (stream.count == BENCH_STREAM_MAX) {
+    return;
+  }
+
+  bench_ev_t* ev = &stream.evs[stream.count++];
+  ev->delta_us = delta_us;
+  ev->bytes[0] = status;
+  ev->bytes[1] = d0;
+  ev->bytes[2] = d1;
+  ev->len = ((status & 0xf0) == MIDI_PRG_CHANGE) ? 2 : 3;
+}
+
+// Four note chords on the keyboard channel, held then released together
+static void gen_chords() {
+  static const uint8_t SHAPES[][3] = { {4, 7, 11}, {3, 7, 10}, {4, 7, 10}, {3, 6, 10}, {5, 7, 12} };
+
+  for (int i = 0; i < 300; i++) {
+    uint8_t root = 36 + lcg_next(48);
+    const uint8_t* shape = SHAPES[lcg_next(5)];
+    uint8_t vel = 40 + lcg_next(80);
+
+    stream_add(lcg_next(5000), MIDI_NOTE_ON, root, vel);
+    for (int n = 0; n < 3; n++) {
+      stream_add(0, MIDI_NOTE_ON, root + shape[n], vel);
+    }
+
+    stream_add(2000 + lcg_next(8000), MIDI_NOTE_OFF, root, 64);
+    for (int n = 0; n < 3; n++) {
+      stream_add(0, MIDI_NOTE_ON, root + shape[n], 0);
+    }
+  }
+}
+
+// Short hits on an odd channel, the drum kit in single timbral mode
+static void gen_drums() {
+  for (int i = 0; i < 1000; i++) {
+    uint8_t note = 36 + lcg_next(16);
+
+    stream_add(lcg_next(2000), MIDI_NOTE_ON | 1, note, 60 + lcg_next(60));
+    stream_add(lcg_next(1500), MIDI_NOTE_OFF | 1, note, 0);
+  }
+}
+
+// A held chord under a dense pitch bend sweep, back and forth over the whole range
+static void gen_bends() {
+  for (int i = 0; i < 3; i++) {
+    uint8_t root = 48 + lcg_next(24);
+
+    for (int n = 0; n < 3; n++) {
+      stream_add(n ? 0 : 10000, MIDI_NOTE_ON, root + (n * 4), 100);
+    }
+
+    for (int step = 0; step < 800; step++) {
+      int phase = step % 400;
+      uint16_t val = ((phase < 200) ? phase : (400 - phase)) * 81;
+      stream_add(0, MIDI_PITCH_BEND, val & 0x7f, val >> 7);
+    }
+
+    stream_add(0, MIDI_PITCH_BEND, 0x00, 0x40);
+    for (int n = 0; n < 3; n++) {
+      stream_add(0, MIDI_NOTE_OFF, root + (n * 4), 0);
+    }
+  }
+}
+
+// Bank and program changes on the keyboard channel, each followed by a few notes
+static void gen_programs() {
+  for (int i = 0; i < 200; i++) {
+    stream_add(5000 + lcg_next(10000), MIDI_CTRL_CHANGE, 0, 0);
+    stream_add(0, MIDI_PRG_CHANGE, lcg_next(BENCH_PRG_COUNT), 0);
+
+    for (int n = 0; n < 2; n++) {
+      uint8_t note = 48 + lcg_next(24);
+      stream_add(lcg_next(5000), MIDI_NOTE_ON, note, 100);
+      stream_add(5000 + lcg_next(10000), MIDI_NOTE_OFF, note, 0);
+    }
+  }
+}
+
+static const struct {
+  const char* name;
+  void (*gen)();
+} SCENARIOS[] = {
+  { "chords", gen_chords },
+  { "drums", gen_drums },
+  { "bends", gen_bends },
+  { "programs", gen_programs },
+};
+
+// Raw MIDI bytes, each sent as soon as the DIN rate allows
+static bool load_raw(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+
+  int c;
+  while (((c = fgetc(file)) != EOF) && (stream.count < BENCH_STREAM_MAX)) {
+    bench_ev_t* ev = &stream.evs[stream.count++];
+    ev->delta_us = 0;
+    ev->len = 1;
+    ev->bytes[0] = c;
+  }
+
+  fclose(file);
+  return true;
+}
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000000ull) + (ts.tv_nsec / 1000);
+}
+
+static void sleep_until_us(uint64_t due_us) {
+  struct timespec ts = { .tv_sec = due_us / 1000000, .tv_nsec = (due_us % 1000000) * 1000 };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+  }
+}
+
+// Plays the stream as the MIDI task would, returns the messages queued to the OPL task
+static uint32_t replay() {
+  midi_parser_t parser;
+  midi_parser_reset(&parser);
+
+  uint64_t due_us = now_us();
+  uint64_t last_byte_us = due_us;
+  uint32_t queued = 0;
+
+  for (size_t i = 0; i < stream.count; i++) {
+    const bench_ev_t* ev = &stream.evs[i];
+    due_us += ev->delta_us;
+
+    for (int b = 0; b < ev->len; b++) {
+      if (due_us < last_byte_us + DIN_BYTE_US) {
+        due_us = last_byte_us + DIN_BYTE_US;
+      }
+
+      sleep_until_us(due_us);
+      last_byte_us = due_us;
+
+      midi_msg_t midi;
+      opl_msg_t msg;
+      if (midi_parser_feed(&parser, ev->bytes[b], &midi) && midi_srv_to_opl(&midi, &msg)) {
+        opl_srv_queue_msg(OPL_SRC_DIN, &msg, (uint32_t) esp_timer_get_time());
+        queued++;
+      }
+    }
+  }
+
+  return queued;
+}
+
+// Waits for the OPL task to have taken the queued messages and swapped in the programs they load
+static bool step(uint32_t queued, uint32_t switches) {
+  opl_stats_t stats;
+
+  for (int waited = 0; waited < DRAIN_TIMEOUT_MS * 1000; waited += STEP_POLL_US) {
+    opl_stats_get(&stats);
+    if ((stats.burst_msgs >= queued) && (stats.prg_switches >= switches)) {
+      return true;
+    }
+
+    usleep(STEP_POLL_US);
+  }
+
+  return false;
+}
+
+// Plays the stream one message at a time on its own time, returns the messages queued to the OPL task
+static uint32_t replay_lockstep() {
+  midi_parser_t parser;
+  midi_parser_reset(&parser);
+
+  int64_t due_us = esp_timer_get_time();
+  int64_t last_byte_us = due_us;
+  uint32_t queued = 0;
+  uint32_t switches = 0;
+
+  for (size_t i = 0; i < stream.count; i++) {
+    const bench_ev_t* ev = &stream.evs[i];
+    due_us += ev->delta_us;
+
+    for (int b = 0; b < ev->len; b++) {
+      if (due_us < last_byte_us + DIN_BYTE_US) {
+        due_us = last_byte_us + DIN_BYTE_US;
+      }
+
+      last_byte_us = due_us;
+      host_timer_set(due_us);
+
+      midi_msg_t midi;
+      opl_msg_t msg;
+      if (!midi_parser_feed(&parser, ev->bytes[b], &midi) || !midi_srv_to_opl(&midi, &msg)) {
+        continue;
+      }
+
+      opl_srv_queue_msg(OPL_SRC_DIN, &msg, (uint32_t) due_us);
+      queued++;
+      switches += msg.cmd == LOAD_PROGRAM;
+
+      // drain reports the messages left behind
+      if (!step(queued, switches)) {
+        fprintf(stderr, "message %u: the OPL task is stuck\n", queued);
+        return queued;
+      }
+    }
+  }
+
+  return queued;
+}
+
+// Waits for the OPL task to have taken every queued message
+static bool drain(uint32_t queued) {
+  opl_stats_t stats;
+
+  for (int waited = 0; waited < DRAIN_TIMEOUT_MS; waited++) {
+    opl_stats_get(&stats);
+    if (stats.burst_msgs >= queued) {
+      vTaskDelay(pdMS_TO_TICKS(SETTLE_MS));
+      return true;
+    }
+
+    usleep(1000);
+  }
+
+  return false;
+}
+
+static uint32_t percentile(const opl_latency_hist_t* hist, double fraction) {
+  uint32_t total = 0;
+  for (int i = 0; i < OPL_LATENCY_BUCKETS; i++) {
+    total += hist->buckets[i];
+  }
+
+  uint32_t seen = 0;
+  for (int i = 0; i < OPL_LATENCY_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if ((total > 0) && (seen >= fraction * total)) {
+      return 1u << i;
+    }
+  }
+
+  return 0;
+}
+
+static bool run(const char* name, bench_result_t* out) {
+  opl_stats_t stats;
+
+  opl_bus_rec_clear();
+  opl_stats_reset();
+  uint64_t cpu_ns = host_task_cpu_ns("opl_srv");
+
+  uint32_t queued = lockstep ? replay_lockstep() : replay();
+  if (!drain(queued)) {
+    fprintf(stderr, "%s: the OPL task took only part of %u messages\n", name, queued);
+    return false;
+  }
+
+  cpu_ns = host_task_cpu_ns("opl_srv") - cpu_ns;
+  opl_stats_get(&stats);
+
+  memset(out, 0, sizeof(*out));
+  strncpy(out->name, name, sizeof(out->name) - 1);
+  out->events = queued;
+  out->events_per_s = cpu_ns ? (queued * 1e9 / cpu_ns) : 0;
+  // how many bends merge in their slot depends on the host scheduling, the writes are counted per message dispatched
+  uint32_t dispatched = stats.burst_msgs - stats.coalesced_msgs;
+  out->issued_per_event = dispatched ? ((double) stats.bus_issued / dispatched) : 0;
+  out->elided_per_event = dispatched ? ((double) stats.bus_elided / dispatched) : 0;
+
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    const opl_latency_hist_t* hist = &stats.latency[OPL_SRC_DIN][STAGES[s]];
+    out->pct[s][0] = percentile(hist, 0.5);
+    out->pct[s][1] = percentile(hist, 0.9);
+    out->pct[s][2] = percentile(hist, 0.99);
+  }
+
+  return true;
+}
+
+static void print_result(FILE* file, const bench_result_t* r) {
+  fprintf(file, "%s %u %.0f %.3f %.3f", r->name, r->events, r->events_per_s, r->issued_per_event, r->elided_per_event);
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    fprintf(file, " %u %u %u", r->pct[s][0], r->pct[s][1], r->pct[s][2]);
+  }
+
+  fprintf(file, "\n");
+}
+
+static void print_header(FILE* file) {
+  fprintf(file, "# scenario events events/cpu_s issued/dispatched elided/dispatched");
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    fprintf(file, " %s_p50/p90/p99_us", STAGE_NAMES[s]);
+  }
+
+  fprintf(file, "\n");
+}
+
+static bool parse_result(const char* line, bench_result_t* r) {
+  memset(r, 0, sizeof(*r));
+  return sscanf(line, "%31s %u %lf %lf %lf %u %u %u %u %u %u %u %u %u", r->name, &r->events, &r->events_per_s,
+    &r->issued_per_event, &r->elided_per_event, &r->pct[0][0], &r->pct[0][1], &r->pct[0][2], &r->pct[1][0],
+    &r->pct[1][1], &r->pct[1][2], &r->pct[2][0], &r->pct[2][1], &r->pct[2][2]) == 14;
+}
+
+// Compares against the baseline scenarios of the same name, returns the number of regressions
+static int check(const char* path, const bench_result_t* results, int count) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return 1;
+  }
+
+  char line[256];
+  int regressions = 0;
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    bench_result_t base;
+    if ((line[0] == '#') || !parse_result(line, &base)) {
+      continue;
+    }
+
+    const bench_result_t* r = NULL;
+    for (int i = 0; i < count; i++) {
+      if (strcmp(results[i].name, base.name) == 0) {
+        r = &results[i];
+      }
+    }
+
+    if (r == NULL) {
+      continue;
+    }
+
+    double writes_diff = r->issued_per_event - base.issued_per_event;
+    if ((writes_diff > base.issued_per_event * CHECK_WRITES_TOLERANCE) ||
+        (-writes_diff > base.issued_per_event * CHECK_WRITES_TOLERANCE)) {
+      printf("REGRESSION %s: %.3f writes/event, baseline %.3f\n", r->name, r->issued_per_event, base.issued_per_event);
+      regressions++;
+    }
+
+    if (lockstep) {
+      continue;
+    }
+
+    if (r->events_per_s < base.events_per_s * CHECK_MIN_RATE) {
+      printf("REGRESSION %s: %.0f events/s, baseline %.0f\n", r->name, r->events_per_s, base.events_per_s);
+      regressions++;
+    }
+
+    for (int s = 0; s < STAGE_COUNT; s++) {
+      uint32_t max_p99 = base.pct[s][2] * CHECK_MAX_P99;
+      if (r->pct[s][2] > ((max_p99 > CHECK_P99_FLOOR_US) ? max_p99 : CHECK_P99_FLOOR_US)) {
+        printf("REGRESSION %s: %s p99 %u us, baseline %u us\n", r->name, STAGE_NAMES[s], r->pct[s][2], base.pct[s][2]);
+        regressions++;
+      }
+    }
+  }
+
+  fclose(file);
+  return regressions;
+}
+
+static void seed_programs() {
+  static synth_prg_dump_t prgs[BENCH_PRG_COUNT];
+  static const uint8_t DRUM_NOTES[DRUMKIT_SIZE] = { 36, 60, 48, 72, 84, 55 };
+
+  for (int i = 0; i < BENCH_PRG_COUNT; i++) {
+    synth_prg_dump_t* d = &prgs[i];
+    uint8_t* raw = (uint8_t*) &d->prg;
+
+    for (int b = 0; b < sizeof(opl_program_t); b++) {
+      raw[b] = lcg_next(256);
+    }
+
+    d->bank_num = 0;
+    d->prg_num = i;
+    d->prg.ver = PROGRAM_VER;
+    snprintf(d->prg.name, PROGRAM_MAX_NAME_LEN, "bench %d", i);
+    d->prg.config.map = (i & 1) ? KEYBOARD_2OPS : KEYBOARD_4OPS;
+    memcpy(d->prg.drumkit_notes, DRUM_NOTES, DRUMKIT_SIZE);
+    memset(&d->prg.tuning, 0, sizeof(d->prg.tuning));
+  }
+
+  ESP_ERROR_CHECK(synth_prg_import(prgs, BENCH_PRG_COUNT));
+}
+
+int main(int argc, char** argv) {
+  const char* raw_paths[BENCH_SCENARIO_MAX];
+  int raw_count = 0;
+  const char* baseline_out = NULL;
+  const char* baseline_in = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--lockstep") == 0) {
+      lockstep = true;
+    } else if ((strcmp(argv[i], "--raw") == 0) && (i + 1 < argc) && (raw_count < BENCH_SCENARIO_MAX)) {
+      raw_paths[raw_count++] = argv[++i];
+    } else if ((strcmp(argv[i], "--write-baseline") == 0) && (i + 1 < argc)) {
+      baseline_out = argv[++i];
+    } else if ((strcmp(argv[i], "--check") == 0) && (i + 1 < argc)) {
+      baseline_in = argv[++i];
+    } else {
+      fprintf(stderr, "usage: %s [--lockstep] [--raw FILE]... [--write-baseline FILE] [--check FILE]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  unlink(BENCH_NVS_PATH);
+  host_nvs_set_path(BENCH_NVS_PATH);
+  lcg_state = BENCH_SEED;
+
+  synth_init();
+  seed_programs();
+  opl_srv_start();
+  // lets every part load its first program
+  vTaskDelay(pdMS_TO_TICKS(100));
+
+  bench_result_t results[BENCH_SCENARIO_MAX];
+  int count = 0;
+  int scenario_count = raw_count ? raw_count : (int) (sizeof(SCENARIOS) / sizeof(SCENARIOS[0]));
+
+  print_header(stdout);
+
+  for (int i = 0; i < scenario_count; i++) {
+    const char* name;
+    stream.count = 0;
+
+    if (raw_count) {
+      name = strrchr(raw_paths[i], '/') ? (strrchr(raw_paths[i], '/') + 1) : raw_paths[i];
+      if (!load_raw(raw_paths[i])) {
+        return 1;
+      }
+    } else {
+      name = SCENARIOS[i].name;
+      SCENARIOS[i].gen();
+    }
+
+    if (!run(name, &results[count])) {
+      return 1;
+    }
+
+    print_result(stdout, &results[count++]);
+  }
+
+  if (baseline_out != NULL) {
+    FILE* file = fopen(baseline_out, "w");
+    if (file == NULL) {
+      perror(baseline_out);
+      return 1;
+    }
+
+    print_header(file);
+    for (int i = 0; i < count; i++) {
+      print_result(file, &results[i]);
+    }
+
+    fclose(file);
+  }
+
+  if ((baseline_in != NULL) && (check(baseline_in, results, count) > 0)) {
+    return 1;
+  }
+
+  return 0;
+}
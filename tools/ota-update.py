@@ -1,7 +1,9 @@
+import argparse
 import asyncio
 import datetime
-import sys
+import zlib
 from bleak import BleakClient, BleakScanner
+from ota_delta import make_patch
 
 
 OTA_DATA_UUID = '23408888-1F40-4CD8-9B89-CA8D45F8A5B0'
@@ -14,6 +16,22 @@ SVR_CHR_OTA_CONTROL_REQUEST_NAK = bytearray.fromhex("03")
 SVR_CHR_OTA_CONTROL_DONE = bytearray.fromhex("04")
 SVR_CHR_OTA_CONTROL_DONE_ACK = bytearray.fromhex("05")
 SVR_CHR_OTA_CONTROL_DONE_NAK = bytearray.fromhex("06")
+SVR_CHR_OTA_CONTROL_REQUEST_STREAM = 0x07
+SVR_CHR_OTA_CONTROL_DATA_ACK = 0x08
+SVR_CHR_OTA_CONTROL_DATA_NAK = 0x09
+
+OTA_STREAM_ZLIB = 0x01
+OTA_STREAM_DELTA = 0x02
+# the device inflates into a window of this size, see OTA_SRV_INFLATE_WINDOW_BITS
+OTA_INFLATE_WINDOW_BITS = 13
+
+# packets in flight before waiting for an ack, the device acks every 8 packets. Its 4 flash blocks of 4 KB hold about
+# a window of uncompressed packets; when the writer is behind, the device NAKs the next packet instead of stalling and
+# the window starts over from it.
+STREAM_WINDOW = 32
+STREAM_ACK_TIMEOUT = 2.0
+# pause before resending after a second NAK at the same packet, the device is still writing flash
+STREAM_BUSY_DELAY = 0.02
 
 
 async def _search_for_device():
@@ -34,16 +52,148 @@ async def _search_for_device():
     return dev
 
 
-async def send_ota(file_path):
+def _print_throughput(size, t0):
+    dt = datetime.datetime.now() - t0
+    rate = size / dt.total_seconds() / 1024
+    print(f"OTA successful! Total time: {dt}, {size} bytes, {rate:.1f} KiB/s")
+
+
+async def _send_legacy(client, file_path, queue):
+    firmware = []
+
+    # compute the packet size
+    packet_size = (client.mtu_size - 3)
+
+    # write the packet size to OTA Data
+    print(f"Sending packet size: {packet_size}.")
+    await client.write_gatt_char(
+        OTA_DATA_UUID,
+        packet_size.to_bytes(2, 'little'),
+        response=True
+    )
+
+    # split the firmware into packets
+    with open(file_path, "rb") as file:
+        while chunk := file.read(packet_size):
+            firmware.append(chunk)
+
+    # write the request OP code to OTA Control
+    print("Sending OTA request.")
+    await client.write_gatt_char(
+        OTA_CONTROL_UUID,
+        SVR_CHR_OTA_CONTROL_REQUEST
+    )
+
+    # wait for the response
+    await asyncio.sleep(1)
+    if await queue.get() != "ack":
+        print("SynthOPL did not acknowledge the OTA request.")
+        return None
+
+    # sequentially write all packets to OTA data
+    for i, pkg in enumerate(firmware):
+        print(f"Sending packet {i+1}/{len(firmware)}.")
+        await client.write_gatt_char(
+            OTA_DATA_UUID,
+            pkg,
+            response=True
+        )
+
+    # write done OP code to OTA Control
+    print("Sending OTA done.")
+    await client.write_gatt_char(
+        OTA_CONTROL_UUID,
+        SVR_CHR_OTA_CONTROL_DONE
+    )
+
+    return sum(len(pkg) for pkg in firmware)
+
+
+def _compress(image):
+    compressor = zlib.compressobj(9, zlib.DEFLATED, OTA_INFLATE_WINDOW_BITS)
+    return compressor.compress(image) + compressor.flush()
+
+
+async def _send_stream(client, image, flags, queue, acks):
+    # 3 bytes of ATT header and 2 of sequence number
+    packet_size = (client.mtu_size - 5)
+    packets = [image[i:i + packet_size] for i in range(0, len(image), packet_size)]
+
+    print(f"Sending OTA stream request: {len(image)} bytes in {len(packets)} packets.")
+    await client.write_gatt_char(
+        OTA_CONTROL_UUID,
+        bytes([SVR_CHR_OTA_CONTROL_REQUEST_STREAM]) + len(image).to_bytes(4, 'little') + bytes([flags]),
+        response=True
+    )
+
+    if await queue.get() != "ack":
+        print("SynthOPL did not acknowledge the OTA request.")
+        return None
+
+    base = 0
+    sent = 0
+    resent = 0
+    last_nak = None
+
+    while base < len(packets):
+        while sent < len(packets) and (sent - base) < STREAM_WINDOW:
+            await client.write_gatt_char(
+                OTA_DATA_UUID,
+                (sent & 0xffff).to_bytes(2, 'little') + packets[sent],
+                response=False
+            )
+            sent += 1
+
+        try:
+            kind, seq = await asyncio.wait_for(acks.get(), STREAM_ACK_TIMEOUT)
+        except asyncio.TimeoutError:
+            # the tail of the window or its ack was lost, go back to the last acked packet
+            resent += sent - base
+            sent = base
+            continue
+
+        # sequence numbers are 16 bit, the window keeps them unambiguous
+        pos = base + ((seq - base) & 0xffff)
+
+        if kind == "nak":
+            if pos == last_nak:
+                await asyncio.sleep(STREAM_BUSY_DELAY)
+            last_nak = pos
+            resent += sent - pos
+            base = pos
+            sent = pos
+        elif pos > base:
+            base = pos
+
+        print(f"Acknowledged {base}/{len(packets)} packets.", end="\r")
+
+    print()
+    if resent:
+        print(f"Resent {resent} packets.")
+
+    print("Sending OTA done.")
+    await client.write_gatt_char(
+        OTA_CONTROL_UUID,
+        bytes([SVR_CHR_OTA_CONTROL_DONE[0]]) + zlib.crc32(image).to_bytes(4, 'little'),
+        response=True
+    )
+
+    return len(image)
+
+
+async def send_ota(file_path, legacy, compress, running_path):
     t0 = datetime.datetime.now()
     queue = asyncio.Queue()
-    firmware = []
+    acks = asyncio.Queue()
 
     dev = await _search_for_device()
     async with BleakClient(dev) as client:
 
         async def _ota_notification_handler(sender: int, data: bytearray):
-            if data == SVR_CHR_OTA_CONTROL_REQUEST_ACK:
+            if data[0] in (SVR_CHR_OTA_CONTROL_DATA_ACK, SVR_CHR_OTA_CONTROL_DATA_NAK) and len(data) == 3:
+                kind = "ack" if data[0] == SVR_CHR_OTA_CONTROL_DATA_ACK else "nak"
+                await acks.put((kind, int.from_bytes(data[1:3], 'little')))
+            elif data == SVR_CHR_OTA_CONTROL_REQUEST_ACK:
                 print("SynthOPL: OTA request acknowledged.")
                 await queue.put("ack")
             elif data == SVR_CHR_OTA_CONTROL_REQUEST_NAK:
@@ -67,60 +217,46 @@ async def send_ota(file_path):
             _ota_notification_handler
         )
 
-        # compute the packet size
-        packet_size = (client.mtu_size - 3)
-
-        # write the packet size to OTA Data
-        print(f"Sending packet size: {packet_size}.")
-        await client.write_gatt_char(
-            OTA_DATA_UUID,
-            packet_size.to_bytes(2, 'little'),
-            response=True
-        )
+        if legacy:
+            size = await _send_legacy(client, file_path, queue)
+        else:
+            with open(file_path, "rb") as file:
+                image = file.read()
 
-        # split the firmware into packets
-        with open(file_path, "rb") as file:
-            while chunk := file.read(packet_size):
-                firmware.append(chunk)
+            flags = 0
+            stream = image
 
-        # write the request OP code to OTA Control
-        print("Sending OTA request.")
-        await client.write_gatt_char(
-            OTA_CONTROL_UUID,
-            SVR_CHR_OTA_CONTROL_REQUEST
-        )
+            if running_path:
+                with open(running_path, "rb") as file:
+                    stream = make_patch(file.read(), image)
+                flags |= OTA_STREAM_DELTA
+                print(f"Patch against {running_path} is {len(stream)} bytes.")
 
-        # wait for the response
-        await asyncio.sleep(1)
-        if await queue.get() == "ack":
+            if compress:
+                size = len(stream)
+                stream = _compress(stream)
+                flags |= OTA_STREAM_ZLIB
+                print(f"Compressed {size} bytes to {len(stream)} ({100 * len(stream) / size:.0f}%).")
 
-            # sequentially write all packets to OTA data
-            for i, pkg in enumerate(firmware):
-                print(f"Sending packet {i+1}/{len(firmware)}.")
-                await client.write_gatt_char(
-                    OTA_DATA_UUID,
-                    pkg,
-                    response=True
-                )
-
-            # write done OP code to OTA Control
-            print("Sending OTA done.")
-            await client.write_gatt_char(
-                OTA_CONTROL_UUID,
-                SVR_CHR_OTA_CONTROL_DONE
-            )
+            # throughput is reported in image bytes
+            size = await _send_stream(client, stream, flags, queue, acks) and len(image)
 
-            # wait for the response
-            await asyncio.sleep(1)
-            if await queue.get() == "ack":
-                dt = datetime.datetime.now() - t0
-                print(f"OTA successful! Total time: {dt}")
-            else:
-                print("OTA failed.")
+        if size is None:
+            return
 
+        # wait for the response
+        if await queue.get() == "ack":
+            _print_throughput(size, t0)
         else:
-            print("SynthOPL did not acknowledge the OTA request.")
+            print("OTA failed.")
 
 
 if __name__ == '__main__':
-    asyncio.run(send_ota(sys.argv[1]))
+    parser = argparse.ArgumentParser(description="Update the SynthOPL firmware over BLE")
+    parser.add_argument("firmware", help="application image (.bin)")
+    parser.add_argument("--legacy", action="store_true", help="one acknowledged write per packet, for older firmware")
+    parser.add_argument("--no-compress", action="store_true", help="send the image as is, for firmware without inflate support")
+    parser.add_argument("--delta", metavar="RUNNING", help="send a patch against RUNNING, the image the device runs now")
+    args = parser.parse_args()
+
+    asyncio.run(send_ota(args.firmware, args.legacy, not args.no_compress, args.delta))
@@ -0,0 +1,183 @@
+"""Binary patches between firmware images, for delta OTA updates.
+
+The patch format is the one main/ota_patch.c applies against the running partition:
+    "OPD1", image size (u32), SHA-256 of the image
+    records: END 0 / COPY 1, offset (u32), length (u32) / ADD 2, length (u32), bytes
+
+    python3 ota_delta.py diff running.bin new.bin patch.bin
+    python3 ota_delta.py apply running.bin patch.bin out.bin
+    python3 ota_delta.py check running.bin new.bin
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+
+PATCH_MAGIC = b"OPD1"
+OP_END = 0
+OP_COPY = 1
+OP_ADD = 2
+
+# matches are looked up by this many bytes and a COPY record costs 9 bytes
+MATCH_KEY = 16
+MIN_COPY = 24
+
+
+def _index(old):
+    index = {}
+    for i in range(len(old) - MATCH_KEY + 1):
+        index.setdefault(old[i:i + MATCH_KEY], i)
+    return index
+
+
+def make_patch(old, new):
+    index = _index(old)
+    out = bytearray(PATCH_MAGIC + struct.pack("<I", len(new)) + hashlib.sha256(new).digest())
+
+    def add(start, end):
+        if end > start:
+            out.extend(struct.pack("<BI", OP_ADD, end - start))
+            out.extend(new[start:end])
+
+    literal = 0
+    last = None
+    j = 0
+
+    while j + MATCH_KEY <= len(new):
+        key = new[j:j + MATCH_KEY]
+
+        # code that only moved keeps matching right after the previous copy
+        if last is not None and old[last:last + MATCH_KEY] == key:
+            src = last
+        else:
+            src = index.get(key)
+
+        if src is None:
+            j += 1
+            continue
+
+        n = MATCH_KEY
+        while j + n < len(new) and src + n < len(old) and new[j + n] == old[src + n]:
+            n += 1
+
+        back = 0
+        while j - back > literal and src - back > 0 and new[j - back - 1] == old[src - back - 1]:
+            back += 1
+
+        if n + back < MIN_COPY:
+            j += 1
+            continue
+
+        add(literal, j - back)
+        out.extend(struct.pack("<BII", OP_COPY, src - back, n + back))
+        j += n
+        literal = j
+        last = src + n
+
+    add(literal, len(new))
+    out.append(OP_END)
+
+    return bytes(out)
+
+
+def _field(patch, pos, fmt):
+    # a patch cut short fails like any other broken one
+    if pos + struct.calcsize(fmt) > len(patch):
+        raise ValueError(f"patch truncated at {len(patch)} bytes")
+    return struct.unpack_from(fmt, patch, pos)
+
+
+def apply_patch(old, patch):
+    if patch[:4] != PATCH_MAGIC:
+        raise ValueError("not a patch")
+
+    size, = _field(patch, 4, "<I")
+    digest, = _field(patch, 8, "<32s")
+    out = bytearray()
+    pos = 40
+
+    while True:
+        op, = _field(patch, pos, "<B")
+        pos += 1
+
+        if op == OP_END:
+            break
+        elif op == OP_COPY:
+            offset, length = _field(patch, pos, "<II")
+            pos += 8
+            if offset + length > len(old):
+                raise ValueError(f"copy of {length} bytes at {offset} out of range")
+            out.extend(old[offset:offset + length])
+        elif op == OP_ADD:
+            length, = _field(patch, pos, "<I")
+            pos += 4
+            if pos + length > len(patch):
+                raise ValueError(f"patch truncated at {len(patch)} bytes")
+            out.extend(patch[pos:pos + length])
+            pos += length
+        else:
+            raise ValueError(f"unknown op {op}")
+
+        if len(out) > size:
+            raise ValueError("patch writes past the image")
+
+    if pos != len(patch):
+        raise ValueError("data after the end of the patch")
+    if len(out) != size or hashlib.sha256(out).digest() != digest:
+        raise ValueError("patched image does not match")
+
+    return bytes(out)
+
+
+def _read(path):
+    with open(path, "rb") as file:
+        return file.read()
+
+
+def _write(path, data):
+    with open(path, "wb") as file:
+        file.write(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Delta OTA patches")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    diff = sub.add_parser("diff", help="write the patch from the running image to the new one")
+    diff.add_argument("old")
+    diff.add_argument("new")
+    diff.add_argument("patch")
+
+    apply = sub.add_parser("apply", help="rebuild the new image from the running one and a patch")
+    apply.add_argument("old")
+    apply.add_argument("patch")
+    apply.add_argument("out")
+
+    check = sub.add_parser("check", help="diff, apply and compare")
+    check.add_argument("old")
+    check.add_argument("new")
+
+    args = parser.parse_args()
+
+    if args.cmd == "diff":
+        _write(args.patch, make_patch(_read(args.old), _read(args.new)))
+    elif args.cmd == "apply":
+        _write(args.out, apply_patch(_read(args.old), _read(args.patch)))
+    else:
+        old = _read(args.old)
+        new = _read(args.new)
+        patch = make_patch(old, new)
+
+        if apply_patch(old, patch) != new:
+            print("FAILED: patched image differs")
+            return 1
+
+        print(f"OK: {len(new)} bytes image, {len(patch)} bytes patch ({100 * len(patch) / max(len(new), 1):.1f}%)")
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,130 @@
+"""Tests of the delta OTA patches on generated images.
+
+Patches made by ota_delta.py are applied by apply_patch and, when OTA_PATCH_APPLY names the ota_patch_apply binary of
+the host build, by the patch reader of the device. Broken patches must be rejected by both.
+
+    python3 ota_delta_test.py
+    OTA_PATCH_APPLY=build_host/ota_patch_apply python3 ota_delta_test.py
+"""
+
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import ota_delta  # noqa: E402
+
+
+SEED = 0x0da7a
+IMAGE_SIZE = 64 * 1024
+DEVICE_APPLY = os.environ.get("OTA_PATCH_APPLY")
+
+
+def _image(rng, size):
+    # firmware like: runs of code mixed with padding and repeated tables
+    out = bytearray()
+    while len(out) < size:
+        kind = rng.randrange(3)
+        n = rng.randrange(64, 2048)
+        if kind == 0:
+            out.extend(rng.randbytes(n))
+        elif kind == 1:
+            out.extend(b"\xff" * n)
+        else:
+            out.extend(bytes(range(256)) * (n // 256 + 1))
+    return bytes(out[:size])
+
+
+def _device_apply(old, patch):
+    """Image rebuilt by the device patch reader, None when it rejects the patch"""
+    with tempfile.TemporaryDirectory() as tmp:
+        paths = [os.path.join(tmp, name) for name in ("old.bin", "patch.bin", "out.bin")]
+        for path, data in zip(paths, (old, patch)):
+            with open(path, "wb") as file:
+                file.write(data)
+
+        result = subprocess.run([DEVICE_APPLY] + paths, capture_output=True)
+        if result.returncode == 1:
+            return None
+        if result.returncode != 0:
+            raise RuntimeError(result.stderr.decode())
+
+        with open(paths[2], "rb") as file:
+            return file.read()
+
+
+class PatchTest(unittest.TestCase):
+    def setUp(self):
+        self.rng = random.Random(SEED)
+        self.old = _image(self.rng, IMAGE_SIZE)
+
+    def check_roundtrip(self, new, max_ratio=None):
+        patch = ota_delta.make_patch(self.old, new)
+        self.assertEqual(ota_delta.apply_patch(self.old, patch), new)
+
+        if max_ratio is not None:
+            self.assertLess(len(patch), len(new) * max_ratio)
+
+        if DEVICE_APPLY:
+            self.assertEqual(_device_apply(self.old, patch), new)
+
+        return patch
+
+    def check_rejected(self, patch):
+        with self.assertRaises(ValueError):
+            ota_delta.apply_patch(self.old, patch)
+
+        if DEVICE_APPLY:
+            out = _device_apply(self.old, patch)
+            # the device checks the hash of what it wrote at DONE, a rebuilt image may only get past it when it is right
+            if out is not None:
+                self.assertNotEqual(ota_delta.hashlib.sha256(out).digest(), patch[8:40])
+
+    def test_identical(self):
+        self.check_roundtrip(self.old, max_ratio=0.01)
+
+    def test_shifted(self):
+        new = self.rng.randbytes(100) + self.old[:30000] + self.rng.randbytes(37) + self.old[30000:]
+        self.check_roundtrip(new, max_ratio=0.05)
+
+    def test_random(self):
+        self.check_roundtrip(self.rng.randbytes(IMAGE_SIZE))
+
+    def test_empty(self):
+        self.check_roundtrip(b"")
+
+    def test_truncated(self):
+        new = self.old[:20000] + self.rng.randbytes(3000) + self.old[20000:]
+        patch = self.check_roundtrip(new)
+
+        # in the header, in a COPY record, in an ADD record and right before END
+        for cut in list(range(0, 48)) + [len(patch) // 2, len(patch) - 100, len(patch) - 1]:
+            with self.subTest(cut=cut):
+                self.check_rejected(patch[:cut])
+
+    def test_copy_out_of_range(self):
+        header = ota_delta.PATCH_MAGIC + struct.pack("<I", 16) + bytes(32)
+        for offset, length in ((IMAGE_SIZE, 1), (IMAGE_SIZE - 8, 16), (0xfffffff0, 0x20), (0, 17)):
+            with self.subTest(offset=offset, length=length):
+                self.check_rejected(header + struct.pack("<BII", ota_delta.OP_COPY, offset, length) + bytes([ota_delta.OP_END]))
+
+    def test_data_after_end(self):
+        patch = ota_delta.make_patch(self.old, self.old[1000:])
+        self.check_rejected(patch + b"\x00")
+        self.check_rejected(patch + struct.pack("<BI", ota_delta.OP_ADD, 1) + b"x")
+
+    def test_unknown_op(self):
+        header = ota_delta.PATCH_MAGIC + struct.pack("<I", 0) + bytes(32)
+        self.check_rejected(header + b"\x07")
+
+    def test_not_a_patch(self):
+        self.check_rejected(b"OPD0" + bytes(40))
+
+
+if __name__ == "__main__":
+    unittest.main()